@@ -0,0 +1,749 @@
+// Benchmarks of the ray tracer
+//
+// Runs the intersection and shading kernels on fixed, seeded sets of rays
+// and renders the shipped models. Prints a table and optionally writes the
+// results as JSON, so that runs before and after a change can be compared.
+//
+
+#include "raytracing.h"
+#include "pfm.h"
+#include "ray.h"
+#include "sphere.h"
+#include "box.h"
+#include "triangle.h"
+#include "triangle4.h"
+#include "material.h"
+#include "rng.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+struct Options {
+    std::string models_dir = "3d_models";
+    std::string json_filename;
+    int repetitions = 5;
+    int num_rays = 1 << 16;
+    int width = 500;
+    int height = 500;
+    int samples = 4;
+    int num_threads = 0;
+    bool scaling = false;
+    std::string csv_filename;
+    int max_objects = 1000000;
+    // Convergence benchmark
+    bool convergence = false;
+    std::string mesh_filename;
+    std::string cache_dir = ".";
+    int reference_samples = 1024;
+    double seconds = 10.0;
+    double target_relmse = 0.0;
+    int max_bounces = 1;
+    bool use_packets = true;
+    bool use_simd = true;
+    bool use_wavefront = false;
+    float adaptive_threshold = 0.0f;
+    bool denoise = false;
+};
+
+// Work done by one repetition of a benchmark. The checksum depends on the
+// results of the kernel, so that the compiler cannot drop the work, and
+// should not change between runs unless the results change.
+struct Run {
+    double items;
+    double checksum;
+};
+
+struct Result {
+    std::string name;
+    std::string unit;  // What is counted as an item (test, scatter, ray, sample)
+    double items = 0.0;
+    double checksum = 0.0;
+    std::vector<double> seconds;
+
+    double nsPerItem(int i) const { return seconds[i] * 1e9 / items; }
+    double meanNsPerItem() const
+    {
+        double sum = 0.0;
+        for (std::size_t i = 0; i < seconds.size(); ++i) sum += nsPerItem(i);
+        return sum / seconds.size();
+    }
+    double varianceNsPerItem() const
+    {
+        if (seconds.size() < 2) return 0.0;
+        double mean = meanNsPerItem();
+        double sum = 0.0;
+        for (std::size_t i = 0; i < seconds.size(); ++i) {
+            sum += (nsPerItem(i) - mean) * (nsPerItem(i) - mean);
+        }
+        return sum / (seconds.size() - 1);
+    }
+    double minNsPerItem() const
+    {
+        double min_ns = nsPerItem(0);
+        for (std::size_t i = 1; i < seconds.size(); ++i) min_ns = std::min(min_ns, nsPerItem(i));
+        return min_ns;
+    }
+    double millionItemsPerSecond() const { return 1e3 / meanNsPerItem(); }
+};
+
+// Runs fn once to warm up caches and then the given number of times
+template <typename Fn>
+Result runBenchmark(const std::string &name, const std::string &unit, int repetitions, Fn fn)
+{
+    Result result;
+    result.name = name;
+    result.unit = unit;
+    fn();
+    for (int i = 0; i < repetitions; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        Run run = fn();
+        auto end = std::chrono::steady_clock::now();
+        result.seconds.push_back(std::chrono::duration<double>(end - start).count());
+        result.items = run.items;
+        result.checksum = run.checksum;
+    }
+
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed
+              << std::setprecision(2) << std::setw(10) << result.meanNsPerItem() << " ns/" << unit
+              << "  +- " << std::setw(6) << std::sqrt(result.varianceNsPerItem())
+              << std::setw(10) << result.millionItemsPerSecond() << " M" << unit << "/s"
+              << std::endl;
+    return result;
+}
+
+glm::vec3 randomVec3(rt::RNG &rng)
+{
+    float x = rng.next();
+    float y = rng.next();
+    float z = rng.next();
+    return glm::vec3(x, y, z) * 2.0f - 1.0f;
+}
+
+// Rays from points on a sphere of radius 3 towards points in [-1, 1]^3, so
+// that a good share of them hit primitives placed around the origin. The
+// same seed always gives the same rays.
+std::vector<rt::Ray> makeRays(int count, std::uint32_t seed)
+{
+    std::vector<rt::Ray> rays;
+    for (int i = 0; i < count; ++i) {
+        rt::RNG rng(std::uint32_t(i), seed);
+        glm::vec3 origin = 3.0f * glm::normalize(randomVec3(rng) + glm::vec3(1e-6f));
+        glm::vec3 target = randomVec3(rng);
+        rays.push_back(rt::Ray(origin, target - origin));
+    }
+    return rays;
+}
+
+const int kNumPrimitives = 16;
+
+// Tests every ray against every primitive, without shrinking t_max, so that
+// all tests do the same work
+template <typename Primitive>
+Run intersectAll(const std::vector<rt::Ray> &rays, const std::vector<Primitive> &primitives)
+{
+    double checksum = 0.0;
+    for (std::size_t i = 0; i < rays.size(); ++i) {
+        for (std::size_t j = 0; j < primitives.size(); ++j) {
+            rt::HitRecord rec;
+            if (primitives[j].hit(rays[i], 0.001f, 1e30f, rec)) checksum += rec.t;
+        }
+    }
+    Run run = { double(rays.size() * primitives.size()), checksum };
+    return run;
+}
+
+// Scatters rays that hit the unit sphere from outside
+Run scatterAll(const rt::Material &mat, const std::vector<rt::Ray> &rays)
+{
+    rt::Sphere sphere(glm::vec3(0.0f), 1.0f);
+    double checksum = 0.0;
+    double count = 0.0;
+    for (std::size_t i = 0; i < rays.size(); ++i) {
+        rt::HitRecord rec;
+        if (!sphere.hit(rays[i], 0.001f, 1e30f, rec)) continue;
+        rt::RNG rng(std::uint32_t(i), 0);
+        glm::vec3 attenuation;
+        rt::Ray scattered;
+        if (rt::scatter(mat, rays[i], rec, attenuation, scattered, rng)) {
+            checksum += scattered.direction().x + scattered.direction().y + scattered.direction().z;
+        }
+        count += 1.0;
+    }
+    Run run = { count, checksum };
+    return run;
+}
+
+std::vector<Result> runKernelBenchmarks(const Options &options)
+{
+    std::vector<Result> results;
+    std::vector<rt::Ray> rays = makeRays(options.num_rays, 1);
+
+    std::vector<rt::Sphere> spheres;
+    std::vector<rt::Box> boxes;
+    std::vector<rt::Triangle> triangles;
+    for (int i = 0; i < kNumPrimitives; ++i) {
+        rt::RNG rng(std::uint32_t(i), 2);
+        glm::vec3 center = 0.5f * randomVec3(rng);
+        spheres.push_back(rt::Sphere(center, 0.3f));
+        boxes.push_back(rt::Box(center, glm::vec3(0.2f, 0.3f, 0.25f)));
+        triangles.push_back(rt::Triangle(center + 0.5f * randomVec3(rng), center + 0.5f * randomVec3(rng),
+                                         center + 0.5f * randomVec3(rng)));
+    }
+    results.push_back(runBenchmark("sphere_hit", "test", options.repetitions,
+                                   [&]() { return intersectAll(rays, spheres); }));
+    results.push_back(runBenchmark("box_hit", "test", options.repetitions,
+                                   [&]() { return intersectAll(rays, boxes); }));
+    results.push_back(runBenchmark("triangle_hit", "test", options.repetitions,
+                                   [&]() { return intersectAll(rays, triangles); }));
+
+    // The same triangles in blocks of four, with the scalar and the
+    // selected SIMD kernel
+    std::vector<rt::TriangleBlock> blocks;
+    rt::packTriangles(triangles.data(), int(triangles.size()), blocks);
+    const char *kernel_name = rt::selectTriangleKernel(true);
+    rt::TriangleKernel kernels[2] = { rt::hitTrianglesScalar, rt::triangleKernel() };
+    std::string kernel_names[2] = { "triangle_blocks_scalar", std::string("triangle_blocks_") + kernel_name };
+    for (int k = 0; k < (kernels[1] == kernels[0] ? 1 : 2); ++k) {
+        rt::TriangleKernel kernel = kernels[k];
+        results.push_back(runBenchmark(kernel_names[k], "test", options.repetitions, [&]() {
+            double checksum = 0.0;
+            for (std::size_t i = 0; i < rays.size(); ++i) {
+                float t_max = 1e30f;
+                int index;
+                if (kernel(blocks.data(), int(blocks.size()), rays[i], 0.001f, t_max, index)) {
+                    checksum += t_max + index;
+                }
+            }
+            Run run = { double(rays.size() * triangles.size()), checksum };
+            return run;
+        }));
+    }
+
+    rt::Material lambertian = rt::lambertian(glm::vec3(0.5f));
+    rt::Material metal = rt::metal(glm::vec3(0.8f), 0.3f);
+    rt::Material dielectric = rt::dielectric(1.5f);
+    results.push_back(runBenchmark("lambertian_scatter", "scatter", options.repetitions,
+                                   [&]() { return scatterAll(lambertian, rays); }));
+    results.push_back(runBenchmark("metal_scatter", "scatter", options.repetitions,
+                                   [&]() { return scatterAll(metal, rays); }));
+    results.push_back(runBenchmark("dielectric_scatter", "scatter", options.repetitions,
+                                   [&]() { return scatterAll(dielectric, rays); }));
+    return results;
+}
+
+std::vector<Result> runSceneBenchmarks(const Options &options)
+{
+    std::vector<Result> results;
+    std::vector<rt::Ray> rays = makeRays(options.num_rays, 3);
+    const char *models[3] = { "bunny", "armadillo", "gargo" };
+    for (int m = 0; m < 3; ++m) {
+        std::string filename = options.models_dir + "/" + models[m] + "_lowpoly.obj";
+        std::ifstream file(filename.c_str());
+        if (!file) {
+            std::cout << "Skipping " << filename << " (not found)" << std::endl;
+            continue;
+        }
+
+        rt::RTContext rtx;
+        rtx.width = options.width;
+        rtx.height = options.height;
+        rtx.num_threads = options.num_threads;
+        rtx.view = glm::lookAt(glm::vec3(0.0f, 0.0f, 2.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+        if (!rt::setupScene(rtx, filename.c_str())) {
+            std::cout << "Skipping " << filename << " (could not be loaded)" << std::endl;
+            continue;
+        }
+
+        results.push_back(runBenchmark(std::string("hit_world_") + models[m], "ray", options.repetitions, [&]() {
+            double checksum = 0.0;
+            for (std::size_t i = 0; i < rays.size(); ++i) {
+                rt::HitRecord rec;
+                if (rt::hit_world(rays[i], 0.001f, 9999.0f, rec)) checksum += rec.t;
+            }
+            Run run = { double(rays.size()), checksum };
+            return run;
+        }));
+
+        // Full frames, with only primary rays when showing normals
+        for (int shaded = 0; shaded < 2; ++shaded) {
+            std::string name = std::string("render_") + models[m] + (shaded ? "_shaded" : "_normals");
+            results.push_back(runBenchmark(name, shaded ? "sample" : "ray", options.repetitions, [&]() {
+                rtx.show_normals = !shaded;
+                rt::resetImage(rtx);
+                rt::renderImage(rtx, options.samples);
+                double checksum = 0.0;
+                for (std::size_t i = 0; i < rtx.image.size(); ++i) {
+                    checksum += rtx.image[i].r + rtx.image[i].g + rtx.image[i].b;
+                }
+                Run run = { double(rtx.width) * rtx.height * options.samples, checksum };
+                return run;
+            }));
+        }
+    }
+    return results;
+}
+
+void writeJSON(const std::string &filename, const Options &options, const std::vector<Result> &results)
+{
+    std::ofstream file(filename.c_str());
+    file << std::setprecision(10);
+    file << "{\n";
+    file << "  \"repetitions\": " << options.repetitions << ",\n";
+    file << "  \"num_rays\": " << options.num_rays << ",\n";
+    file << "  \"width\": " << options.width << ",\n";
+    file << "  \"height\": " << options.height << ",\n";
+    file << "  \"samples\": " << options.samples << ",\n";
+    file << "  \"num_threads\": " << options.num_threads << ",\n";
+    file << "  \"benchmarks\": [\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+        file << "    {\n";
+        file << "      \"name\": \"" << r.name << "\",\n";
+        file << "      \"unit\": \"" << r.unit << "\",\n";
+        file << "      \"items\": " << r.items << ",\n";
+        file << "      \"seconds\": [";
+        for (std::size_t j = 0; j < r.seconds.size(); ++j) {
+            file << (j > 0 ? ", " : "") << r.seconds[j];
+        }
+        file << "],\n";
+        file << "      \"ns_per_item\": " << r.meanNsPerItem() << ",\n";
+        file << "      \"ns_per_item_min\": " << r.minNsPerItem() << ",\n";
+        file << "      \"ns_per_item_variance\": " << r.varianceNsPerItem() << ",\n";
+        file << "      \"mitems_per_second\": " << r.millionItemsPerSecond() << ",\n";
+        file << "      \"checksum\": " << r.checksum << "\n";
+        file << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    file << "  ]\n";
+    file << "}\n";
+}
+
+// One configuration of the scaling sweeps
+struct ScalingRow {
+    std::string sweep;
+    rt::SceneInfo scene;
+    int width;
+    int height;
+    int num_threads;
+    double image_bytes;
+    double mrays_per_second;     // Primary rays only (normals)
+    double msamples_per_second;  // Shaded paths
+};
+
+// Mean time of rendering samples passes over the whole image
+double timeRender(rt::RTContext &rtx, int samples, int repetitions)
+{
+    double seconds = 0.0;
+    for (int i = 0; i < repetitions; ++i) {
+        rt::resetImage(rtx);
+        auto start = std::chrono::steady_clock::now();
+        rt::renderImage(rtx, samples);
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return seconds / repetitions;
+}
+
+ScalingRow measureScaling(const std::string &sweep, const Options &options, const rt::ProceduralScene &desc,
+                          int width, int height, int num_threads)
+{
+    rt::RTContext rtx;
+    rtx.width = width;
+    rtx.height = height;
+    rtx.num_threads = num_threads;
+    rtx.view = glm::lookAt(glm::vec3(0.0f, 0.0f, 2.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    rt::setupProceduralScene(rtx, desc);
+
+    ScalingRow row;
+    row.sweep = sweep;
+    row.scene = rt::sceneInfo();
+    row.width = width;
+    row.height = height;
+    row.num_threads = num_threads;
+    double pixels = double(width) * height;
+    rtx.show_normals = true;
+    row.mrays_per_second = pixels * 1e-6 / timeRender(rtx, 1, options.repetitions);
+    rtx.show_normals = false;
+    row.msamples_per_second = pixels * options.samples * 1e-6 / timeRender(rtx, options.samples, options.repetitions);
+    row.image_bytes = double(rtx.image.size() * sizeof(glm::vec4));
+
+    std::cout << std::left << std::setw(10) << sweep << std::right << std::fixed << std::setprecision(2)
+              << std::setw(9) << row.scene.num_spheres << std::setw(7) << row.scene.num_instances
+              << std::setw(10) << row.scene.num_unique_triangles << std::setw(11)
+              << row.scene.num_instanced_triangles << std::setw(6) << width << "x" << std::setw(5)
+              << std::left << height << std::right << std::setw(4) << num_threads << std::setw(11)
+              << row.scene.setup_ms << std::setw(11) << row.scene.build_ms << std::setw(10)
+              << row.scene.memory_bytes / 1048576.0 << std::setw(10) << row.image_bytes / 1048576.0
+              << std::setw(10) << row.mrays_per_second << std::setw(11) << row.msamples_per_second << std::endl;
+    return row;
+}
+
+int maxThreads()
+{
+#if defined(_OPENMP)
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// Sweeps the number of spheres and mesh instances, the resolution and the
+// number of threads of procedural scenes, one at a time
+std::vector<ScalingRow> runScalingBenchmarks(const Options &options)
+{
+    std::vector<ScalingRow> rows;
+    std::cout << std::left << std::setw(10) << "sweep" << std::right << std::setw(9) << "spheres"
+              << std::setw(7) << "inst" << std::setw(10) << "uniq_tris" << std::setw(11) << "inst_tris"
+              << std::setw(12) << "resolution" << std::setw(4) << "thr" << std::setw(11) << "setup_ms"
+              << std::setw(11) << "build_ms" << std::setw(10) << "scene_MB" << std::setw(10) << "image_MB"
+              << std::setw(10) << "Mrays/s" << std::setw(11) << "Msamples/s" << std::endl;
+
+    // Spheres only
+    for (int n = 100; n <= options.max_objects; n *= 10) {
+        rt::ProceduralScene desc;
+        desc.num_spheres = n;
+        rows.push_back(measureScaling("spheres", options, desc, options.width, options.height, options.num_threads));
+    }
+
+    // Instances of one tessellated sphere of 20480 triangles, so that the
+    // triangles seen by rays grow while the unique triangles stay the same
+    for (int n = 1; n <= std::min(options.max_objects, 10000); n *= 10) {
+        rt::ProceduralScene desc;
+        desc.num_spheres = 0;
+        desc.num_instances = n;
+        desc.mesh_subdivisions = 5;
+        rows.push_back(measureScaling("instanced", options, desc, options.width, options.height, options.num_threads));
+    }
+
+    // The same scenes without instancing, up to about two million triangles
+    for (int n = 1; n <= std::min(options.max_objects, 100); n *= 10) {
+        rt::ProceduralScene desc;
+        desc.num_spheres = 0;
+        desc.num_instances = n;
+        desc.mesh_subdivisions = 5;
+        desc.unique_meshes = true;
+        rows.push_back(measureScaling("unique", options, desc, options.width, options.height, options.num_threads));
+    }
+
+    // Resolution, which mostly stresses the accumulation buffer
+    rt::ProceduralScene mid_scene;
+    mid_scene.num_spheres = std::min(options.max_objects, 10000);
+    for (int size = 256; size <= 2048; size *= 2) {
+        rows.push_back(measureScaling("resolution", options, mid_scene, size, size, options.num_threads));
+    }
+
+    // Threads, in powers of two up to all cores
+    int max_threads = maxThreads();
+    for (int threads = 1; ; threads = std::min(2 * threads, max_threads)) {
+        rows.push_back(measureScaling("threads", options, mid_scene, options.width, options.height, threads));
+        if (threads == max_threads) break;
+    }
+    return rows;
+}
+
+void writeScalingCSV(const std::string &filename, const std::vector<ScalingRow> &rows)
+{
+    std::ofstream file(filename.c_str());
+    file << "sweep,spheres,instances,unique_triangles,instanced_triangles,width,height,threads,"
+         << "setup_ms,build_ms,scene_bytes,image_bytes,mrays_per_second,msamples_per_second\n";
+    file << std::setprecision(10);
+    for (std::size_t i = 0; i < rows.size(); ++i) {
+        const ScalingRow &r = rows[i];
+        file << r.sweep << "," << r.scene.num_spheres << "," << r.scene.num_instances << ","
+             << r.scene.num_unique_triangles << "," << r.scene.num_instanced_triangles << "," << r.width
+             << "," << r.height << "," << r.num_threads << "," << r.scene.setup_ms << ","
+             << r.scene.build_ms << "," << r.scene.memory_bytes << "," << r.image_bytes << ","
+             << r.mrays_per_second << "," << r.msamples_per_second << "\n";
+    }
+}
+
+// Error of the average of an accumulated image against a reference, over
+// all pixels and color channels. The relative MSE divides by the squared
+// reference value (plus a small constant for dark pixels), so that errors
+// in dark and bright parts of the image count about the same.
+struct ImageError {
+    double rmse;
+    double relmse;
+};
+
+ImageError imageError(const std::vector<glm::vec4> &image, const std::vector<glm::vec4> &reference)
+{
+    double squared_error = 0.0;
+    double relative_error = 0.0;
+    for (std::size_t i = 0; i < image.size(); ++i) {
+        float n = glm::max(image[i].a, 1.0f);
+        for (int c = 0; c < 3; ++c) {
+            double r = reference[i][c];
+            double d = image[i][c] / n - r;
+            squared_error += d * d;
+            relative_error += d * d / (r * r + 1e-2);
+        }
+    }
+    double count = 3.0 * image.size();
+    ImageError error = { std::sqrt(squared_error / count), relative_error / count };
+    return error;
+}
+
+// Point of a convergence curve, after a completed pass
+struct ConvergencePoint {
+    double seconds;  // Render time, without the time spent computing errors
+    double samples;  // Mean samples per pixel, which vary with adaptive sampling
+    ImageError error;
+};
+
+// Reference image in the cache, named after the scene, the render settings
+// and rt::kRenderVersion, so that older references are rendered again
+std::string referenceFilename(const Options &options)
+{
+    std::string mesh = options.mesh_filename;
+    std::size_t slash = mesh.find_last_of("/\\");
+    if (slash != std::string::npos) mesh = mesh.substr(slash + 1);
+    std::size_t dot = mesh.find_last_of('.');
+    if (dot != std::string::npos) mesh = mesh.substr(0, dot);
+    return options.cache_dir + "/reference_" + mesh + "_" + std::to_string(options.width) + "x" +
+           std::to_string(options.height) + "_b" + std::to_string(options.max_bounces) + "_" +
+           std::to_string(options.reference_samples) + "spp_v" + std::to_string(rt::kRenderVersion) + ".pfm";
+}
+
+// Renders the scene progressively with updateImage(), as the GUI does, and
+// records the error against a high-spp reference after every pass, of the
+// denoised image if requested, with the denoising in the render time. The
+// reference is rendered with another seed, so that its samples are
+// independent of the measured ones, and cached on disk.
+std::vector<ConvergencePoint> runConvergenceBenchmark(const Options &options)
+{
+    rt::RTContext rtx;
+    rtx.width = options.width;
+    rtx.height = options.height;
+    rtx.num_threads = options.num_threads;
+    rtx.max_bounces = options.max_bounces;
+    rtx.use_packets = options.use_packets;
+    rtx.use_simd = options.use_simd;
+    rtx.use_wavefront = options.use_wavefront;
+    rtx.show_normals = false;
+    rtx.view = glm::lookAt(glm::vec3(0.0f, 0.0f, 2.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    if (!rt::setupScene(rtx, options.mesh_filename.c_str())) return std::vector<ConvergencePoint>();
+
+    std::vector<glm::vec4> reference;
+    std::string reference_filename = referenceFilename(options);
+    int width, height;
+    if (rt::readPFM(reference_filename, width, height, reference) && width == rtx.width &&
+        height == rtx.height) {
+        std::cout << "Loaded reference " << reference_filename << std::endl;
+    }
+    else {
+        std::cout << "Rendering reference at " << options.reference_samples << " spp..." << std::endl;
+        auto start = std::chrono::steady_clock::now();
+        rtx.seed = 1;
+        rt::resetImage(rtx);
+        rt::renderImage(rtx, options.reference_samples);
+        std::cout << "Rendered reference in "
+                  << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s"
+                  << std::endl;
+        if (rt::writePFM(reference_filename, rtx.width, rtx.height, rtx.image)) {
+            std::cout << "Wrote " << reference_filename << std::endl;
+        }
+        rt::readPFM(reference_filename, width, height, reference);
+        if (reference.size() != rtx.image.size()) return std::vector<ConvergencePoint>();
+    }
+
+    std::vector<ConvergencePoint> points;
+    rtx.seed = 0;
+    rtx.adaptive_threshold = options.adaptive_threshold;
+    rtx.max_frames = 1 << 20;
+    rt::resetImage(rtx);
+    double seconds = 0.0;
+    std::cout << std::setw(10) << "seconds" << std::setw(8) << "spp" << std::setw(12) << "RMSE"
+              << std::setw(12) << "relMSE" << std::endl;
+    while (seconds < options.seconds && rtx.current_frame < rtx.max_frames && !rtx.converged) {
+        int frame = rtx.current_frame;
+        auto start = std::chrono::steady_clock::now();
+        rt::updateImage(rtx);
+        bool pass_done = rtx.current_frame != frame;
+        if (pass_done && options.denoise) rt::denoiseImage(rtx);
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (!pass_done) continue;
+
+        double num_samples = 0.0;
+        for (std::size_t i = 0; i < rtx.image.size(); ++i) num_samples += rtx.image[i].a;
+        ConvergencePoint point = { seconds, num_samples / rtx.image.size(),
+                                   imageError(options.denoise ? rtx.denoised : rtx.image, reference) };
+        points.push_back(point);
+        std::cout << std::fixed << std::setprecision(3) << std::setw(10) << point.seconds << std::setprecision(1)
+                  << std::setw(8) << point.samples << std::scientific << std::setprecision(4) << std::setw(12)
+                  << point.error.rmse << std::setw(12) << point.error.relmse << std::endl;
+        if (point.error.relmse <= options.target_relmse) {
+            std::cout << std::fixed << "Reached relMSE " << options.target_relmse << " in " << point.seconds
+                      << " s" << std::endl;
+            break;
+        }
+    }
+    return points;
+}
+
+void writeConvergenceCSV(const std::string &filename, const std::vector<ConvergencePoint> &points)
+{
+    std::ofstream file(filename.c_str());
+    file << "seconds,samples,rmse,relmse\n";
+    file << std::setprecision(10);
+    for (std::size_t i = 0; i < points.size(); ++i) {
+        file << points[i].seconds << "," << points[i].samples << "," << points[i].error.rmse << ","
+             << points[i].error.relmse << "\n";
+    }
+}
+
+void printUsage(const char *program)
+{
+    std::cout << "Usage: " << program << " [options]\n"
+              << "  -m, --models DIR    directory with the shipped models (default 3d_models)\n"
+              << "  -j, --json FILE     write the results as JSON\n"
+              << "  -r, --reps N        repetitions of each benchmark (default 5)\n"
+              << "  -n, --rays N        rays in the kernel ray sets (default 65536)\n"
+              << "  -s, --spp N         samples per pixel of the renders (default 4)\n"
+              << "  -t, --threads N     render threads, 0 for all cores (default 0)\n"
+              << "      --scaling       sweep the size of procedural scenes, the resolution and the\n"
+              << "                      number of threads instead\n"
+              << "      --max-objects N largest number of spheres in the scaling sweeps (default 1000000)\n"
+              << "      --csv FILE      write the results of the scaling or convergence benchmark as CSV\n"
+              << "      --convergence   record the error against a reference over render time instead\n"
+              << "      --mesh FILE     mesh of the convergence scene (default MODELS/bunny_lowpoly.obj)\n"
+              << "      --reference-spp N  samples per pixel of the reference (default 1024)\n"
+              << "      --cache DIR     directory of the cached references (default .)\n"
+              << "      --seconds T     render time of the convergence benchmark (default 10)\n"
+              << "      --target-relmse E  stop once the relative MSE is at most E\n"
+              << "  -w, --width N       image width (default 500)\n"
+              << "  -h, --height N      image height (default 500)\n"
+              << "  -b, --bounces N     max bounces (default 1)\n"
+              << "      --no-packets    trace primary rays one at a time\n"
+              << "      --no-simd       use the scalar triangle kernel\n"
+              << "      --wavefront     trace paths in batches per bounce\n"
+              << "      --adaptive E    sample adaptively until the error of each tile, pooled over\n"
+              << "                      its pixels and relative to their mean luminance plus\n"
+              << "                      0.01, is below E\n"
+              << "      --denoise       measure the error of the denoised image" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if ((arg == "-m" || arg == "--models") && has_value) {
+            options.models_dir = argv[++i];
+        }
+        else if ((arg == "-j" || arg == "--json") && has_value) {
+            options.json_filename = argv[++i];
+        }
+        else if ((arg == "-r" || arg == "--reps") && has_value) {
+            options.repetitions = std::max(1, std::atoi(argv[++i]));
+        }
+        else if ((arg == "-n" || arg == "--rays") && has_value) {
+            options.num_rays = std::max(1, std::atoi(argv[++i]));
+        }
+        else if ((arg == "-s" || arg == "--spp") && has_value) {
+            options.samples = std::max(1, std::atoi(argv[++i]));
+        }
+        else if ((arg == "-t" || arg == "--threads") && has_value) {
+            options.num_threads = std::atoi(argv[++i]);
+        }
+        else if (arg == "--scaling") {
+            options.scaling = true;
+        }
+        else if (arg == "--max-objects" && has_value) {
+            options.max_objects = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--csv" && has_value) {
+            options.csv_filename = argv[++i];
+        }
+        else if (arg == "--convergence") {
+            options.convergence = true;
+        }
+        else if (arg == "--mesh" && has_value) {
+            options.mesh_filename = argv[++i];
+        }
+        else if (arg == "--reference-spp" && has_value) {
+            options.reference_samples = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--cache" && has_value) {
+            options.cache_dir = argv[++i];
+        }
+        else if (arg == "--seconds" && has_value) {
+            options.seconds = std::atof(argv[++i]);
+        }
+        else if (arg == "--target-relmse" && has_value) {
+            options.target_relmse = std::atof(argv[++i]);
+        }
+        else if ((arg == "-w" || arg == "--width") && has_value) {
+            options.width = std::max(1, std::atoi(argv[++i]));
+        }
+        else if ((arg == "-h" || arg == "--height") && has_value) {
+            options.height = std::max(1, std::atoi(argv[++i]));
+        }
+        else if ((arg == "-b" || arg == "--bounces") && has_value) {
+            options.max_bounces = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (arg == "--no-packets") {
+            options.use_packets = false;
+        }
+        else if (arg == "--no-simd") {
+            options.use_simd = false;
+        }
+        else if (arg == "--wavefront") {
+            options.use_wavefront = true;
+        }
+        else if (arg == "--adaptive" && has_value) {
+            options.adaptive_threshold = float(std::atof(argv[++i]));
+        }
+        else if (arg == "--denoise") {
+            options.denoise = true;
+        }
+        else {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (options.convergence) {
+        if (options.mesh_filename.empty()) options.mesh_filename = options.models_dir + "/bunny_lowpoly.obj";
+        std::vector<ConvergencePoint> points = runConvergenceBenchmark(options);
+        if (points.empty()) return EXIT_FAILURE;
+        if (!options.csv_filename.empty()) {
+            writeConvergenceCSV(options.csv_filename, points);
+            std::cout << "Wrote " << options.csv_filename << std::endl;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (options.scaling) {
+        std::vector<ScalingRow> rows = runScalingBenchmarks(options);
+        if (!options.csv_filename.empty()) {
+            writeScalingCSV(options.csv_filename, rows);
+            std::cout << "Wrote " << options.csv_filename << std::endl;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    std::vector<Result> results = runKernelBenchmarks(options);
+    std::vector<Result> scene_results = runSceneBenchmarks(options);
+    results.insert(results.end(), scene_results.begin(), scene_results.end());
+
+    if (!options.json_filename.empty()) {
+        writeJSON(options.json_filename, options, results);
+        std::cout << "Wrote " << options.json_filename << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
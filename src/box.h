@@ -7,16 +7,18 @@ namespace rt {
 class Box: public Hitable {
 public:
     Box() {}
-    Box(const glm::vec3 &cen, const glm::vec3 r) : center(cen), radius(r) {};
+    Box(const glm::vec3 &cen, const glm::vec3 r) : center(cen), radius(r), material_id(0) {};
+    Box(const glm::vec3 &cen, const glm::vec3 r, MaterialID mat) : center(cen), radius(r), material_id(mat) {};
     virtual bool hit(const Ray &r, float t_min, float t_max, HitRecord &rec) const;
 
     glm::vec3 center;
     glm::vec3 radius;
+    MaterialID material_id;
 };
 
 // Ray-box test adapted from branchless code at
 // https://tavianator.com/fast-branchless-raybounding-box-intersections/
-bool Box::hit(const Ray &r, float t_min, float t_max, HitRecord &rec) const
+inline bool Box::hit(const Ray &r, float t_min, float t_max, HitRecord &rec) const
 {
     glm::vec3 oc = r.origin() - center;
     glm::vec3 t0 = (-radius - oc) / r.direction();
@@ -29,6 +31,7 @@ bool Box::hit(const Ray &r, float t_min, float t_max, HitRecord &rec) const
         rec.p = r.point_at_parameter(rec.t);
         glm::vec3 npc = (rec.p - center) / radius;
         rec.normal = glm::sign(npc) * glm::step(glm::compMax(glm::abs(npc)), glm::abs(npc));
+        rec.material_id = material_id;
         return true;
     }
     return false;
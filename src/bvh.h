@@ -0,0 +1,621 @@
+#pragma once
+
+#include "ray.h"
+#include "packet.h"
+#include "raytracing.h"
+#include "stats.h"
+
+#include <glm/gtx/component_wise.hpp>
+
+#include <vector>
+#include <cstdint>
+#include <cfloat>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+namespace rt {
+
+// Axis-aligned bounding box used for building and traversing the BVH
+struct AABB {
+    glm::vec3 bmin = glm::vec3(FLT_MAX);
+    glm::vec3 bmax = glm::vec3(-FLT_MAX);
+
+    void grow(const glm::vec3 &p) { bmin = glm::min(bmin, p); bmax = glm::max(bmax, p); }
+    void grow(const AABB &b) { bmin = glm::min(bmin, b.bmin); bmax = glm::max(bmax, b.bmax); }
+    glm::vec3 center() const { return 0.5f * (bmin + bmax); }
+    float area() const
+    {
+        glm::vec3 d = glm::max(bmax - bmin, glm::vec3(0.0f));
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+};
+
+// Node of the flattened BVH. Nodes are stored in depth-first order, so the
+// first child of an interior node always directly follows its parent and
+// only the index of the second child has to be stored.
+struct BVHNode {
+    glm::vec3 bbox_min;
+    std::uint32_t offset;  // Leaf: first primitive slot, interior: second child
+    glm::vec3 bbox_max;
+    std::uint16_t count;   // Number of primitives (zero for interior nodes)
+    std::uint16_t axis;    // Split axis of interior nodes
+};
+
+inline AABB nodeBounds(const BVHNode &node)
+{
+    AABB bounds;
+    bounds.bmin = node.bbox_min;
+    bounds.bmax = node.bbox_max;
+    return bounds;
+}
+
+// Slab test against the box of a BVH node, using the precomputed inverse ray
+// direction. Returns the entry distance in t_entry.
+inline bool hitNode(const BVHNode &node, const glm::vec3 &origin, const glm::vec3 &inv_dir,
+                    float t_min, float t_max, float &t_entry)
+{
+    glm::vec3 t0 = (node.bbox_min - origin) * inv_dir;
+    glm::vec3 t1 = (node.bbox_max - origin) * inv_dir;
+    float tnear = glm::max(t_min, glm::compMax(glm::min(t0, t1)));
+    float tfar = glm::min(t_max, glm::compMin(glm::max(t0, t1)));
+    t_entry = tnear;
+    return tnear <= tfar;
+}
+
+// Build time and quality metrics of a BVH, used for comparing builders. The
+// SAH cost is relative to the surface area of the root node.
+struct BVHStats {
+    double build_ms = 0.0;
+    float sah_cost = 0.0f;
+    int num_nodes = 0;
+    int num_leaves = 0;
+    int max_depth = 0;
+    int min_leaf_size = 0;
+    int max_leaf_size = 0;
+    float avg_leaf_size = 0.0f;
+};
+
+// Bounding volume hierarchy over an arbitrary set of primitives, built with
+// the surface area heuristic (SAH). The BVH only knows about the bounding
+// boxes of the primitives; after building, prim_indices[i] is the original
+// index of the primitive in slot i. Leaves refer to contiguous slot ranges,
+// so callers can reorder their primitives into slot order for better
+// locality.
+class BVH {
+public:
+    // Primitives in leaves are intersected in blocks of block_size, so the
+    // SAH counts the cost of a leaf per started block
+    void build(const std::vector<AABB> &prim_bounds, BVHBuilder builder = BVHBuilder::BinnedSAH,
+               int max_leaf_size = 4, int block_size = 1);
+
+    // Closest-hit traversal. hit_prim(slot, t_min, closest) is called for
+    // every primitive slot in a visited leaf; it should return true and
+    // update closest if the primitive was hit closer than closest.
+    template <typename HitPrim>
+    bool hit(const Ray &r, float t_min, float t_max, HitPrim hit_prim) const;
+
+    // Closest-hit traversal of the rays [first, last] of a packet, with the
+    // current closest distance of each ray in t_max. hit_prim(slot, first,
+    // last) is called for every primitive slot in a visited leaf with the
+    // range of rays that reached it, and should update t_max of the rays.
+    template <typename HitPrim>
+    void hitPacket(const RayPacket &packet, int first, int last, float t_min, float t_max[],
+                   HitPrim hit_prim) const;
+
+    std::vector<BVHNode> nodes;
+    std::vector<std::uint32_t> prim_indices;
+    BVHStats stats;
+
+private:
+    struct BuildRef {
+        AABB bounds;
+        glm::vec3 centroid;
+        std::uint32_t index;
+    };
+    // Temporary node of the binned builder, allocated out of order by
+    // parallel tasks and flattened into depth-first order afterwards
+    struct BuildNode {
+        AABB bounds;
+        std::uint32_t child[2];
+        std::uint32_t begin;
+        std::uint32_t count;
+        std::uint16_t axis;
+    };
+    std::uint32_t buildSweep(std::vector<BuildRef> &refs, int begin, int end, int depth,
+                             std::vector<float> &right_areas);
+    void buildBinned(std::vector<BuildRef> &refs, std::vector<BuildNode> &build_nodes,
+                     std::atomic<std::uint32_t> &next_node, std::uint32_t node_index,
+                     int begin, int end, int depth);
+    static int medianAxis(const std::vector<BuildRef> &refs, int begin, int end);
+    std::uint32_t flatten(const std::vector<BuildNode> &build_nodes, std::uint32_t index);
+    void computeStats();
+    int blocks(int count) const { return (count + block_size_ - 1) / block_size_; }
+    int max_leaf_size_ = 4;
+    int block_size_ = 1;
+};
+
+// Relative costs of traversing a node and intersecting a primitive, used
+// when evaluating the SAH
+const float kSAHTraversalCost = 1.0f;
+const float kSAHIntersectionCost = 1.0f;
+
+// Parameters of the binned builder. Nodes with more primitives than the
+// task threshold build their children as separate OpenMP tasks, and nodes
+// above the chunk size also split binning and bounds computation into tasks.
+const int kNumBins = 32;
+const int kTaskThreshold = 4096;
+const int kChunkSize = 32768;
+
+// Deepest level of a leaf (the root is level 0). The traversal stacks are
+// sized for it, so nodes that could not otherwise stay within it are split
+// at the median instead of by the SAH.
+const int kMaxBVHDepth = 63;
+
+// Whether a node of count primitives at depth has too few levels left for
+// an arbitrary split: a median split needs ceil(log2(count)) of them.
+inline bool needsMedianSplit(int depth, int count)
+{
+    int levels = 0;
+    while ((1LL << levels) < count) ++levels;
+    return depth + levels >= kMaxBVHDepth;
+}
+
+inline void BVH::build(const std::vector<AABB> &prim_bounds, BVHBuilder builder,
+                       int max_leaf_size, int block_size)
+{
+    auto tic = std::chrono::high_resolution_clock::now();
+    max_leaf_size_ = std::max(1, max_leaf_size);
+    block_size_ = std::max(1, block_size);
+    nodes.clear();
+    prim_indices.clear();
+    stats = BVHStats();
+    if (prim_bounds.empty()) return;
+
+    std::vector<BuildRef> refs(prim_bounds.size());
+    for (std::size_t i = 0; i < prim_bounds.size(); ++i) {
+        refs[i].bounds = prim_bounds[i];
+        refs[i].centroid = prim_bounds[i].center();
+        refs[i].index = std::uint32_t(i);
+    }
+
+    nodes.reserve(2 * refs.size());
+    if (builder == BVHBuilder::SweepSAH) {
+        std::vector<float> right_areas(refs.size());
+        buildSweep(refs, 0, int(refs.size()), 0, right_areas);
+    }
+    else {
+        std::vector<BuildNode> build_nodes(2 * refs.size());
+        std::atomic<std::uint32_t> next_node(1);
+        #pragma omp parallel
+        #pragma omp single nowait
+        buildBinned(refs, build_nodes, next_node, 0, 0, int(refs.size()), 0);
+        flatten(build_nodes, 0);
+    }
+
+    prim_indices.resize(refs.size());
+    for (std::size_t i = 0; i < refs.size(); ++i) {
+        prim_indices[i] = refs[i].index;
+    }
+
+    auto toc = std::chrono::high_resolution_clock::now();
+    computeStats();
+    stats.build_ms = std::chrono::duration<double, std::milli>(toc - tic).count();
+}
+
+// Full sweep SAH: for each axis, sort the primitives by centroid and evaluate
+// every possible partition of the sorted list
+inline std::uint32_t BVH::buildSweep(std::vector<BuildRef> &refs, int begin, int end, int depth,
+                                     std::vector<float> &right_areas)
+{
+    std::uint32_t node_index = std::uint32_t(nodes.size());
+    nodes.push_back(BVHNode());
+
+    AABB bounds;
+    for (int i = begin; i < end; ++i) {
+        bounds.grow(refs[i].bounds);
+    }
+    int count = end - begin;
+
+    int best_axis = -1;
+    int best_split = 0;
+    float best_cost = FLT_MAX;
+    float parent_area = bounds.area();
+    if (count > 1 && parent_area > 0.0f) {
+        for (int axis = 0; axis < 3; ++axis) {
+            std::sort(refs.begin() + begin, refs.begin() + end,
+                      [axis](const BuildRef &a, const BuildRef &b) {
+                          return a.centroid[axis] < b.centroid[axis];
+                      });
+            AABB right;
+            for (int i = end - 1; i > begin; --i) {
+                right.grow(refs[i].bounds);
+                right_areas[i] = right.area();
+            }
+            AABB left;
+            for (int i = begin + 1; i < end; ++i) {
+                left.grow(refs[i - 1].bounds);
+                float cost = left.area() * blocks(i - begin) + right_areas[i] * blocks(end - i);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = i;
+                }
+            }
+        }
+        best_cost = kSAHTraversalCost + kSAHIntersectionCost * best_cost / parent_area;
+    }
+
+    float leaf_cost = kSAHIntersectionCost * blocks(count);
+    bool make_leaf = (best_axis < 0) || (count <= max_leaf_size_ && leaf_cost <= best_cost);
+    if (make_leaf && count > max_leaf_size_) {
+        // Degenerate bounds but too many primitives: split in the middle
+        make_leaf = false;
+        best_axis = 0;
+        best_split = begin + count / 2;
+    }
+    if (!make_leaf && needsMedianSplit(depth, count)) {
+        best_axis = medianAxis(refs, begin, end);
+        best_split = begin + count / 2;
+    }
+
+    BVHNode &node = nodes[node_index];
+    node.bbox_min = bounds.bmin;
+    node.bbox_max = bounds.bmax;
+    if (make_leaf) {
+        node.offset = std::uint32_t(begin);
+        node.count = std::uint16_t(count);
+        node.axis = 0;
+        return node_index;
+    }
+
+    // The primitives are sorted along the last axis, re-sort if needed
+    if (best_axis != 2) {
+        std::sort(refs.begin() + begin, refs.begin() + end,
+                  [best_axis](const BuildRef &a, const BuildRef &b) {
+                      return a.centroid[best_axis] < b.centroid[best_axis];
+                  });
+    }
+    buildSweep(refs, begin, best_split, depth + 1, right_areas);
+    std::uint32_t second = buildSweep(refs, best_split, end, depth + 1, right_areas);
+    nodes[node_index].offset = second;
+    nodes[node_index].count = 0;
+    nodes[node_index].axis = std::uint16_t(best_axis);
+    return node_index;
+}
+
+// Runs fn(chunk, begin, end) over num_chunks parts of a primitive range,
+// as parallel tasks when there is more than one chunk
+template <typename ChunkFn>
+void forEachChunk(int begin, int end, int num_chunks, ChunkFn fn)
+{
+    if (num_chunks <= 1) {
+        fn(0, begin, end);
+        return;
+    }
+    for (int c = 0; c < num_chunks; ++c) {
+        int chunk_begin = begin + int((long long)(end - begin) * c / num_chunks);
+        int chunk_end = begin + int((long long)(end - begin) * (c + 1) / num_chunks);
+        #pragma omp task firstprivate(c, chunk_begin, chunk_end) shared(fn)
+        fn(c, chunk_begin, chunk_end);
+    }
+    #pragma omp taskwait
+}
+
+// Primitive counts and bounds of the SAH bins along each axis
+struct BVHBins {
+    AABB bounds[3][kNumBins];
+    int counts[3][kNumBins] = {};
+};
+
+inline int binIndex(const glm::vec3 &centroid, const AABB &centroid_bounds,
+                    const glm::vec3 &scale, int axis)
+{
+    int bin = int((centroid[axis] - centroid_bounds.bmin[axis]) * scale[axis]);
+    return glm::clamp(bin, 0, kNumBins - 1);
+}
+
+// Binned SAH with task-parallel recursion
+inline void BVH::buildBinned(std::vector<BuildRef> &refs, std::vector<BuildNode> &build_nodes,
+                             std::atomic<std::uint32_t> &next_node, std::uint32_t node_index,
+                             int begin, int end, int depth)
+{
+    int count = end - begin;
+    int num_chunks = std::min(64, count / kChunkSize);
+
+    // Bounds of the primitives and of their centroids
+    AABB bounds, centroid_bounds;
+    if (num_chunks <= 1) {
+        for (int i = begin; i < end; ++i) {
+            bounds.grow(refs[i].bounds);
+            centroid_bounds.grow(refs[i].centroid);
+        }
+    }
+    else {
+        std::vector<AABB> chunk_bounds(num_chunks);
+        std::vector<AABB> chunk_centroid_bounds(num_chunks);
+        forEachChunk(begin, end, num_chunks, [&](int c, int b, int e) {
+            for (int i = b; i < e; ++i) {
+                chunk_bounds[c].grow(refs[i].bounds);
+                chunk_centroid_bounds[c].grow(refs[i].centroid);
+            }
+        });
+        for (int c = 0; c < num_chunks; ++c) {
+            bounds.grow(chunk_bounds[c]);
+            centroid_bounds.grow(chunk_centroid_bounds[c]);
+        }
+    }
+
+    // Bin the centroids along all axes and evaluate the SAH at bin boundaries
+    int best_axis = -1;
+    int best_bin = 0;
+    float best_cost = FLT_MAX;
+    glm::vec3 extent = centroid_bounds.bmax - centroid_bounds.bmin;
+    glm::vec3 scale(0.0f);
+    for (int axis = 0; axis < 3; ++axis) {
+        if (extent[axis] > 0.0f) scale[axis] = kNumBins / extent[axis];
+    }
+    float parent_area = bounds.area();
+    if (count > 1 && parent_area > 0.0f) {
+        auto bin_range = [&](BVHBins &bins, int b, int e) {
+            for (int i = b; i < e; ++i) {
+                for (int axis = 0; axis < 3; ++axis) {
+                    int bin = binIndex(refs[i].centroid, centroid_bounds, scale, axis);
+                    bins.counts[axis][bin] += 1;
+                    bins.bounds[axis][bin].grow(refs[i].bounds);
+                }
+            }
+        };
+        BVHBins bins;
+        if (num_chunks <= 1) {
+            bin_range(bins, begin, end);
+        }
+        else {
+            std::vector<BVHBins> chunk_bins(num_chunks);
+            forEachChunk(begin, end, num_chunks, [&](int c, int b, int e) {
+                bin_range(chunk_bins[c], b, e);
+            });
+            for (int c = 0; c < num_chunks; ++c) {
+                for (int axis = 0; axis < 3; ++axis) {
+                    for (int bin = 0; bin < kNumBins; ++bin) {
+                        bins.counts[axis][bin] += chunk_bins[c].counts[axis][bin];
+                        bins.bounds[axis][bin].grow(chunk_bins[c].bounds[axis][bin]);
+                    }
+                }
+            }
+        }
+
+        for (int axis = 0; axis < 3; ++axis) {
+            if (extent[axis] <= 0.0f) continue;
+            float right_areas[kNumBins];
+            int right_counts[kNumBins];
+            AABB right;
+            int right_count = 0;
+            for (int bin = kNumBins - 1; bin > 0; --bin) {
+                right.grow(bins.bounds[axis][bin]);
+                right_count += bins.counts[axis][bin];
+                right_areas[bin] = right.area();
+                right_counts[bin] = right_count;
+            }
+            AABB left;
+            int left_count = 0;
+            for (int bin = 1; bin < kNumBins; ++bin) {
+                left.grow(bins.bounds[axis][bin - 1]);
+                left_count += bins.counts[axis][bin - 1];
+                if (left_count == 0 || right_counts[bin] == 0) continue;
+                float cost = left.area() * blocks(left_count) + right_areas[bin] * blocks(right_counts[bin]);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = bin;
+                }
+            }
+        }
+        best_cost = kSAHTraversalCost + kSAHIntersectionCost * best_cost / parent_area;
+    }
+
+    BuildNode &node = build_nodes[node_index];
+    node.bounds = bounds;
+    float leaf_cost = kSAHIntersectionCost * blocks(count);
+    bool make_leaf = (best_axis < 0) || (count <= max_leaf_size_ && leaf_cost <= best_cost);
+    if (make_leaf && count <= max_leaf_size_) {
+        node.begin = std::uint32_t(begin);
+        node.count = std::uint32_t(count);
+        node.axis = 0;
+        return;
+    }
+
+    int mid;
+    if (needsMedianSplit(depth, count)) {
+        best_axis = medianAxis(refs, begin, end);
+        mid = begin + count / 2;
+        std::nth_element(refs.begin() + begin, refs.begin() + mid, refs.begin() + end,
+                         [best_axis](const BuildRef &a, const BuildRef &b) {
+                             return a.centroid[best_axis] < b.centroid[best_axis];
+                         });
+    }
+    else if (!make_leaf) {
+        mid = int(std::partition(refs.begin() + begin, refs.begin() + end,
+                                 [&](const BuildRef &ref) {
+                                     return binIndex(ref.centroid, centroid_bounds, scale, best_axis) < best_bin;
+                                 }) - refs.begin());
+    }
+    else {
+        // Coincident centroids but too many primitives: split in the middle
+        best_axis = 0;
+        mid = begin + count / 2;
+    }
+
+    std::uint32_t first = next_node.fetch_add(2);
+    node.child[0] = first;
+    node.child[1] = first + 1;
+    node.begin = 0;
+    node.count = 0;
+    node.axis = std::uint16_t(best_axis);
+    if (count > kTaskThreshold) {
+        #pragma omp task shared(refs, build_nodes, next_node)
+        buildBinned(refs, build_nodes, next_node, first, begin, mid, depth + 1);
+        buildBinned(refs, build_nodes, next_node, first + 1, mid, end, depth + 1);
+        #pragma omp taskwait
+    }
+    else {
+        buildBinned(refs, build_nodes, next_node, first, begin, mid, depth + 1);
+        buildBinned(refs, build_nodes, next_node, first + 1, mid, end, depth + 1);
+    }
+}
+
+// Axis along which the centroids of the primitives spread the most
+inline int BVH::medianAxis(const std::vector<BuildRef> &refs, int begin, int end)
+{
+    AABB centroid_bounds;
+    for (int i = begin; i < end; ++i) {
+        centroid_bounds.grow(refs[i].centroid);
+    }
+    glm::vec3 extent = centroid_bounds.bmax - centroid_bounds.bmin;
+    return extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+}
+
+inline std::uint32_t BVH::flatten(const std::vector<BuildNode> &build_nodes, std::uint32_t index)
+{
+    const BuildNode &build_node = build_nodes[index];
+    std::uint32_t node_index = std::uint32_t(nodes.size());
+    nodes.push_back(BVHNode());
+    nodes[node_index].bbox_min = build_node.bounds.bmin;
+    nodes[node_index].bbox_max = build_node.bounds.bmax;
+    if (build_node.count > 0) {
+        nodes[node_index].offset = build_node.begin;
+        nodes[node_index].count = std::uint16_t(build_node.count);
+        nodes[node_index].axis = 0;
+    }
+    else {
+        flatten(build_nodes, build_node.child[0]);
+        std::uint32_t second = flatten(build_nodes, build_node.child[1]);
+        nodes[node_index].offset = second;
+        nodes[node_index].count = 0;
+        nodes[node_index].axis = build_node.axis;
+    }
+    return node_index;
+}
+
+inline void BVH::computeStats()
+{
+    stats.num_nodes = int(nodes.size());
+    stats.min_leaf_size = INT32_MAX;
+    float root_area = nodeBounds(nodes[0]).area();
+    float inv_root_area = root_area > 0.0f ? 1.0f / root_area : 0.0f;
+    int total_leaf_size = 0;
+
+    std::vector<std::pair<std::uint32_t, int> > stack(1, std::make_pair(0u, 1));
+    while (!stack.empty()) {
+        std::uint32_t index = stack.back().first;
+        int depth = stack.back().second;
+        stack.pop_back();
+        const BVHNode &node = nodes[index];
+        float area = nodeBounds(node).area() * inv_root_area;
+        stats.max_depth = std::max(stats.max_depth, depth);
+        if (node.count > 0) {
+            stats.sah_cost += kSAHIntersectionCost * blocks(node.count) * area;
+            stats.num_leaves += 1;
+            stats.min_leaf_size = std::min(stats.min_leaf_size, int(node.count));
+            stats.max_leaf_size = std::max(stats.max_leaf_size, int(node.count));
+            total_leaf_size += node.count;
+        }
+        else {
+            stats.sah_cost += kSAHTraversalCost * area;
+            stack.push_back(std::make_pair(index + 1, depth + 1));
+            stack.push_back(std::make_pair(node.offset, depth + 1));
+        }
+    }
+    stats.avg_leaf_size = float(total_leaf_size) / float(stats.num_leaves);
+}
+
+template <typename HitPrim>
+bool BVH::hit(const Ray &r, float t_min, float t_max, HitPrim hit_prim) const
+{
+    if (nodes.empty()) return false;
+
+    glm::vec3 origin = r.origin();
+    glm::vec3 inv_dir = 1.0f / r.direction();
+    bool dir_is_neg[3] = { inv_dir.x < 0.0f, inv_dir.y < 0.0f, inv_dir.z < 0.0f };
+
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+    std::uint32_t stack[kMaxBVHDepth + 1];
+    int stack_size = 0;
+    std::uint32_t current = 0;
+    while (true) {
+        RT_COUNT(node_visits, 1);
+        const BVHNode &node = nodes[current];
+        float t_entry;
+        if (hitNode(node, origin, inv_dir, t_min, closest_so_far, t_entry)) {
+            if (node.count > 0) {
+                for (std::uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                    if (hit_prim(i, t_min, closest_so_far)) {
+                        hit_anything = true;
+                    }
+                }
+            }
+            else {
+                // Visit the child on the near side of the split plane first
+                if (dir_is_neg[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                }
+                else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+        if (stack_size == 0) break;
+        current = stack[--stack_size];
+    }
+    return hit_anything;
+}
+
+template <typename HitPrim>
+void BVH::hitPacket(const RayPacket &packet, int first, int last, float t_min, float t_max[],
+                    HitPrim hit_prim) const
+{
+    if (nodes.empty()) return;
+
+    struct StackEntry {
+        std::uint32_t node;
+        int first, last;
+    };
+    StackEntry stack[kMaxBVHDepth + 1];
+    int stack_size = 0;
+    stack[stack_size++] = { 0, first, last };
+    while (stack_size > 0) {
+        StackEntry entry = stack[--stack_size];
+        RT_COUNT(packet_node_visits, 1);
+        const BVHNode &node = nodes[entry.node];
+        float t_entry;
+        if (packet.frustum.culls(node.bbox_min, node.bbox_max) ||
+            !packet.clipRange(node.bbox_min, node.bbox_max, t_min, t_max, entry.first, entry.last,
+                              t_entry)) {
+            continue;
+        }
+        if (node.count > 0) {
+            for (std::uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                hit_prim(i, entry.first, entry.last);
+            }
+        }
+        else {
+            // Visit the child on the near side of the split plane for the
+            // first active ray first
+            float dir[3] = { packet.dx[entry.first], packet.dy[entry.first], packet.dz[entry.first] };
+            if (dir[node.axis] < 0.0f) {
+                stack[stack_size++] = { entry.node + 1, entry.first, entry.last };
+                stack[stack_size++] = { node.offset, entry.first, entry.last };
+            }
+            else {
+                stack[stack_size++] = { node.offset, entry.first, entry.last };
+                stack[stack_size++] = { entry.node + 1, entry.first, entry.last };
+            }
+        }
+    }
+}
+
+} // namespace rt
@@ -0,0 +1,463 @@
+#pragma once
+
+#include "bvh.h"
+#include "mappedfile.h"
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace rt {
+
+// Node of the 4-wide BVH (64 bytes). The boxes of the children are stored as
+// structure-of-arrays and quantized to 8 bits relative to the bounds of the
+// node: a child bound is origin + q * 2^exponent, where lower bounds are
+// rounded down and upper bounds rounded up so the boxes stay conservative.
+// Leaf children are stored inline as a range of primitive slots.
+struct BVH4Node {
+    float origin[3];
+    std::int8_t exponent[3];
+    std::uint8_t num_children;
+    std::uint8_t qlo_x[4], qlo_y[4], qlo_z[4];
+    std::uint8_t qhi_x[4], qhi_y[4], qhi_z[4];
+    std::uint32_t child[4];       // Interior: node index, leaf: first primitive slot
+    std::uint8_t leaf_count[4];   // Number of primitives, zero for interior children
+    std::uint32_t padding;
+};
+
+// Collapsed 4-wide BVH built from a binary BVH. Traversal tests all children
+// of a node with one SIMD slab test and visits the hit children in front to
+// back order. Primitive slots are the same as in the binary BVH, unless the
+// leaves are remapped by the owner (e.g. to blocks of primitives).
+class BVH4 {
+public:
+    void collapse(const BVH &bvh);
+
+    // Closest-hit traversal. hit_leaf(first, count, t_min, closest) is called
+    // once per visited leaf with its range of primitive slots; it should
+    // return true and update closest if a primitive was hit closer. The
+    // traversal can be restricted to the subtree of an interior node.
+    template <typename HitLeaf>
+    bool hit(const Ray &r, float t_min, float t_max, HitLeaf hit_leaf, std::uint32_t root = 0) const;
+
+    // Closest-hit traversal of the rays [first, last] of a packet, with the
+    // current closest distance of each ray in t_max. Leaves are intersected
+    // per ray with hit_leaf(ray, first, count, t_min, closest), which has the
+    // same meaning as above. Rays that remain of a packet that diverges are
+    // traced individually through the rest of the subtree.
+    template <typename HitLeaf>
+    void hitPacket(const RayPacket &packet, int first, int last, float t_min, float t_max[],
+                   HitLeaf hit_leaf) const;
+
+    MappedArray<BVH4Node> nodes;  // Mapped when loaded from a scene cache
+    AABB bounds;
+
+private:
+    std::uint32_t collapseNode(const BVH &bvh, std::uint32_t binary_index, std::vector<BVH4Node> &out);
+};
+
+// 2^e for the exponents stored in the nodes, built directly from the bits
+inline float exponentToFloat(int e)
+{
+    std::uint32_t bits = std::uint32_t(e + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, 4);
+    return scale;
+}
+
+// Smallest exponent such that 255 * 2^exponent covers the extent
+inline int quantizationExponent(float extent)
+{
+    int e = -126;
+    if (extent > 0.0f) {
+        e = std::max(-126, int(std::ceil(std::log2(extent / 255.0f))));
+        while (std::ldexp(255.0f, e) < extent) ++e;
+    }
+    return e;
+}
+
+inline void BVH4::collapse(const BVH &bvh)
+{
+    std::vector<BVH4Node> &out = nodes.vector();
+    out.clear();
+    bounds = AABB();
+    if (bvh.nodes.empty()) return;
+    bounds = nodeBounds(bvh.nodes[0]);
+    out.reserve(bvh.nodes.size() / 2 + 1);
+    collapseNode(bvh, 0, out);
+}
+
+inline std::uint32_t BVH4::collapseNode(const BVH &bvh, std::uint32_t binary_index,
+                                        std::vector<BVH4Node> &out)
+{
+    // Gather up to four children by repeatedly opening the interior child
+    // with the largest surface area
+    std::uint32_t children[4];
+    int num_children = 0;
+    const BVHNode &binary_node = bvh.nodes[binary_index];
+    if (binary_node.count > 0) {
+        children[num_children++] = binary_index;
+    }
+    else {
+        children[num_children++] = binary_index + 1;
+        children[num_children++] = binary_node.offset;
+    }
+    while (num_children < 4) {
+        int best = -1;
+        float best_area = -1.0f;
+        for (int i = 0; i < num_children; ++i) {
+            const BVHNode &node = bvh.nodes[children[i]];
+            float area = nodeBounds(node).area();
+            if (node.count == 0 && area > best_area) {
+                best = i;
+                best_area = area;
+            }
+        }
+        if (best < 0) break;
+        std::uint32_t opened = children[best];
+        children[best] = opened + 1;
+        children[num_children++] = bvh.nodes[opened].offset;
+    }
+
+    std::uint32_t node_index = std::uint32_t(out.size());
+    out.push_back(BVH4Node());
+    {
+        BVH4Node &node = out[node_index];
+        std::memset(&node, 0, sizeof(BVH4Node));
+        AABB node_bounds = nodeBounds(binary_node);
+        node.num_children = std::uint8_t(num_children);
+        for (int axis = 0; axis < 3; ++axis) {
+            float origin = node_bounds.bmin[axis];
+            int e = quantizationExponent(node_bounds.bmax[axis] - origin);
+            float scale = exponentToFloat(e);
+            node.origin[axis] = origin;
+            node.exponent[axis] = std::int8_t(e);
+
+            std::uint8_t *qlo = axis == 0 ? node.qlo_x : axis == 1 ? node.qlo_y : node.qlo_z;
+            std::uint8_t *qhi = axis == 0 ? node.qhi_x : axis == 1 ? node.qhi_y : node.qhi_z;
+            for (int i = 0; i < num_children; ++i) {
+                const BVHNode &child = bvh.nodes[children[i]];
+                int lo = glm::clamp(int(std::floor((child.bbox_min[axis] - origin) / scale)), 0, 255);
+                int hi = glm::clamp(int(std::ceil((child.bbox_max[axis] - origin) / scale)), 0, 255);
+                // Guard against rounding in the dequantization
+                while (lo > 0 && origin + float(lo) * scale > child.bbox_min[axis]) --lo;
+                while (hi < 255 && origin + float(hi) * scale < child.bbox_max[axis]) ++hi;
+                qlo[i] = std::uint8_t(lo);
+                qhi[i] = std::uint8_t(hi);
+            }
+        }
+    }
+
+    for (int i = 0; i < num_children; ++i) {
+        const BVHNode &child = bvh.nodes[children[i]];
+        if (child.count > 0) {
+            out[node_index].child[i] = child.offset;
+            out[node_index].leaf_count[i] = std::uint8_t(child.count);
+        }
+        else {
+            std::uint32_t child_index = collapseNode(bvh, children[i], out);
+            out[node_index].child[i] = child_index;
+            out[node_index].leaf_count[i] = 0;
+        }
+    }
+    return node_index;
+}
+
+// Ray data broadcast for testing the children of BVH4 nodes
+struct BVH4Ray {
+    glm::vec3 origin;
+    glm::vec3 inv_dir;
+#if defined(__SSE2__)
+    __m128 ox, oy, oz;
+    __m128 idx, idy, idz;
+#endif
+
+    explicit BVH4Ray(const Ray &r) : origin(r.origin()), inv_dir(1.0f / r.direction())
+    {
+#if defined(__SSE2__)
+        ox = _mm_set1_ps(origin.x);
+        oy = _mm_set1_ps(origin.y);
+        oz = _mm_set1_ps(origin.z);
+        idx = _mm_set1_ps(inv_dir.x);
+        idy = _mm_set1_ps(inv_dir.y);
+        idz = _mm_set1_ps(inv_dir.z);
+#endif
+    }
+};
+
+#if defined(__SSE2__)
+inline __m128 dequantize(const std::uint8_t q[4], __m128 origin, __m128 scale)
+{
+    int bits;
+    std::memcpy(&bits, q, 4);
+    __m128i zero = _mm_setzero_si128();
+    __m128i q32 = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bits), zero), zero);
+    return _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(q32), scale));
+}
+
+inline __m128 exponentToScale(int e)
+{
+    return _mm_castsi128_ps(_mm_set1_epi32((e + 127) << 23));
+}
+#endif
+
+// Dequantized box of a child
+inline void childBounds(const BVH4Node &node, int i, glm::vec3 &bmin, glm::vec3 &bmax)
+{
+    const std::uint8_t *qlo[3] = { node.qlo_x, node.qlo_y, node.qlo_z };
+    const std::uint8_t *qhi[3] = { node.qhi_x, node.qhi_y, node.qhi_z };
+    for (int axis = 0; axis < 3; ++axis) {
+        float scale = exponentToFloat(node.exponent[axis]);
+        bmin[axis] = node.origin[axis] + float(qlo[axis][i]) * scale;
+        bmax[axis] = node.origin[axis] + float(qhi[axis][i]) * scale;
+    }
+}
+
+// Dequantizes the boxes of all children of a node and returns a bit mask of
+// the children that are outside the frustum of a packet
+inline int cullChildren(const BVH4Node &node, const Frustum &frustum, glm::vec3 bmin[4],
+                        glm::vec3 bmax[4])
+{
+#if defined(__SSE2__)
+    __m128 lo[3], hi[3];
+    lo[0] = dequantize(node.qlo_x, _mm_set1_ps(node.origin[0]), exponentToScale(node.exponent[0]));
+    hi[0] = dequantize(node.qhi_x, _mm_set1_ps(node.origin[0]), exponentToScale(node.exponent[0]));
+    lo[1] = dequantize(node.qlo_y, _mm_set1_ps(node.origin[1]), exponentToScale(node.exponent[1]));
+    hi[1] = dequantize(node.qhi_y, _mm_set1_ps(node.origin[1]), exponentToScale(node.exponent[1]));
+    lo[2] = dequantize(node.qlo_z, _mm_set1_ps(node.origin[2]), exponentToScale(node.exponent[2]));
+    hi[2] = dequantize(node.qhi_z, _mm_set1_ps(node.origin[2]), exponentToScale(node.exponent[2]));
+    float lo_soa[3][4], hi_soa[3][4];
+    for (int axis = 0; axis < 3; ++axis) {
+        _mm_storeu_ps(lo_soa[axis], lo[axis]);
+        _mm_storeu_ps(hi_soa[axis], hi[axis]);
+    }
+    for (int i = 0; i < node.num_children; ++i) {
+        bmin[i] = glm::vec3(lo_soa[0][i], lo_soa[1][i], lo_soa[2][i]);
+        bmax[i] = glm::vec3(hi_soa[0][i], hi_soa[1][i], hi_soa[2][i]);
+    }
+
+    // Same test as Frustum::culls() for four boxes at a time
+    __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 culled = _mm_setzero_ps();
+    for (int k = 0; k < 4; ++k) {
+        const glm::vec3 &n = frustum.normal[k];
+        __m128 px = n.x > 0.0f ? lo[0] : hi[0];
+        __m128 py = n.y > 0.0f ? lo[1] : hi[1];
+        __m128 pz = n.z > 0.0f ? lo[2] : hi[2];
+        __m128 dist = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(n.x), px),
+                                                       _mm_mul_ps(_mm_set1_ps(n.y), py)),
+                                            _mm_mul_ps(_mm_set1_ps(n.z), pz)),
+                                 _mm_set1_ps(frustum.offset[k]));
+        __m128 max_abs = _mm_max_ps(_mm_max_ps(_mm_and_ps(px, abs_mask), _mm_and_ps(py, abs_mask)),
+                                    _mm_and_ps(pz, abs_mask));
+        __m128 eps = _mm_mul_ps(_mm_set1_ps(1e-5f),
+                                _mm_add_ps(_mm_set1_ps(1.0f + std::fabs(frustum.offset[k])), max_abs));
+        culled = _mm_or_ps(culled, _mm_cmpgt_ps(dist, eps));
+    }
+    return _mm_movemask_ps(culled);
+#else
+    int mask = 0;
+    for (int i = 0; i < node.num_children; ++i) {
+        childBounds(node, i, bmin[i], bmax[i]);
+        if (frustum.culls(bmin[i], bmax[i])) mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+// Slab test of the ray against all children of a node. Returns a bit mask of
+// the children that were hit and their entry distances in t_entry.
+inline int hitChildren(const BVH4Node &node, const BVH4Ray &ray, float t_min, float t_max,
+                       float t_entry[4])
+{
+#if defined(__SSE2__)
+    __m128 lo_x = dequantize(node.qlo_x, _mm_set1_ps(node.origin[0]), exponentToScale(node.exponent[0]));
+    __m128 hi_x = dequantize(node.qhi_x, _mm_set1_ps(node.origin[0]), exponentToScale(node.exponent[0]));
+    __m128 lo_y = dequantize(node.qlo_y, _mm_set1_ps(node.origin[1]), exponentToScale(node.exponent[1]));
+    __m128 hi_y = dequantize(node.qhi_y, _mm_set1_ps(node.origin[1]), exponentToScale(node.exponent[1]));
+    __m128 lo_z = dequantize(node.qlo_z, _mm_set1_ps(node.origin[2]), exponentToScale(node.exponent[2]));
+    __m128 hi_z = dequantize(node.qhi_z, _mm_set1_ps(node.origin[2]), exponentToScale(node.exponent[2]));
+
+    __m128 t0x = _mm_mul_ps(_mm_sub_ps(lo_x, ray.ox), ray.idx);
+    __m128 t1x = _mm_mul_ps(_mm_sub_ps(hi_x, ray.ox), ray.idx);
+    __m128 t0y = _mm_mul_ps(_mm_sub_ps(lo_y, ray.oy), ray.idy);
+    __m128 t1y = _mm_mul_ps(_mm_sub_ps(hi_y, ray.oy), ray.idy);
+    __m128 t0z = _mm_mul_ps(_mm_sub_ps(lo_z, ray.oz), ray.idz);
+    __m128 t1z = _mm_mul_ps(_mm_sub_ps(hi_z, ray.oz), ray.idz);
+
+    __m128 tnear = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+                              _mm_max_ps(_mm_min_ps(t0z, t1z), _mm_set1_ps(t_min)));
+    __m128 tfar = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+                             _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_set1_ps(t_max)));
+    _mm_storeu_ps(t_entry, tnear);
+    int mask = _mm_movemask_ps(_mm_cmple_ps(tnear, tfar));
+    return mask & ((1 << node.num_children) - 1);
+#else
+    int mask = 0;
+    for (int i = 0; i < node.num_children; ++i) {
+        const std::uint8_t *qlo[3] = { node.qlo_x, node.qlo_y, node.qlo_z };
+        const std::uint8_t *qhi[3] = { node.qhi_x, node.qhi_y, node.qhi_z };
+        float tnear = t_min;
+        float tfar = t_max;
+        for (int axis = 0; axis < 3; ++axis) {
+            float scale = exponentToFloat(node.exponent[axis]);
+            float lo = node.origin[axis] + float(qlo[axis][i]) * scale;
+            float hi = node.origin[axis] + float(qhi[axis][i]) * scale;
+            float t0 = (lo - ray.origin[axis]) * ray.inv_dir[axis];
+            float t1 = (hi - ray.origin[axis]) * ray.inv_dir[axis];
+            tnear = glm::max(tnear, glm::min(t0, t1));
+            tfar = glm::min(tfar, glm::max(t0, t1));
+        }
+        t_entry[i] = tnear;
+        if (tnear <= tfar) mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+template <typename HitLeaf>
+bool BVH4::hit(const Ray &r, float t_min, float t_max, HitLeaf hit_leaf, std::uint32_t root) const
+{
+    if (nodes.empty()) return false;
+    const BVH4Node *node_data = nodes.data();
+
+    struct StackEntry {
+        std::uint32_t child;
+        std::uint32_t leaf_count;
+        float t_entry;
+    };
+    StackEntry stack[256];
+    int stack_size = 0;
+    stack[stack_size++] = { root, 0, t_min };
+
+    BVH4Ray ray(r);
+    bool hit_anything = false;
+    float closest_so_far = t_max;
+    while (stack_size > 0) {
+        StackEntry entry = stack[--stack_size];
+        if (entry.t_entry > closest_so_far) continue;
+
+        if (entry.leaf_count > 0) {
+            if (hit_leaf(entry.child, entry.leaf_count, t_min, closest_so_far)) {
+                hit_anything = true;
+            }
+            continue;
+        }
+
+        RT_COUNT(node_visits, 1);
+        const BVH4Node &node = node_data[entry.child];
+        float t_entry[4];
+        int mask = hitChildren(node, ray, t_min, closest_so_far, t_entry);
+
+        // Sort the hit children by distance and push them far to near, so
+        // that the nearest child is visited first
+        int order[4];
+        int num_hits = 0;
+        for (int i = 0; i < 4; ++i) {
+            if (!(mask & (1 << i))) continue;
+            int j = num_hits++;
+            while (j > 0 && t_entry[order[j - 1]] < t_entry[i]) {
+                order[j] = order[j - 1];
+                --j;
+            }
+            order[j] = i;
+        }
+        for (int k = 0; k < num_hits; ++k) {
+            int i = order[k];
+            stack[stack_size++] = { node.child[i], node.leaf_count[i], t_entry[i] };
+        }
+    }
+    return hit_anything;
+}
+
+template <typename HitLeaf>
+void BVH4::hitPacket(const RayPacket &packet, int first, int last, float t_min, float t_max[],
+                     HitLeaf hit_leaf) const
+{
+    if (nodes.empty()) return;
+    const BVH4Node *node_data = nodes.data();
+
+    // Leaf entries keep the box of the leaf, so that rays in the range
+    // that miss it can be skipped
+    struct StackEntry {
+        std::uint32_t child;
+        std::uint32_t leaf_count;
+        int first, last;
+        glm::vec3 bmin, bmax;
+    };
+    StackEntry stack[256];
+    int stack_size = 0;
+    stack[stack_size].child = 0;
+    stack[stack_size].leaf_count = 0;
+    stack[stack_size].first = first;
+    stack[stack_size].last = last;
+    ++stack_size;
+
+    while (stack_size > 0) {
+        StackEntry entry = stack[--stack_size];
+
+        if (entry.leaf_count > 0) {
+            for (int i = entry.first; i <= entry.last; ++i) {
+                float t_entry;
+                if (packet.hitBox(i, entry.bmin, entry.bmax, t_min, t_max[i], t_entry)) {
+                    hit_leaf(i, entry.child, entry.leaf_count, t_min, t_max[i]);
+                }
+            }
+            continue;
+        }
+
+        if (entry.last - entry.first + 1 < kMinPacketRays) {
+            for (int i = entry.first; i <= entry.last; ++i) {
+                auto hit_ray_leaf = [&](std::uint32_t leaf_first, std::uint32_t count, float tmin,
+                                        float &closest) {
+                    if (!hit_leaf(i, leaf_first, count, tmin, closest)) return false;
+                    t_max[i] = closest;
+                    return true;
+                };
+                hit(packet.ray(i), t_min, t_max[i], hit_ray_leaf, entry.child);
+            }
+            continue;
+        }
+
+        RT_COUNT(packet_node_visits, 1);
+        const BVH4Node &node = node_data[entry.child];
+
+        // Children that some ray in the range hits, sorted far to near by
+        // the entry distance of their first ray
+        glm::vec3 bmin[4], bmax[4];
+        int culled = cullChildren(node, packet.frustum, bmin, bmax);
+        StackEntry children[4];
+        float t_entry[4];
+        int num_hits = 0;
+        for (int i = 0; i < node.num_children; ++i) {
+            if (culled & (1 << i)) continue;
+            StackEntry child;
+            child.bmin = bmin[i];
+            child.bmax = bmax[i];
+            child.first = entry.first;
+            child.last = entry.last;
+            float t;
+            if (!packet.clipRange(child.bmin, child.bmax, t_min, t_max, child.first, child.last, t)) {
+                continue;
+            }
+            child.child = node.child[i];
+            child.leaf_count = node.leaf_count[i];
+            int j = num_hits++;
+            while (j > 0 && t_entry[j - 1] < t) {
+                children[j] = children[j - 1];
+                t_entry[j] = t_entry[j - 1];
+                --j;
+            }
+            children[j] = child;
+            t_entry[j] = t;
+        }
+        for (int k = 0; k < num_hits; ++k) {
+            stack[stack_size++] = children[k];
+        }
+    }
+}
+
+} // namespace rt
@@ -0,0 +1,278 @@
+// Headless batch renderer
+//
+// Renders the scene of the ray tracer without a window and writes the
+// result to a PNG or PFM (floating point) image.
+//
+
+#include "raytracing.h"
+#include "pfm.h"
+#include "trace.h"
+
+#include <lodepng.h>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+struct Options {
+    std::string mesh_filename;
+    std::string output_filename = "output.png";
+    int width = 500;
+    int height = 500;
+    int samples = 16;
+    int max_bounces = 1;
+    int num_threads = 0;
+    bool show_normals = false;
+    bool use_wavefront = false;
+    bool denoise = false;
+    bool use_cache = false;
+    int geometry_budget_mb = 0;
+    float adaptive_threshold = 0.0f;
+    int min_samples = 16;
+    rt::CostView cost_view = rt::CostView::Off;
+    std::string stats_filename;
+    std::string trace_filename;
+};
+
+void printUsage(const char *program)
+{
+    std::cout << "Usage: " << program << " [options] mesh.obj\n"
+              << "  -o, --output FILE   output image, .png or .pfm (default output.png)\n"
+              << "  -w, --width N       image width (default 500)\n"
+              << "  -h, --height N      image height (default 500)\n"
+              << "  -s, --spp N         samples per pixel, or the maximum with -a (default 16)\n"
+              << "  -a, --adaptive E    stop sampling a tile once the error of its pixels, pooled\n"
+              << "                      over the tile and relative to their mean luminance plus\n"
+              << "                      0.01, is below E (e.g. 0.02)\n"
+              << "      --min-spp N     samples per pixel before the error is trusted (default 16)\n"
+              << "  -b, --bounces N     max bounces (default 1)\n"
+              << "  -t, --threads N     render threads, 0 for all cores (default 0)\n"
+              << "  -n, --normals       render normals instead of shading\n"
+              << "      --wavefront     trace paths in batches per bounce instead of recursively\n"
+              << "  -d, --denoise       filter the noise out of the image, guided by the normal,\n"
+              << "                      albedo and depth of the primary hits\n"
+              << "      --cache         read the mesh and its BVH from the scene cache\n"
+              << "                      mesh.obj.rtcache, writing it first if needed\n"
+              << "      --geometry-budget MB  stream the mesh from the scene cache (implies --cache),\n"
+              << "                      keeping at most MB of it in memory besides the top of its BVH\n"
+              << "  -c, --cost VIEW     render the cost per pixel instead: nodes, tests, length or\n"
+              << "                      time; a .pfm output then holds the mean cost per sample\n"
+              << "      --stats FILE    write the counters of the tracer as JSON\n"
+              << "      --trace FILE    write a timeline of the render in Chrome trace format" << std::endl;
+}
+
+bool parseOptions(int argc, char **argv, Options &options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if ((arg == "-o" || arg == "--output") && has_value) {
+            options.output_filename = argv[++i];
+        }
+        else if ((arg == "-w" || arg == "--width") && has_value) {
+            options.width = std::atoi(argv[++i]);
+        }
+        else if ((arg == "-h" || arg == "--height") && has_value) {
+            options.height = std::atoi(argv[++i]);
+        }
+        else if ((arg == "-s" || arg == "--spp") && has_value) {
+            options.samples = std::atoi(argv[++i]);
+        }
+        else if ((arg == "-a" || arg == "--adaptive") && has_value) {
+            options.adaptive_threshold = float(std::atof(argv[++i]));
+        }
+        else if (arg == "--min-spp" && has_value) {
+            options.min_samples = std::atoi(argv[++i]);
+        }
+        else if ((arg == "-b" || arg == "--bounces") && has_value) {
+            options.max_bounces = std::atoi(argv[++i]);
+        }
+        else if ((arg == "-t" || arg == "--threads") && has_value) {
+            options.num_threads = std::atoi(argv[++i]);
+        }
+        else if (arg == "-n" || arg == "--normals") {
+            options.show_normals = true;
+        }
+        else if (arg == "--wavefront") {
+            options.use_wavefront = true;
+        }
+        else if (arg == "-d" || arg == "--denoise") {
+            options.denoise = true;
+        }
+        else if (arg == "--cache") {
+            options.use_cache = true;
+        }
+        else if (arg == "--geometry-budget" && has_value) {
+            options.geometry_budget_mb = std::atoi(argv[++i]);
+        }
+        else if ((arg == "-c" || arg == "--cost") && has_value) {
+            std::string view = argv[++i];
+            if (view == "nodes") options.cost_view = rt::CostView::NodeVisits;
+            else if (view == "tests") options.cost_view = rt::CostView::PrimitiveTests;
+            else if (view == "length") options.cost_view = rt::CostView::PathLength;
+            else if (view == "time") options.cost_view = rt::CostView::Time;
+            else {
+                std::cout << "Error: invalid cost view " << view << std::endl;
+                return false;
+            }
+            if (!rt::costViewAvailable(options.cost_view)) {
+                std::cout << "Error: cost view " << view << " needs a build with RAYTRACER_ENABLE_STATS=ON"
+                          << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--stats" && has_value) {
+            options.stats_filename = argv[++i];
+        }
+        else if (arg == "--trace" && has_value) {
+            options.trace_filename = argv[++i];
+        }
+        else if (arg[0] != '-' && options.mesh_filename.empty()) {
+            options.mesh_filename = arg;
+        }
+        else {
+            std::cout << "Error: invalid argument " << arg << std::endl;
+            return false;
+        }
+    }
+    if (options.mesh_filename.empty() || options.width <= 0 || options.height <= 0 ||
+        options.samples <= 0) {
+        return false;
+    }
+    return true;
+}
+
+bool hasExtension(const std::string &filename, const std::string &extension)
+{
+    return filename.size() >= extension.size() &&
+           filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+// Writes the image with the same gamma correction as the fragment shader
+// of the GUI. Rows are stored top to bottom, so the image is flipped.
+bool writePNG(const std::string &filename, int width, int height, const std::vector<glm::vec4> &image)
+{
+    std::vector<unsigned char> pixels(width * height * 3);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            glm::vec4 p = image[(height - 1 - y) * width + x];
+            for (int c = 0; c < 3; ++c) {
+                float v = std::pow(glm::max(p[c] / glm::max(p.a, 1.0f), 0.0f), 1.0f / 2.2f);
+                pixels[(y * width + x) * 3 + c] = (unsigned char)(glm::min(v, 1.0f) * 255.0f + 0.5f);
+            }
+        }
+    }
+    unsigned error = lodepng::encode(filename, pixels, width, height, LCT_RGB);
+    if (error) {
+        std::cout << "Error: " << lodepng_error_text(error) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    bool pfm = hasExtension(options.output_filename, ".pfm");
+    if (!pfm && !hasExtension(options.output_filename, ".png")) {
+        std::cout << "Error: output must be a .png or .pfm file" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!options.trace_filename.empty()) {
+        rt::setTracing(true);
+        rt::setTraceThreadName("main");
+    }
+
+    rt::RTContext rtx;
+    rtx.width = options.width;
+    rtx.height = options.height;
+    rtx.max_bounces = options.max_bounces;
+    rtx.num_threads = options.num_threads;
+    rtx.show_normals = options.show_normals;
+    rtx.cost_view = options.cost_view;
+    rtx.use_wavefront = options.use_wavefront;
+    rtx.use_scene_cache = options.use_cache || options.geometry_budget_mb > 0;
+    rtx.geometry_budget_mb = options.geometry_budget_mb;
+    rtx.adaptive_threshold = options.adaptive_threshold;
+    rtx.adaptive_min_samples = options.min_samples;
+    rtx.max_frames = options.samples;
+    // Same default view as the GUI
+    rtx.view = glm::lookAt(glm::vec3(0.0f, 0.0f, 2.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+    if (!rt::setupScene(rtx, options.mesh_filename.c_str())) {
+        std::cout << "Error: could not load " << options.mesh_filename << std::endl;
+        return EXIT_FAILURE;
+    }
+    rt::resetImage(rtx);
+
+    auto start = std::chrono::steady_clock::now();
+    rt::renderImage(rtx, options.samples);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double num_samples = 0.0;
+    for (std::size_t i = 0; i < rtx.image.size(); ++i) num_samples += rtx.image[i].a;
+    std::cout << "Rendered " << rtx.width << "x" << rtx.height << " at "
+              << num_samples / (double(rtx.width) * rtx.height) << " spp in " << seconds << " s ("
+              << num_samples / seconds * 1e-6 << " Msamples/s)" << std::endl;
+    if (rtx.adaptive_threshold > 0.0f) {
+        std::cout << (rtx.converged ? "Converged" : "Not converged") << " at error "
+                  << rtx.adaptive_threshold << std::endl;
+    }
+
+    // Cost views are not denoised; the PFM image holds the cost itself
+    // instead of the ramp
+    std::vector<glm::vec4> image = rtx.image;
+    if (rtx.cost_view != rt::CostView::Off) {
+        if (pfm) {
+            for (std::size_t i = 0; i < image.size(); ++i) {
+                image[i] = glm::vec4(glm::vec3(rtx.cost[i]), rtx.image[i].a);
+            }
+        }
+    }
+    else if (options.denoise && !rtx.show_normals) {
+        start = std::chrono::steady_clock::now();
+        rt::denoiseImage(rtx);
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Denoised in " << seconds << " s" << std::endl;
+        image = rtx.denoised;
+    }
+    if (rt::sceneInfo().treelet_read_errors > 0) {
+        std::cout << "Error: parts of the streamed mesh could not be read" << std::endl;
+        return EXIT_FAILURE;
+    }
+    bool ok = pfm ? rt::writePFM(options.output_filename, rtx.width, rtx.height, image)
+                  : writePNG(options.output_filename, rtx.width, rtx.height, image);
+    if (!ok) return EXIT_FAILURE;
+    std::cout << "Wrote " << options.output_filename << std::endl;
+
+    if (!options.stats_filename.empty()) {
+        std::ofstream file(options.stats_filename.c_str());
+        rt::writeStatsJSON(file, rtx.stats);
+        if (!file) {
+            std::cout << "Error: could not write " << options.stats_filename << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << "Wrote " << options.stats_filename << std::endl;
+    }
+    if (!options.trace_filename.empty()) {
+        if (!rt::writeTrace(options.trace_filename)) {
+            std::cout << "Error: could not write " << options.trace_filename << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << "Wrote " << options.trace_filename << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+namespace rt {
+
+// Edge-avoiding a-trous wavelet filter, after Dammertz et al., "Edge-Avoiding
+// A-Trous Wavelet Transform for fast Global Illumination Filtering" (HPG
+// 2010). Each iteration blurs with a 5x5 B3-spline kernel whose taps are
+// spread 2^i pixels apart, weighted down where the color, normal, position
+// or albedo of the primary hit differ from the center pixel. The color is
+// divided by the albedo before filtering and multiplied back after, so that
+// the filter only has to smooth the lighting.
+struct DenoiseSettings {
+    int iterations = 5;
+    float sigma_color = 0.6f;  // Halved in each iteration, as the noise goes down
+    float sigma_normal = 0.2f;
+    float sigma_position = 0.3f;
+    float sigma_albedo = 0.1f;
+};
+
+// Features of the primary hits in planes (structure of arrays), so that
+// the filter can process consecutive pixels with SIMD
+struct DenoisePlanes {
+    std::vector<float> r, g, b;
+    std::vector<float> nx, ny, nz;
+    std::vector<float> px, py, pz;
+    std::vector<float> ar, ag, ab;
+
+    void resize(std::size_t n)
+    {
+        std::vector<float> *planes[12] = { &r, &g, &b, &nx, &ny, &nz, &px, &py, &pz, &ar, &ag, &ab };
+        for (int i = 0; i < 12; ++i) planes[i]->resize(n);
+    }
+};
+
+// Decreasing like exp(-x) for x >= 0, from the reciprocal of its Taylor
+// series, which vectorizes where exp() does not
+inline float expNegApprox(float x)
+{
+    return 1.0f / (1.0f + x * (1.0f + x * (0.5f + x * (1.0f / 6.0f + x * (1.0f / 24.0f)))));
+}
+
+// One filter iteration from the colors in planes to out_r/g/b. Rows are
+// filtered in parallel; within a row, each tap is applied to all pixels
+// whose tap lies in the image, so the inner loop runs over consecutive
+// pixels.
+inline void denoiseIteration(int width, int height, int step, float sigma_color, const DenoiseSettings &settings,
+                             const DenoisePlanes &planes, std::vector<float> &out_r, std::vector<float> &out_g,
+                             std::vector<float> &out_b, int num_threads)
+{
+    const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+    const float inv_color = 1.0f / (sigma_color * sigma_color);
+    const float inv_normal = 1.0f / (settings.sigma_normal * settings.sigma_normal);
+    const float inv_position = 1.0f / (settings.sigma_position * settings.sigma_position);
+    const float inv_albedo = 1.0f / (settings.sigma_albedo * settings.sigma_albedo);
+    const float *r = planes.r.data(), *g = planes.g.data(), *b = planes.b.data();
+    const float *nx = planes.nx.data(), *ny = planes.ny.data(), *nz = planes.nz.data();
+    const float *px = planes.px.data(), *py = planes.py.data(), *pz = planes.pz.data();
+    const float *ar = planes.ar.data(), *ag = planes.ag.data(), *ab = planes.ab.data();
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        std::vector<float> sum_r(width), sum_g(width), sum_b(width), sum_w(width);
+        #pragma omp for schedule(dynamic, 4)
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                sum_r[x] = sum_g[x] = sum_b[x] = sum_w[x] = 0.0f;
+            }
+            for (int ty = -2; ty <= 2; ++ty) {
+                int yy = y + ty * step;
+                if (yy < 0 || yy >= height) continue;
+                for (int tx = -2; tx <= 2; ++tx) {
+                    int offset = tx * step;
+                    int x_begin = glm::max(0, -offset);
+                    int x_end = glm::min(width, width - offset);
+                    float k = kernel[ty + 2] * kernel[tx + 2];
+                    const int p0 = y * width;
+                    const int q0 = yy * width + offset;
+                    float *sr = sum_r.data(), *sg = sum_g.data(), *sb = sum_b.data(), *sw = sum_w.data();
+                    #pragma omp simd
+                    for (int x = x_begin; x < x_end; ++x) {
+                        int p = p0 + x;
+                        int q = q0 + x;
+                        float dr = r[p] - r[q], dg = g[p] - g[q], db = b[p] - b[q];
+                        float dnx = nx[p] - nx[q], dny = ny[p] - ny[q], dnz = nz[p] - nz[q];
+                        float dpx = px[p] - px[q], dpy = py[p] - py[q], dpz = pz[p] - pz[q];
+                        float dar = ar[p] - ar[q], dag = ag[p] - ag[q], dab = ab[p] - ab[q];
+                        float e = (dr * dr + dg * dg + db * db) * inv_color +
+                                  (dnx * dnx + dny * dny + dnz * dnz) * inv_normal +
+                                  (dpx * dpx + dpy * dpy + dpz * dpz) * inv_position +
+                                  (dar * dar + dag * dag + dab * dab) * inv_albedo;
+                        float w = k * expNegApprox(e);
+                        sr[x] += w * r[q];
+                        sg[x] += w * g[q];
+                        sb[x] += w * b[q];
+                        sw[x] += w;
+                    }
+                }
+            }
+            // The center tap always has a positive weight
+            for (int x = 0; x < width; ++x) {
+                out_r[y * width + x] = sum_r[x] / sum_w[x];
+                out_g[y * width + x] = sum_g[x] / sum_w[x];
+                out_b[y * width + x] = sum_b[x] / sum_w[x];
+            }
+        }
+    }
+}
+
+// Filters the mean of an accumulated image (sums of the samples in RGB and
+// their number in alpha), given the primary hit of each pixel: its
+// position with w = 1, or w = 0 for the sky, and its normal and albedo.
+// The result has alpha one.
+inline void denoise(int width, int height, const std::vector<glm::vec4> &image, const std::vector<glm::vec4> &surface,
+                    const std::vector<glm::vec3> &normal, const std::vector<glm::vec3> &albedo,
+                    const DenoiseSettings &settings, std::vector<glm::vec4> &output, int num_threads)
+{
+    int n = width * height;
+    DenoisePlanes planes;
+    planes.resize(n);
+    #pragma omp parallel for num_threads(num_threads)
+    for (int i = 0; i < n; ++i) {
+        glm::vec3 a = surface[i].w != 0.0f ? albedo[i] : glm::vec3(1.0f);
+        glm::vec3 c = glm::vec3(image[i]) / glm::max(image[i].a, 1.0f) / glm::max(a, glm::vec3(0.01f));
+        planes.r[i] = c.r; planes.g[i] = c.g; planes.b[i] = c.b;
+        planes.nx[i] = normal[i].x; planes.ny[i] = normal[i].y; planes.nz[i] = normal[i].z;
+        planes.px[i] = surface[i].x; planes.py[i] = surface[i].y; planes.pz[i] = surface[i].z;
+        planes.ar[i] = a.r; planes.ag[i] = a.g; planes.ab[i] = a.b;
+    }
+
+    std::vector<float> out_r(n), out_g(n), out_b(n);
+    float sigma_color = settings.sigma_color;
+    for (int i = 0; i < settings.iterations; ++i) {
+        denoiseIteration(width, height, 1 << i, sigma_color, settings, planes, out_r, out_g, out_b, num_threads);
+        planes.r.swap(out_r);
+        planes.g.swap(out_g);
+        planes.b.swap(out_b);
+        sigma_color *= 0.5f;
+    }
+
+    output.resize(n);
+    for (int i = 0; i < n; ++i) {
+        glm::vec3 a(planes.ar[i], planes.ag[i], planes.ab[i]);
+        output[i] = glm::vec4(glm::vec3(planes.r[i], planes.g[i], planes.b[i]) * a, 1.0f);
+    }
+}
+
+} // namespace rt
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace rt {
+
+// Formats of the copy of the image that is uploaded for display. The copy
+// holds the mean of each pixel instead of the sums, so that it fits into
+// fewer bits, with an alpha of one.
+enum class DisplayFormat {
+    Float32,         // RGBA32F, 16 bytes per pixel
+    Half,            // RGBA16F, 8 bytes per pixel
+    SharedExponent,  // RGB9_E5, 4 bytes per pixel
+};
+
+inline std::size_t displayPixelSize(DisplayFormat format)
+{
+    switch (format) {
+    case DisplayFormat::Float32: return 16;
+    case DisplayFormat::Half: return 8;
+    case DisplayFormat::SharedExponent: return 4;
+    }
+    return 16;
+}
+
+// IEEE half float, rounded to nearest even
+inline std::uint16_t floatToHalf(float f)
+{
+    std::uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    std::uint32_t sign = (x >> 16) & 0x8000u;
+    std::uint32_t bits = x & 0x7fffffffu;
+    if (bits >= 0x47800000u) {  // At least 2^16, infinity or NaN
+        return std::uint16_t(sign | (bits > 0x7f800000u ? 0x7e00u : 0x7c00u));
+    }
+    if (bits < 0x38800000u) {  // Below 2^-14, so a subnormal half
+        float magnitude;
+        std::memcpy(&magnitude, &bits, sizeof(magnitude));
+        return std::uint16_t(sign | std::uint32_t(std::nearbyint(magnitude * 16777216.0f)));
+    }
+    std::uint32_t h = (bits - 0x38000000u) >> 13;  // Exponent bias 127 to 15
+    std::uint32_t rest = bits & 0x1fffu;
+    if (rest > 0x1000u || (rest == 0x1000u && (h & 1u))) h += 1;  // May round up to infinity
+    return std::uint16_t(sign | h);
+}
+
+// Three 9-bit mantissas with a shared 5-bit exponent, as in
+// EXT_texture_shared_exponent. Negative values are clamped to zero.
+inline std::uint32_t packRGB9E5(const glm::vec3 &c)
+{
+    const int kMantissaBits = 9;
+    const int kBias = 15;
+    const float kMax = 511.0f / 512.0f * 65536.0f;
+    glm::vec3 v = glm::clamp(c, glm::vec3(0.0f), glm::vec3(kMax));
+    float max_component = glm::max(v.x, glm::max(v.y, v.z));
+    if (!(max_component > 0.0f)) return 0;  // Also catches NaN
+
+    int exponent;
+    std::frexp(max_component, &exponent);  // max_component < 2^exponent
+    int shared = glm::max(-kBias - 1, exponent - 1) + 1 + kBias;
+    float scale = std::ldexp(1.0f, kMantissaBits + kBias - shared);
+    if (std::floor(max_component * scale + 0.5f) == float(1 << kMantissaBits)) {
+        shared += 1;
+        scale *= 0.5f;
+    }
+    std::uint32_t r = std::uint32_t(std::floor(v.x * scale + 0.5f));
+    std::uint32_t g = std::uint32_t(std::floor(v.y * scale + 0.5f));
+    std::uint32_t b = std::uint32_t(std::floor(v.z * scale + 0.5f));
+    return r | (g << 9) | (b << 18) | (std::uint32_t(shared) << 27);
+}
+
+// Pixels [x_begin, x_end) x [y_begin, y_end)
+struct PixelRect {
+    int x_begin, y_begin, x_end, y_end;
+};
+
+// Tiles of the image that changed since they were last taken for display.
+// Render threads mark disjoint tiles, so marking needs no locks.
+struct DirtyTiles {
+    int width = 0;
+    int height = 0;
+    int tile_size = 1;
+    int tiles_x = 0;
+    std::vector<std::uint8_t> dirty;
+
+    // Marks all tiles if the size changed
+    void resize(int new_width, int new_height, int new_tile_size)
+    {
+        if (new_width == width && new_height == height && new_tile_size == tile_size) return;
+        width = new_width;
+        height = new_height;
+        tile_size = new_tile_size;
+        tiles_x = (width + tile_size - 1) / tile_size;
+        dirty.assign(tiles_x * ((height + tile_size - 1) / tile_size), 1);
+    }
+
+    void mark(int tile) { dirty[tile] = 1; }
+    void markAll() { std::fill(dirty.begin(), dirty.end(), 1); }
+    void clear() { std::fill(dirty.begin(), dirty.end(), 0); }
+    bool any() const { return std::find(dirty.begin(), dirty.end(), 1) != dirty.end(); }
+
+    // Returns the dirty tiles as one rectangle per row of tiles, from the
+    // first to the last dirty tile in the row, and marks them clean. Passes
+    // render consecutive tiles, so few clean tiles are taken along.
+    std::vector<PixelRect> take()
+    {
+        std::vector<PixelRect> rects;
+        for (std::size_t row_begin = 0; row_begin < dirty.size(); row_begin += tiles_x) {
+            int first = -1, last = -1;
+            for (int i = 0; i < tiles_x; ++i) {
+                if (!dirty[row_begin + i]) continue;
+                if (first < 0) first = i;
+                last = i;
+                dirty[row_begin + i] = 0;
+            }
+            if (first < 0) continue;
+            int y_begin = int(row_begin / tiles_x) * tile_size;
+            PixelRect rect = { first * tile_size, y_begin, std::min((last + 1) * tile_size, width),
+                               std::min(y_begin + tile_size, height) };
+            rects.push_back(rect);
+        }
+        return rects;
+    }
+};
+
+// Converts a rectangle of an accumulated image (sums of the samples in RGB
+// and their number in alpha) to the display copy, which has the same size
+// and row order as the image
+inline void convertToDisplay(const std::vector<glm::vec4> &image, int width, const PixelRect &rect,
+                             DisplayFormat format, std::vector<std::uint8_t> &display)
+{
+    std::size_t pixel_size = displayPixelSize(format);
+    #pragma omp parallel for if ((rect.y_end - rect.y_begin) * (rect.x_end - rect.x_begin) > 65536)
+    for (int y = rect.y_begin; y < rect.y_end; ++y) {
+        for (int x = rect.x_begin; x < rect.x_end; ++x) {
+            std::size_t i = std::size_t(y) * width + x;
+            glm::vec3 c = glm::vec3(image[i]) / glm::max(image[i].a, 1.0f);
+            std::uint8_t *dst = &display[i * pixel_size];
+            if (format == DisplayFormat::Float32) {
+                float texel[4] = { c.r, c.g, c.b, 1.0f };
+                std::memcpy(dst, texel, sizeof(texel));
+            }
+            else if (format == DisplayFormat::Half) {
+                std::uint16_t texel[4] = { floatToHalf(c.r), floatToHalf(c.g), floatToHalf(c.b), 0x3c00 };
+                std::memcpy(dst, texel, sizeof(texel));
+            }
+            else {
+                std::uint32_t texel = packRGB9E5(c);
+                std::memcpy(dst, &texel, sizeof(texel));
+            }
+        }
+    }
+}
+
+} // namespace rt
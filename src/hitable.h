@@ -5,14 +5,19 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/component_wise.hpp>
 
+#include <cstdint>
+
 
 namespace rt {
-	class material;
+
+// Index of a material in the material table of the scene
+typedef std::uint16_t MaterialID;
+
 struct HitRecord {
     float t;
     glm::vec3 p;
     glm::vec3 normal;
-	material *mat_ptr;
+    MaterialID material_id;
 };
 
 class Hitable {
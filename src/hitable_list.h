@@ -14,7 +14,7 @@ namespace rt {
 		int list_size;
 	};
 
-	bool Hitable_list::hit(const Ray& r, float t_min, float t_max, HitRecord& rec) const {
+	inline bool Hitable_list::hit(const Ray& r, float t_min, float t_max, HitRecord& rec) const {
 		HitRecord temp_rec;
 		bool hit_anything = false;
 		double closest_so_far = t_max;
@@ -0,0 +1,259 @@
+#pragma once
+
+#include "hitable.h"
+#include "triangle4.h"
+#include "bvh4.h"
+#include "treelet.h"
+
+#include <memory>
+
+namespace rt {
+
+// Bottom-level acceleration structure of a unique mesh. The triangles are
+// kept in object space and packed into blocks of four per BVH leaf, and the
+// leaves of the 4-wide BVH refer to ranges of blocks. The blocks and nodes
+// are mapped in place when the mesh is loaded from a scene cache. A mesh
+// streamed out of core keeps only the top of its BVH in bvh and blocks,
+// and reads the treelets below it on demand (see treelet.h).
+class MeshBLAS: public Hitable {
+public:
+    void build(const std::vector<Triangle> &mesh_triangles, BVHBuilder builder);
+    virtual bool hit(const Ray &r, float t_min, float t_max, HitRecord &rec) const;
+    // With a queue, treelets that are not in memory are skipped and queued
+    // instead of read
+    bool hit(const Ray &r, float t_min, float t_max, HitRecord &rec, TreeletQueue *deferred) const;
+    // Packet version of hit() for the rays [first, last]. For rays that hit
+    // closer than t_max, t_max is updated, hit is set and normal is set to
+    // the unnormalized normal of the triangle.
+    void hitPacket(const RayPacket &packet, int first, int last, float t_min, float t_max[], bool hit_mesh[],
+                   glm::vec3 normal[]) const;
+    bool hitTreelet(std::uint32_t index, const Ray &r, float t_min, float &closest, glm::vec3 &normal,
+                    TreeletQueue *deferred) const;
+
+    MappedArray<TriangleBlock> blocks;
+    BVH4 bvh;
+    BVHStats stats;
+    std::size_t num_triangles = 0;
+    std::shared_ptr<TreeletCache> treelets;  // Only for streamed meshes
+};
+
+inline void MeshBLAS::build(const std::vector<Triangle> &mesh_triangles, BVHBuilder builder)
+{
+    std::vector<AABB> bounds(mesh_triangles.size());
+    for (std::size_t i = 0; i < mesh_triangles.size(); ++i) {
+        bounds[i].grow(mesh_triangles[i].v0);
+        bounds[i].grow(mesh_triangles[i].v1);
+        bounds[i].grow(mesh_triangles[i].v2);
+    }
+
+    // Build a binary BVH with leaves of up to two blocks and collapse it into
+    // the 4-wide layout used for traversal
+    BVH binary_bvh;
+    binary_bvh.build(bounds, builder, 8, 4);
+    bvh.collapse(binary_bvh);
+    stats = binary_bvh.stats;
+    num_triangles = mesh_triangles.size();
+
+    // Pack the triangles of each leaf into blocks and point the leaves of
+    // the 4-wide BVH to their blocks instead of primitive slots
+    std::vector<Triangle> leaf_triangles;
+    std::vector<std::uint32_t> first_block(mesh_triangles.size());
+    std::vector<TriangleBlock> &packed = blocks.vector();
+    packed.clear();
+    for (std::size_t i = 0; i < binary_bvh.nodes.size(); ++i) {
+        const BVHNode &node = binary_bvh.nodes[i];
+        if (node.count == 0) continue;
+        leaf_triangles.clear();
+        for (std::uint32_t slot = node.offset; slot < node.offset + node.count; ++slot) {
+            leaf_triangles.push_back(mesh_triangles[binary_bvh.prim_indices[slot]]);
+        }
+        first_block[node.offset] = std::uint32_t(packed.size());
+        packTriangles(leaf_triangles.data(), int(leaf_triangles.size()), packed);
+    }
+    std::vector<BVH4Node> &nodes = bvh.nodes.vector();
+    for (std::size_t i = 0; i < nodes.size(); ++i) {
+        BVH4Node &node = nodes[i];
+        for (int c = 0; c < node.num_children; ++c) {
+            if (node.leaf_count[c] == 0) continue;
+            node.leaf_count[c] = std::uint8_t((node.leaf_count[c] + 3) / 4);
+            node.child[c] = first_block[node.child[c]];
+        }
+    }
+}
+
+inline bool MeshBLAS::hit(const Ray &r, float t_min, float t_max, HitRecord &rec) const
+{
+    return hit(r, t_min, t_max, rec, nullptr);
+}
+
+inline bool MeshBLAS::hit(const Ray &r, float t_min, float t_max, HitRecord &rec, TreeletQueue *deferred) const
+{
+    TriangleKernel kernel = triangleKernel();
+    const TriangleBlock *block_data = blocks.data();
+    float t_hit = t_max;
+    glm::vec3 normal;
+    auto hit_leaf = [&](std::uint32_t first, std::uint32_t count, float tmin, float &closest) {
+        bool hit_leaf = count == kTreeletLeafCount
+                            ? hitTreelet(first, r, tmin, closest, normal, deferred)
+                            : hitBlocks(kernel, block_data, first, count, r, tmin, closest, normal);
+        if (hit_leaf) t_hit = closest;
+        return hit_leaf;
+    };
+    if (!bvh.hit(r, t_min, t_max, hit_leaf)) return false;
+    rec.t = t_hit;
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = normal;
+    rec.material_id = 0;
+    return true;
+}
+
+inline void MeshBLAS::hitPacket(const RayPacket &packet, int first, int last, float t_min,
+                                float t_max[], bool hit_mesh[], glm::vec3 normal[]) const
+{
+    TriangleKernel kernel = triangleKernel();
+    const TriangleBlock *block_data = blocks.data();
+    auto hit_leaf = [&](int ray, std::uint32_t leaf_first, std::uint32_t count, float tmin,
+                        float &closest) {
+        bool hit_leaf = count == kTreeletLeafCount
+                            ? hitTreelet(leaf_first, packet.ray(ray), tmin, closest, normal[ray], nullptr)
+                            : hitBlocks(kernel, block_data, leaf_first, count, packet.ray(ray), tmin, closest,
+                                        normal[ray]);
+        if (hit_leaf) hit_mesh[ray] = true;
+        return hit_leaf;
+    };
+    bvh.hitPacket(packet, first, last, t_min, t_max, hit_leaf);
+}
+
+// Traces a ray through a treelet of a streamed mesh, which is read if it is
+// not in memory, unless the ray can be queued on it instead
+inline bool MeshBLAS::hitTreelet(std::uint32_t index, const Ray &r, float t_min, float &closest,
+                                 glm::vec3 &normal, TreeletQueue *deferred) const
+{
+    if (!deferred) {
+        std::shared_ptr<const Treelet> treelet = treelets->acquire(index);
+        return treelet && treelet->hit(triangleKernel(), r, t_min, closest, normal);
+    }
+    const Treelet *treelet = deferred->find(*treelets, index);
+    if (!treelet) {
+        deferred->push(index);
+        return false;
+    }
+    return treelet->hit(triangleKernel(), r, t_min, closest, normal);
+}
+
+// Placement of a mesh in the scene. Rays are transformed into the object
+// space of the mesh, so any number of instances can share one MeshBLAS.
+// The mesh pointer must stay valid for the lifetime of the instance.
+class Instance: public Hitable {
+public:
+    Instance() {}
+    Instance(const MeshBLAS *m, const glm::mat4 &transform, MaterialID mat)
+        : mesh(m), material_id(mat) { setTransform(transform); }
+    void setTransform(const glm::mat4 &transform);
+    AABB worldBounds() const;
+    virtual bool hit(const Ray &r, float t_min, float t_max, HitRecord &rec) const;
+    // Queues the ray on the treelets of a streamed mesh that are not in
+    // memory, to be traced later with hitTreelet()
+    bool hit(const Ray &r, float t_min, float t_max, HitRecord &rec, TreeletQueue *deferred) const;
+    bool hitTreelet(const Treelet &treelet, const Ray &r, float t_min, float t_max, HitRecord &rec) const;
+    // Intersect the rays [first, last] of a world space packet, updating
+    // t_max, hit and rec of the rays that hit the instance closer
+    void hitPacket(const RayPacket &packet, int first, int last, float t_min, float t_max[],
+                   bool hit[], HitRecord rec[]) const;
+    Ray objectRay(const Ray &r) const;
+
+    const MeshBLAS *mesh;
+    glm::mat4 world_from_object;
+    glm::mat4 object_from_world;
+    MaterialID material_id;
+};
+
+inline void Instance::setTransform(const glm::mat4 &transform)
+{
+    world_from_object = transform;
+    object_from_world = glm::inverse(transform);
+}
+
+inline AABB Instance::worldBounds() const
+{
+    AABB bounds;
+    if (mesh->bvh.nodes.empty()) return bounds;
+    const AABB &b = mesh->bvh.bounds;
+    for (int i = 0; i < 8; ++i) {
+        glm::vec3 corner((i & 1) ? b.bmax.x : b.bmin.x,
+                         (i & 2) ? b.bmax.y : b.bmin.y,
+                         (i & 4) ? b.bmax.z : b.bmin.z);
+        bounds.grow(glm::vec3(world_from_object * glm::vec4(corner, 1.0f)));
+    }
+    return bounds;
+}
+
+// The direction is not normalized, so t is the same in both spaces
+inline Ray Instance::objectRay(const Ray &r) const
+{
+    return Ray(glm::vec3(object_from_world * glm::vec4(r.origin(), 1.0f)),
+               glm::vec3(object_from_world * glm::vec4(r.direction(), 0.0f)));
+}
+
+inline bool Instance::hit(const Ray &r, float t_min, float t_max, HitRecord &rec) const
+{
+    return hit(r, t_min, t_max, rec, nullptr);
+}
+
+inline bool Instance::hit(const Ray &r, float t_min, float t_max, HitRecord &rec, TreeletQueue *deferred) const
+{
+    if (deferred) deferred->instance = this;
+    if (mesh->hit(objectRay(r), t_min, t_max, rec, deferred)) {
+        rec.p = r.point_at_parameter(rec.t);
+        rec.normal = glm::transpose(glm::mat3(object_from_world)) * rec.normal;
+        rec.material_id = material_id;
+        return true;
+    }
+    return false;
+}
+
+inline bool Instance::hitTreelet(const Treelet &treelet, const Ray &r, float t_min, float t_max,
+                                 HitRecord &rec) const
+{
+    float closest = t_max;
+    glm::vec3 normal;
+    if (!treelet.hit(triangleKernel(), objectRay(r), t_min, closest, normal)) return false;
+    rec.t = closest;
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = glm::transpose(glm::mat3(object_from_world)) * normal;
+    rec.material_id = material_id;
+    return true;
+}
+
+inline void Instance::hitPacket(const RayPacket &packet, int first, int last, float t_min,
+                                float t_max[], bool hit[], HitRecord rec[]) const
+{
+    // Same transform of the rays as in hit(), so that both give the same
+    // result. The frustum is rebuilt from the transformed corner rays.
+    RayPacket object_packet;
+    object_packet.width = packet.width;
+    object_packet.height = packet.height;
+    object_packet.origin = glm::vec3(object_from_world * glm::vec4(packet.origin, 1.0f));
+    for (int i = 0; i < packet.size(); ++i) {
+        glm::vec3 d(packet.dx[i], packet.dy[i], packet.dz[i]);
+        object_packet.setDirection(i, glm::vec3(object_from_world * glm::vec4(d, 0.0f)));
+    }
+    object_packet.finalize();
+
+    bool hit_mesh[kPacketSize];
+    glm::vec3 normal[kPacketSize];
+    for (int i = first; i <= last; ++i) hit_mesh[i] = false;
+    mesh->hitPacket(object_packet, first, last, t_min, t_max, hit_mesh, normal);
+
+    glm::mat3 normal_from_object = glm::transpose(glm::mat3(object_from_world));
+    for (int i = first; i <= last; ++i) {
+        if (!hit_mesh[i]) continue;
+        hit[i] = true;
+        rec[i].t = t_max[i];
+        rec[i].p = packet.ray(i).point_at_parameter(rec[i].t);
+        rec[i].normal = normal_from_object * normal[i];
+        rec[i].material_id = material_id;
+    }
+}
+
+} // namespace rt
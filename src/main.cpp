@@ -4,6 +4,8 @@
 //
 
 #include "raytracing.h"
+#include "material.h"
+#include "trace.h"
 #include "utils.h"
 #include "utils2.h"
 
@@ -33,6 +35,18 @@ struct Context {
     rt::RTContext rtx;
     GLuint texture = 0;
     float elapsed_time;
+    bool denoise = false;
+    int denoise_interval = 8;  // Frames between runs of the denoiser
+    int denoised_frame = -1;  // Frame of rtx.denoised, or -1 if there is none
+    int denoised_version = 0;  // Number of runs of the denoiser
+    // Display copy of the image, of which only dirty tiles are converted
+    // and uploaded to the texture
+    rt::DisplayFormat display_format = rt::DisplayFormat::Half;
+    std::vector<std::uint8_t> display;
+    int texture_width = 0;
+    int texture_height = 0;
+    rt::DisplayFormat texture_format = rt::DisplayFormat::Half;
+    int uploaded_version = -1;  // Version of the denoised image in the texture, or -1 for the image
 };
 
 // Returns the value of an environment variable
@@ -69,8 +83,32 @@ std::string modelDir(void)
     return rootDir + "/raytracer/3d_models/";
 }
 
-void createImageTexture(GLuint *texture, int width, int height)
+// Returns the absolute path to the model of the scene
+std::string modelFilename(void)
 {
+    return modelDir() + "bunny_lowpoly.obj";
+}
+
+void displayTextureFormat(rt::DisplayFormat format, GLint &internal_format, GLenum &pixel_format, GLenum &type)
+{
+    switch (format) {
+    case rt::DisplayFormat::Float32:
+        internal_format = GL_RGBA32F; pixel_format = GL_RGBA; type = GL_FLOAT;
+        break;
+    case rt::DisplayFormat::Half:
+        internal_format = GL_RGBA16F; pixel_format = GL_RGBA; type = GL_HALF_FLOAT;
+        break;
+    case rt::DisplayFormat::SharedExponent:
+        internal_format = GL_RGB9_E5; pixel_format = GL_RGB; type = GL_UNSIGNED_INT_5_9_9_9_REV;
+        break;
+    }
+}
+
+void createImageTexture(GLuint *texture, int width, int height, rt::DisplayFormat format)
+{
+    GLint internal_format;
+    GLenum pixel_format, type;
+    displayTextureFormat(format, internal_format, pixel_format, type);
     glDeleteTextures(1, texture);
     glGenTextures(1, texture);
     glBindTexture(GL_TEXTURE_2D, *texture);
@@ -78,7 +116,7 @@ void createImageTexture(GLuint *texture, int width, int height)
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, pixel_format, type, nullptr);
     glBindTexture(GL_TEXTURE_2D, 0);
 }
 
@@ -94,34 +132,119 @@ void init(Context &ctx)
 {
     ctx.program = loadShaderProgram(shaderDir() + "draw_image.vert",
                                     shaderDir() + "draw_image.frag");
-    createImageTexture(&ctx.texture, ctx.rtx.width, ctx.rtx.height);
 
     // Set up ray tracing scene
-    rt::setupScene(ctx.rtx, (modelDir() + "bunny_lowpoly.obj").c_str());
+    rt::setupScene(ctx.rtx, modelFilename().c_str());
+    // Show a low-resolution preview while the camera or a setting is being
+    // dragged and for a few frames after, and keep what the image had
+    // accumulated where it is still visible once the camera stops
+    ctx.rtx.use_reprojection = true;
+    ctx.rtx.preview_after_reset = 4;
 
     initializeTrackball(ctx);
 }
 
 void updateRayTracing(Context &ctx)
 {
+    RT_TRACE_SCOPE("updateRayTracing");
     // Check for convergence
-    if (ctx.rtx.current_frame >= ctx.rtx.max_frames) { return; }
+    if (ctx.rtx.current_frame >= ctx.rtx.max_frames || ctx.rtx.converged) { return; }
 
-    // Render as much as we can within the current frame
+    // Render as much as we can within the current frame, or a single
+    // preview while the view is changing
     float tic = glfwGetTime();
     while (true) {
+        bool preview = ctx.rtx.preview_frames_left > 0;
         rt::updateImage(ctx.rtx);
-        if (glfwGetTime() - tic > (1.0f / 60.0f)) { break; }
+        if (preview || glfwGetTime() - tic > (1.0f / 60.0f)) { break; }
+    }
+}
+
+// Filters the image every few frames, and once more when it is done or
+// frozen. Previews, normals and cost views are shown as they are.
+void updateDenoised(Context &ctx)
+{
+    rt::RTContext &rtx = ctx.rtx;
+    if (rtx.current_frame < ctx.denoised_frame) { ctx.denoised_frame = -1; }
+    if (!ctx.denoise || rtx.current_frame < 0 || rtx.preview_frames_left > 0 ||
+        rtx.show_normals || rtx.cost_view != rt::CostView::Off) { return; }
+
+    bool done = rtx.freeze || rtx.current_frame >= rtx.max_frames || rtx.converged;
+    if (ctx.denoised_frame < 0 || rtx.current_frame - ctx.denoised_frame >= ctx.denoise_interval ||
+        (done && ctx.denoised_frame != rtx.current_frame)) {
+        rt::denoiseImage(rtx);
+        ctx.denoised_frame = rtx.current_frame;
+        ctx.denoised_version += 1;
+    }
+}
+
+// Whether the denoised image is shown instead of the image
+bool showDenoised(const Context &ctx)
+{
+    return ctx.denoise && ctx.denoised_frame >= 0 && ctx.rtx.preview_frames_left == 0 &&
+           !ctx.rtx.show_normals && ctx.rtx.cost_view == rt::CostView::Off;
+}
+
+// Converts a rectangle of the image to the display copy and uploads it to
+// the bound texture
+void uploadRect(Context &ctx, const std::vector<glm::vec4> &image, const rt::PixelRect &rect)
+{
+    RT_TRACE_SCOPE("uploadRect");
+    rt::convertToDisplay(image, ctx.rtx.width, rect, ctx.texture_format, ctx.display);
+    GLint internal_format;
+    GLenum pixel_format, type;
+    displayTextureFormat(ctx.texture_format, internal_format, pixel_format, type);
+    std::size_t offset = (std::size_t(rect.y_begin) * ctx.rtx.width + rect.x_begin) *
+                         rt::displayPixelSize(ctx.texture_format);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, ctx.rtx.width);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x_begin, rect.y_begin, rect.x_end - rect.x_begin,
+                    rect.y_end - rect.y_begin, pixel_format, type, &ctx.display[offset]);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+// Uploads the tiles that changed since the last frame, or the whole
+// denoised image after each run of the denoiser. Once the render is done,
+// nothing is uploaded.
+void updateTexture(Context &ctx)
+{
+    rt::RTContext &rtx = ctx.rtx;
+    if (rtx.image.size() != std::size_t(rtx.width * rtx.height)) { return; }
+    if (ctx.texture_width != rtx.width || ctx.texture_height != rtx.height ||
+        ctx.texture_format != ctx.display_format) {
+        createImageTexture(&ctx.texture, rtx.width, rtx.height, ctx.display_format);
+        ctx.texture_width = rtx.width;
+        ctx.texture_height = rtx.height;
+        ctx.texture_format = ctx.display_format;
+        ctx.display.resize(rtx.image.size() * rt::displayPixelSize(ctx.texture_format));
+        rtx.dirty_tiles.markAll();
+        ctx.uploaded_version = -1;
+    }
+    glBindTexture(GL_TEXTURE_2D, ctx.texture);
+
+    if (showDenoised(ctx)) {
+        rtx.dirty_tiles.clear();
+        if (ctx.uploaded_version != ctx.denoised_version) {
+            rt::PixelRect all = { 0, 0, rtx.width, rtx.height };
+            uploadRect(ctx, rtx.denoised, all);
+            ctx.uploaded_version = ctx.denoised_version;
+        }
+        return;
+    }
+    if (ctx.uploaded_version >= 0) {
+        rtx.dirty_tiles.markAll();
+        ctx.uploaded_version = -1;
+    }
+    std::vector<rt::PixelRect> rects = rtx.dirty_tiles.take();
+    for (std::size_t i = 0; i < rects.size(); ++i) {
+        uploadRect(ctx, rtx.image, rects[i]);
     }
 }
 
 void drawImage(Context &ctx)
 {
-    // Bind and upload texture
+    RT_TRACE_SCOPE("drawImage");
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, ctx.texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, ctx.rtx.width, ctx.rtx.height,
-                 0, GL_RGBA, GL_FLOAT, &ctx.rtx.image[0]);
+    updateTexture(ctx);
 
     // Activate program and pass uniform for texture unit
     glUseProgram(ctx.program);
@@ -132,9 +255,72 @@ void drawImage(Context &ctx)
     glDrawArrays(GL_TRIANGLES, 0, 3);
 }
 
+// Counters of the tracer since the last reset
+void showStats(const rt::RenderStats &stats)
+{
+#if defined(RT_ENABLE_STATS)
+    if (!ImGui::CollapsingHeader("Statistics")) return;
+    double samples = double(std::max(stats.samples, std::uint64_t(1)));
+    ImGui::Text("Samples/s: %.2f M", stats.samplesPerSecond() * 1e-6);
+    ImGui::Text("Rays/s: %.2f M", stats.seconds > 0.0 ? stats.totalRays() / stats.seconds * 1e-6 : 0.0);
+    for (int i = 0; i < rt::kStatsMaxDepth; ++i) {
+        if (stats.rays[i] == 0) continue;
+        ImGui::Text("  Rays at depth %d%s: %.3f per sample", i, i + 1 == rt::kStatsMaxDepth ? "+" : "",
+                    stats.rays[i] / samples);
+    }
+    ImGui::Text("BVH nodes per sample: %.1f (packets: %.2f)", stats.node_visits / samples,
+                stats.packet_node_visits / samples);
+    ImGui::Text("Tests per sample: spheres %.1f, boxes %.1f", stats.sphere_tests / samples,
+                stats.box_tests / samples);
+    ImGui::Text("  instances %.1f, triangles %.1f", stats.instance_tests / samples,
+                stats.triangle_tests / samples);
+    double paths = double(std::max(stats.paths_escaped + stats.paths_absorbed + stats.paths_max_bounces,
+                                   std::uint64_t(1)));
+    ImGui::Text("Paths: %.1f%% sky, %.1f%% absorbed, %.1f%% max bounces", 100.0 * stats.paths_escaped / paths,
+                100.0 * stats.paths_absorbed / paths, 100.0 * stats.paths_max_bounces / paths);
+    if (stats.treelet_reads > 0) {
+        ImGui::Text("Treelets read: %llu (%.1f MB), rays queued: %llu", (unsigned long long)stats.treelet_reads,
+                    stats.treelet_bytes_read / 1048576.0, (unsigned long long)stats.rays_deferred);
+    }
+#else
+    (void)stats;
+#endif
+}
+
+// Editor of the material table. Edits are copied into the table, which
+// restarts the accumulation like any other change of the scene.
+void showMaterials(Context &ctx)
+{
+    if (!ImGui::CollapsingHeader("Materials")) return;
+    const std::vector<rt::Material> &materials = rt::sceneMaterials();
+    for (std::size_t i = 0; i < materials.size(); ++i) {
+        rt::Material material = materials[i];
+        bool changed = false;
+        ImGui::PushID(int(i));
+        ImGui::Text("Material %d", int(i));
+        int type = int(material.type);
+        if (ImGui::Combo("Type", &type, "Lambertian\0Metal\0Dielectric\0\0")) {
+            material.type = rt::MaterialType(type);
+            changed = true;
+        }
+        if (material.type != rt::MaterialType::Dielectric) {
+            changed |= ImGui::ColorEdit3("Albedo", &material.albedo[0]);
+        }
+        if (material.type == rt::MaterialType::Metal) {
+            changed |= ImGui::SliderFloat("Fuzz", &material.fuzz, 0.0f, 1.0f);
+        }
+        if (material.type == rt::MaterialType::Dielectric) {
+            changed |= ImGui::SliderFloat("Refractive index", &material.ref_idx, 1.0f, 2.5f);
+        }
+        ImGui::PopID();
+        if (changed) rt::setMaterial(ctx.rtx, rt::MaterialID(i), material);
+    }
+}
+
 // MODIFY THIS FUNCTION
 void showGui(Context &ctx)
 {
+    RT_TRACE_SCOPE("showGui");
     if (ImGui::SliderInt("Max bounces", &ctx.rtx.max_bounces, 0, 10)) {
         rt::resetAccumulation(ctx.rtx);
     }
@@ -147,11 +333,75 @@ void showGui(Context &ctx)
     if (ImGui::Checkbox("Show normals", &ctx.rtx.show_normals)) {
         rt::resetAccumulation(ctx.rtx);
     }
+    ImGui::Checkbox("Ray packets", &ctx.rtx.use_packets);
+    ImGui::Checkbox("Wavefront paths", &ctx.rtx.use_wavefront);
+    // Only the views that this build measures are offered
+    const char *cost_view_names[] = { "Off", "BVH nodes", "Primitive tests", "Path length", "Time (ns)" };
+    const int kNumCostViews = int(sizeof(cost_view_names) / sizeof(cost_view_names[0]));
+    rt::CostView cost_views[kNumCostViews];
+    const char *names[kNumCostViews];
+    int num_cost_views = 0, cost_view = 0;
+    for (int i = 0; i < kNumCostViews; ++i) {
+        if (!rt::costViewAvailable(rt::CostView(i))) continue;
+        if (rt::CostView(i) == ctx.rtx.cost_view) cost_view = num_cost_views;
+        cost_views[num_cost_views] = rt::CostView(i);
+        names[num_cost_views++] = cost_view_names[i];
+    }
+    if (ImGui::Combo("Cost view", &cost_view, names, num_cost_views)) {
+        ctx.rtx.cost_view = cost_views[cost_view];
+        rt::resetAccumulation(ctx.rtx);
+    }
+    if (ctx.rtx.cost_view != rt::CostView::Off &&
+        ImGui::SliderFloat("Cost max (0 = default)", &ctx.rtx.cost_max, 0.0f, 1000.0f)) {
+        rt::resetAccumulation(ctx.rtx);
+    }
+    if (ImGui::SliderFloat("Adaptive error (0 = off)", &ctx.rtx.adaptive_threshold, 0.0f, 0.1f)) {
+        rt::resetAccumulation(ctx.rtx);
+    }
+    ImGui::SliderInt("Threads (0 = all)", &ctx.rtx.num_threads, 0, 64);
+    // Reloads the scene, mapping the mesh from <model>.rtcache, which is
+    // written next to the model the first time
+    if (ImGui::Checkbox("Scene cache", &ctx.rtx.use_scene_cache)) {
+        rt::setupScene(ctx.rtx, modelFilename().c_str());
+        rt::resetAccumulation(ctx.rtx);
+    }
+    int display_format = int(ctx.display_format);
+    if (ImGui::Combo("Display format", &display_format, "RGBA32F\0RGBA16F\0RGB9_E5\0\0")) {
+        ctx.display_format = rt::DisplayFormat(display_format);
+    }
+    ImGui::Checkbox("Reproject on camera motion", &ctx.rtx.use_reprojection);
+    if (ctx.rtx.use_reprojection) {
+        ImGui::SliderFloat("Max reprojected samples", &ctx.rtx.reprojection_max_samples, 1.0f, 256.0f);
+    }
+    ImGui::SliderInt("Preview frames (0 = off)", &ctx.rtx.preview_after_reset, 0, 30);
+    ImGui::SliderFloat("Preview target (ms)", &ctx.rtx.preview_target_ms, 5.0f, 100.0f);
+    if (ctx.rtx.preview_frames_left > 0) {
+        ImGui::Text("Preview at 1/%d resolution", ctx.rtx.preview_scale * ctx.rtx.preview_scale);
+    }
+    if (ImGui::Checkbox("Denoise", &ctx.denoise)) {
+        ctx.denoised_frame = -1;
+    }
+    if (ctx.denoise) {
+        ImGui::SliderInt("Denoise every N frames", &ctx.denoise_interval, 1, 64);
+        rt::DenoiseSettings &settings = ctx.rtx.denoise_settings;
+        bool changed = ImGui::SliderInt("Denoise iterations", &settings.iterations, 1, 8);
+        changed |= ImGui::SliderFloat("Sigma color", &settings.sigma_color, 0.05f, 4.0f);
+        changed |= ImGui::SliderFloat("Sigma normal", &settings.sigma_normal, 0.05f, 2.0f);
+        changed |= ImGui::SliderFloat("Sigma position", &settings.sigma_position, 0.01f, 2.0f);
+        changed |= ImGui::SliderFloat("Sigma albedo", &settings.sigma_albedo, 0.01f, 2.0f);
+        if (changed) { ctx.denoised_frame = -1; }
+    }
+    showMaterials(ctx);
     // Add more settings and parameters here
     // ...
 
     ImGui::Text("Progress");
     ImGui::ProgressBar(float(ctx.rtx.current_frame) / ctx.rtx.max_frames);
+    if (!ctx.rtx.tile_converged.empty()) {
+        int converged = int(std::count(ctx.rtx.tile_converged.begin(), ctx.rtx.tile_converged.end(), 1));
+        ImGui::Text("Converged tiles: %d/%d", converged, int(ctx.rtx.tile_converged.size()));
+    }
+    showStats(ctx.rtx.stats);
     if (ImGui::Button("Freeze/Resume")) {
         ctx.rtx.freeze = !ctx.rtx.freeze;
     }
@@ -159,6 +409,15 @@ void showGui(Context &ctx)
     if (ImGui::Button("Reset")) {
         rt::resetImage(ctx.rtx);
     }
+
+    bool tracing = rt::tracingEnabled();
+    if (ImGui::Checkbox("Record trace", &tracing)) {
+        rt::setTracing(tracing);
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Save trace.json")) {
+        rt::writeTrace("trace.json");
+    }
 }
 
 void display(Context &ctx)
@@ -169,18 +428,33 @@ void display(Context &ctx)
     // Update view matrix
     glm::mat4 trackball = trackballGetRotationMatrix(ctx.trackball);
     glm::vec3 eye = glm::mat3(trackball) * glm::vec3(0.0f, 0.0f, 2.0f);
-    ctx.rtx.view = glm::lookAt(eye, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-    if (ctx.trackball.tracking) {
-        rt::resetAccumulation(ctx.rtx);
-    }
+    rt::setView(ctx.rtx, glm::lookAt(eye, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
 
     // Update and draw ray tracing image
     updateRayTracing(ctx);
+    updateDenoised(ctx);
     drawImage(ctx);
 
     showGui(ctx);
 }
 
+// Whether the next frame would show the same image as the last one
+bool renderingIdle(const Context &ctx)
+{
+    const rt::RTContext &rtx = ctx.rtx;
+    bool done = rtx.freeze || rtx.current_frame >= rtx.max_frames || rtx.converged;
+    if (!done || rtx.preview_frames_left > 0 || ctx.texture_width != rtx.width ||
+        ctx.texture_height != rtx.height || ctx.texture_format != ctx.display_format) {
+        return false;
+    }
+    if (ctx.denoise && !rtx.show_normals && rtx.cost_view == rt::CostView::Off &&
+        ctx.denoised_frame != rtx.current_frame) {
+        return false;  // The denoiser runs once more
+    }
+    if (showDenoised(ctx)) { return ctx.uploaded_version == ctx.denoised_version; }
+    return ctx.uploaded_version < 0 && !rtx.dirty_tiles.any();
+}
+
 void reloadShaders(Context *ctx)
 {
     glDeleteProgram(ctx->program);
@@ -314,15 +588,34 @@ int main(void)
     glGenVertexArrays(1, &ctx.defaultVAO);
     glBindVertexArray(ctx.defaultVAO);
     init(ctx);
+    rt::setTraceThreadName("main");
 
     // Start rendering loop
     while (!glfwWindowShouldClose(ctx.window)) {
-        glfwPollEvents();
+        RT_TRACE_SCOPE("frame");
+        // Once the image is done and shown, wait for input instead of
+        // drawing the same frame again
+        if (renderingIdle(ctx)) {
+            glfwWaitEvents();
+        }
+        else {
+            glfwPollEvents();
+        }
         ctx.elapsed_time = glfwGetTime();
         ImGui_ImplGlfwGL3_NewFrame();
         display(ctx);
-        ImGui::Render();
-        glfwSwapBuffers(ctx.window);
+        {
+            RT_TRACE_SCOPE("ImGui::Render");
+            ImGui::Render();
+        }
+        {
+            RT_TRACE_SCOPE("glfwSwapBuffers");
+            glfwSwapBuffers(ctx.window);
+        }
+    }
+    if (rt::tracingEnabled()) {
+        rt::writeTrace("trace.json");
+        std::cout << "Wrote trace.json" << std::endl;
     }
 
     // Shutdown
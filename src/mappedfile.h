@@ -0,0 +1,206 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace rt {
+
+// Read-only view of a whole file, mapped into memory where the platform
+// allows it and read into a buffer otherwise
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool open(const std::string &filename)
+    {
+        close();
+#if defined(_WIN32)
+        std::ifstream file(filename.c_str(), std::ios::binary);
+        if (!file) return false;
+        buffer_.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+        return true;
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            ::close(fd);
+            return false;
+        }
+        size_ = std::size_t(info.st_size);
+        if (size_ > 0) {
+            void *mapping = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                ::close(fd);
+                size_ = 0;
+                return false;
+            }
+            ::madvise(mapping, size_, MADV_WILLNEED);  // Readers jump around instead of reading sequentially
+            data_ = static_cast<const char *>(mapping);
+            mapped_ = true;
+        }
+        ::close(fd);  // The mapping stays valid
+        return true;
+#endif
+    }
+
+    void close()
+    {
+#if !defined(_WIN32)
+        if (mapped_) ::munmap(const_cast<char *>(data_), size_);
+#endif
+        buffer_.clear();
+        data_ = nullptr;
+        size_ = 0;
+        mapped_ = false;
+    }
+
+    const char *data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+private:
+    const char *data_ = nullptr;
+    std::size_t size_ = 0;
+    bool mapped_ = false;
+    std::vector<char> buffer_;
+};
+
+// 64-bit FNV-1a over 8-byte words with an extra shift to mix the high bits
+// down. Not cryptographic, but every step is invertible, so changing any one
+// word always changes the hash, and it runs at several GB/s.
+inline std::uint64_t hashBytes(const void *data, std::size_t size,
+                               std::uint64_t h = 14695981039346656037ull)
+{
+    const std::uint64_t kPrime = 1099511628211ull;
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    std::size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, p + i, sizeof(word));
+        h = (h ^ word) * kPrime;
+        h ^= h >> 29;
+    }
+    for (; i < size; ++i) {
+        h = (h ^ p[i]) * kPrime;
+    }
+    return h;
+}
+
+// File read in ranges at arbitrary offsets, by any number of threads at once
+class PagedFile {
+public:
+    PagedFile() = default;
+    ~PagedFile() { close(); }
+
+    PagedFile(const PagedFile &) = delete;
+    PagedFile &operator=(const PagedFile &) = delete;
+
+    bool open(const std::string &filename)
+    {
+        close();
+#if defined(_WIN32)
+        file_.open(filename.c_str(), std::ios::binary);
+        return bool(file_);
+#else
+        fd_ = ::open(filename.c_str(), O_RDONLY);
+        return fd_ >= 0;
+#endif
+    }
+
+    void close()
+    {
+#if defined(_WIN32)
+        file_.close();
+#else
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+#endif
+    }
+
+    bool read(std::uint64_t offset, std::size_t size, void *data) const
+    {
+#if defined(_WIN32)
+        std::lock_guard<std::mutex> lock(mutex_);
+        file_.clear();
+        file_.seekg(std::streamoff(offset));
+        file_.read(static_cast<char *>(data), std::streamsize(size));
+        return bool(file_);
+#else
+        char *dst = static_cast<char *>(data);
+        while (size > 0) {
+            ssize_t n = ::pread(fd_, dst, size, off_t(offset));
+            if (n <= 0) return false;
+            dst += n;
+            offset += std::uint64_t(n);
+            size -= std::size_t(n);
+        }
+        return true;
+#endif
+    }
+
+private:
+#if defined(_WIN32)
+    mutable std::mutex mutex_;
+    mutable std::ifstream file_;
+#else
+    int fd_ = -1;
+#endif
+};
+
+// Array of trivially copyable elements that are either owned or read in
+// place from a mapped file, which the array keeps open. Mapped elements are
+// read-only; taking the vector for writing drops the mapping.
+template <typename T>
+class MappedArray {
+public:
+    std::vector<T> &vector()
+    {
+        file_.reset();
+        return elements_;
+    }
+
+    // Maps count elements at offset in the file, which must be aligned for T
+    void map(std::shared_ptr<const MappedFile> file, std::size_t offset, std::size_t count)
+    {
+        std::vector<T>().swap(elements_);
+        mapped_ = reinterpret_cast<const T *>(file->data() + offset);
+        mapped_size_ = count;
+        file_ = std::move(file);
+    }
+
+    bool isMapped() const { return file_ != nullptr; }
+    const T *data() const { return file_ ? mapped_ : elements_.data(); }
+    std::size_t size() const { return file_ ? mapped_size_ : elements_.size(); }
+    bool empty() const { return size() == 0; }
+    const T &operator[](std::size_t i) const { return data()[i]; }
+
+private:
+    std::vector<T> elements_;
+    std::shared_ptr<const MappedFile> file_;
+    const T *mapped_ = nullptr;
+    std::size_t mapped_size_ = 0;
+};
+
+} // namespace rt
@@ -0,0 +1,297 @@
+#pragma once
+
+#include "mappedfile.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+namespace rt {
+
+const std::uint32_t kOBJNoIndex = 0xffffffffu;
+
+// Contents of a Wavefront OBJ file, with polygons split into triangle fans.
+// Each corner holds the (0-based) index of its position, texture coordinate
+// and normal, or kOBJNoIndex for the ones the face does not have.
+struct OBJData {
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> texcoords;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::uvec3> corners;
+};
+
+namespace obj {
+
+inline const char *skipSpace(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+    return p;
+}
+
+inline const char *parseFloat(const char *p, const char *end, float &value)
+{
+    p = skipSpace(p, end);
+    if (p < end && *p == '+') ++p;
+#if defined(__cpp_lib_to_chars)
+    std::from_chars_result result = std::from_chars(p, end, value);
+    return result.ec == std::errc() ? result.ptr : nullptr;
+#else
+    // strtof() needs a terminated string, which the mapping is not
+    char token[64];
+    std::size_t n = 0;
+    while (p + n < end && n + 1 < sizeof(token) && p[n] != ' ' && p[n] != '\t' && p[n] != '\r') {
+        token[n] = p[n];
+        ++n;
+    }
+    token[n] = '\0';
+    char *token_end;
+    value = std::strtof(token, &token_end);
+    return token_end != token ? p + (token_end - token) : nullptr;
+#endif
+}
+
+// A vector of up to three floats; missing ones are zero
+inline glm::vec3 parseVector(const char *p, const char *end)
+{
+    glm::vec3 v(0.0f);
+    for (int i = 0; i < 3 && p != nullptr; ++i) {
+        p = parseFloat(p, end, v[i]);
+    }
+    return v;
+}
+
+// Resolves a 1-based index, or a negative one relative to the count of
+// elements before the line. Returns kOBJNoIndex if it is out of range.
+inline std::uint32_t resolveIndex(long index, std::size_t count_before, std::size_t total)
+{
+    long long i = index > 0 ? index - 1 : (long long)(count_before) + index;
+    return (index != 0 && i >= 0 && (unsigned long long)(i) < total) ? std::uint32_t(i) : kOBJNoIndex;
+}
+
+enum LineType { kOther, kPosition, kTexcoord, kNormal, kFace };
+
+// Type of the line at p, and p after its keyword
+inline LineType lineType(const char *&p, const char *end)
+{
+    p = skipSpace(p, end);
+    if (end - p < 2) return kOther;
+    if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+        p += 2;
+        return kFace;
+    }
+    if (p[0] != 'v') return kOther;
+    if (p[1] == ' ' || p[1] == '\t') {
+        p += 2;
+        return kPosition;
+    }
+    if (end - p < 3 || (p[2] != ' ' && p[2] != '\t')) return kOther;
+    if (p[1] == 't') {
+        p += 3;
+        return kTexcoord;
+    }
+    if (p[1] == 'n') {
+        p += 3;
+        return kNormal;
+    }
+    return kOther;
+}
+
+inline const char *lineEnd(const char *p, const char *end)
+{
+    const char *newline = static_cast<const char *>(std::memchr(p, '\n', end - p));
+    return newline != nullptr ? newline : end;
+}
+
+// Lines of the file that one thread parses, and what it found in them
+struct Chunk {
+    const char *begin;
+    const char *end;
+    std::size_t num_positions = 0;
+    std::size_t num_texcoords = 0;
+    std::size_t num_normals = 0;
+    std::size_t first_position = 0;
+    std::size_t first_texcoord = 0;
+    std::size_t first_normal = 0;
+    std::vector<glm::uvec3> corners;
+    bool valid = true;
+};
+
+// Adds the triangle fan of the face at p to the corners of the chunk
+inline bool parseFace(const char *p, const char *end, const Chunk &chunk, std::size_t positions_before,
+                      std::size_t texcoords_before, std::size_t normals_before, const OBJData &data,
+                      std::vector<glm::uvec3> &polygon, std::vector<glm::uvec3> &corners)
+{
+    polygon.clear();
+    while (true) {
+        p = skipSpace(p, end);
+        if (p == end || *p == '\r' || *p == '#') break;
+        long index[3] = { 0, 0, 0 };
+        for (int i = 0; i < 3; ++i) {
+            if (i > 0) {
+                if (p == end || *p != '/') break;
+                ++p;
+                if (p < end && *p == '/') continue;  // v//n
+            }
+            std::from_chars_result result = std::from_chars(p, end, index[i]);
+            if (result.ec != std::errc()) return false;
+            p = result.ptr;
+        }
+        glm::uvec3 corner(resolveIndex(index[0], chunk.first_position + positions_before, data.positions.size()),
+                          kOBJNoIndex, kOBJNoIndex);
+        if (corner.x == kOBJNoIndex) return false;
+        if (index[1] != 0) {
+            corner.y = resolveIndex(index[1], chunk.first_texcoord + texcoords_before, data.texcoords.size());
+            if (corner.y == kOBJNoIndex) return false;
+        }
+        if (index[2] != 0) {
+            corner.z = resolveIndex(index[2], chunk.first_normal + normals_before, data.normals.size());
+            if (corner.z == kOBJNoIndex) return false;
+        }
+        polygon.push_back(corner);
+    }
+    for (std::size_t i = 2; i < polygon.size(); ++i) {
+        corners.push_back(polygon[0]);
+        corners.push_back(polygon[i - 1]);
+        corners.push_back(polygon[i]);
+    }
+    return true;
+}
+
+// Counts the vertex lines of the chunk, so that each chunk knows where its
+// vertices go before any is parsed
+inline void countChunk(Chunk &chunk)
+{
+    for (const char *line = chunk.begin; line < chunk.end;) {
+        const char *end = lineEnd(line, chunk.end);
+        const char *p = line;
+        switch (lineType(p, end)) {
+        case kPosition: chunk.num_positions += 1; break;
+        case kTexcoord: chunk.num_texcoords += 1; break;
+        case kNormal: chunk.num_normals += 1; break;
+        default: break;
+        }
+        line = end + 1;
+    }
+}
+
+inline void parseChunk(Chunk &chunk, OBJData &data)
+{
+    std::size_t positions = 0, texcoords = 0, normals = 0;
+    std::vector<glm::uvec3> polygon;
+    for (const char *line = chunk.begin; line < chunk.end;) {
+        const char *end = lineEnd(line, chunk.end);
+        const char *p = line;
+        switch (lineType(p, end)) {
+        case kPosition: data.positions[chunk.first_position + positions++] = parseVector(p, end); break;
+        case kTexcoord: data.texcoords[chunk.first_texcoord + texcoords++] = parseVector(p, end); break;
+        case kNormal: data.normals[chunk.first_normal + normals++] = parseVector(p, end); break;
+        case kFace:
+            if (!parseFace(p, end, chunk, positions, texcoords, normals, data, polygon, chunk.corners)) {
+                chunk.valid = false;
+            }
+            break;
+        default: break;
+        }
+        line = end + 1;
+    }
+}
+
+} // namespace obj
+
+// Parses OBJ text in chunks of whole lines, in parallel: a first pass
+// counts the vertices of each chunk, and a second one parses them into
+// place and resolves the face indices. Returns false if a face refers to a
+// vertex that does not exist.
+inline bool parseOBJ(const char *text, std::size_t size, OBJData &data, int num_threads = 0)
+{
+#if defined(_OPENMP)
+    if (num_threads <= 0) num_threads = omp_get_max_threads();
+#else
+    num_threads = 1;
+#endif
+    const std::size_t kMinChunkSize = 1 << 20;
+    std::size_t num_chunks = std::max<std::size_t>(1, std::min<std::size_t>(size / kMinChunkSize, 8 * num_threads));
+    std::vector<obj::Chunk> chunks;
+    const char *end = text + size;
+    const char *begin = text;
+    for (std::size_t i = 1; i <= num_chunks && begin < end; ++i) {
+        const char *split = i == num_chunks ? end : obj::lineEnd(text + size / num_chunks * i, end);
+        if (split < begin) continue;  // The previous chunk ended on a long line
+        obj::Chunk chunk;
+        chunk.begin = begin;
+        chunk.end = split;
+        chunks.push_back(chunk);
+        begin = split == end ? end : split + 1;
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(num_threads)
+    for (int i = 0; i < int(chunks.size()); ++i) {
+        obj::countChunk(chunks[i]);
+    }
+    std::size_t num_positions = 0, num_texcoords = 0, num_normals = 0;
+    for (std::size_t i = 0; i < chunks.size(); ++i) {
+        chunks[i].first_position = num_positions;
+        chunks[i].first_texcoord = num_texcoords;
+        chunks[i].first_normal = num_normals;
+        num_positions += chunks[i].num_positions;
+        num_texcoords += chunks[i].num_texcoords;
+        num_normals += chunks[i].num_normals;
+    }
+    data.positions.resize(num_positions);
+    data.texcoords.resize(num_texcoords);
+    data.normals.resize(num_normals);
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(num_threads)
+    for (int i = 0; i < int(chunks.size()); ++i) {
+        obj::parseChunk(chunks[i], data);
+    }
+    std::size_t num_corners = 0;
+    bool valid = true;
+    for (std::size_t i = 0; i < chunks.size(); ++i) {
+        num_corners += chunks[i].corners.size();
+        valid = valid && chunks[i].valid;
+    }
+    data.corners.clear();
+    data.corners.reserve(num_corners);
+    for (std::size_t i = 0; i < chunks.size(); ++i) {
+        data.corners.insert(data.corners.end(), chunks[i].corners.begin(), chunks[i].corners.end());
+    }
+    return valid;
+}
+
+// Unique corners in the order of their first use, and the index of each
+// corner into them, through an open-addressing hash table
+inline void uniqueOBJCorners(const std::vector<glm::uvec3> &corners, std::vector<glm::uvec3> &unique,
+                             std::vector<std::uint32_t> &indices)
+{
+    std::size_t capacity = 16;
+    while (capacity < corners.size() * 2) capacity *= 2;
+    std::vector<std::uint32_t> table(capacity, kOBJNoIndex);  // Indices into unique
+    unique.clear();
+    indices.resize(corners.size());
+    for (std::size_t i = 0; i < corners.size(); ++i) {
+        const glm::uvec3 &c = corners[i];
+        std::uint64_t h = (c.x * 0x9e3779b97f4a7c15ull) ^ (c.y * 0xc2b2ae3d27d4eb4full) ^ (c.z * 0x165667b19e3779f9ull);
+        std::size_t slot = std::size_t(h ^ (h >> 29)) & (capacity - 1);
+        while (table[slot] != kOBJNoIndex && unique[table[slot]] != c) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (table[slot] == kOBJNoIndex) {
+            table[slot] = std::uint32_t(unique.size());
+            unique.push_back(c);
+        }
+        indices[i] = table[slot];
+    }
+}
+
+} // namespace rt
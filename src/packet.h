@@ -0,0 +1,123 @@
+#pragma once
+
+#include "ray.h"
+
+#include <glm/gtx/component_wise.hpp>
+
+#include <cmath>
+
+namespace rt {
+
+// Primary rays are traced as packets of up to 8x8 pixels
+const int kPacketWidth = 8;
+const int kPacketHeight = 8;
+const int kPacketSize = kPacketWidth * kPacketHeight;
+
+// Below this number of rays, a packet that has diverged in the hierarchy is
+// traced as single rays instead
+const int kMinPacketRays = 4;
+
+// Four planes through the common origin of a packet that enclose all of its
+// rays. The normals point outwards, so a box is outside the frustum if it is
+// entirely on the positive side of one of the planes.
+struct Frustum {
+    glm::vec3 normal[4];
+    float offset[4];
+
+    bool culls(const glm::vec3 &bmin, const glm::vec3 &bmax) const
+    {
+        for (int i = 0; i < 4; ++i) {
+            const glm::vec3 &n = normal[i];
+            // Corner of the box that is furthest on the inner side
+            glm::vec3 p(n.x > 0.0f ? bmin.x : bmax.x,
+                        n.y > 0.0f ? bmin.y : bmax.y,
+                        n.z > 0.0f ? bmin.z : bmax.z);
+            float dist = glm::dot(n, p) - offset[i];
+            // Tolerance for rays that lie on the planes
+            float eps = 1e-5f * (1.0f + std::fabs(offset[i]) + glm::compMax(glm::abs(p)));
+            if (dist > eps) return true;
+        }
+        return false;
+    }
+};
+
+// Rays of a rectangular block of pixels sharing one origin, stored in
+// row-major order. The corner rays must bound the others, which is the case
+// for a pinhole camera and for any affine transform of such a packet.
+struct RayPacket {
+    int width = 0;
+    int height = 0;
+    glm::vec3 origin;
+    float dx[kPacketSize], dy[kPacketSize], dz[kPacketSize];
+    float idx[kPacketSize], idy[kPacketSize], idz[kPacketSize];
+    Frustum frustum;
+
+    int size() const { return width * height; }
+    Ray ray(int i) const { return Ray(origin, glm::vec3(dx[i], dy[i], dz[i])); }
+    void setDirection(int i, const glm::vec3 &d) { dx[i] = d.x; dy[i] = d.y; dz[i] = d.z; }
+
+    // Compute the inverse directions and the frustum once all rays are set
+    void finalize();
+
+    // Slab test of ray i against a box
+    bool hitBox(int i, const glm::vec3 &bmin, const glm::vec3 &bmax, float t_min, float t_max,
+                float &t_entry) const
+    {
+        float t0x = (bmin.x - origin.x) * idx[i], t1x = (bmax.x - origin.x) * idx[i];
+        float t0y = (bmin.y - origin.y) * idy[i], t1y = (bmax.y - origin.y) * idy[i];
+        float t0z = (bmin.z - origin.z) * idz[i], t1z = (bmax.z - origin.z) * idz[i];
+        float tnear = glm::max(glm::max(t_min, glm::min(t0x, t1x)),
+                               glm::max(glm::min(t0y, t1y), glm::min(t0z, t1z)));
+        float tfar = glm::min(glm::min(t_max, glm::max(t0x, t1x)),
+                              glm::min(glm::max(t0y, t1y), glm::max(t0z, t1z)));
+        t_entry = tnear;
+        return tnear <= tfar;
+    }
+
+    // Narrow the ray range [first, last] to the first and last ray that hit
+    // the box. Returns false if no ray in the range hits it.
+    bool clipRange(const glm::vec3 &bmin, const glm::vec3 &bmax, float t_min, const float t_max[],
+                   int &first, int &last, float &t_entry) const
+    {
+        float t;
+        int i = first;
+        while (i <= last && !hitBox(i, bmin, bmax, t_min, t_max[i], t_entry)) ++i;
+        if (i > last) return false;
+        int j = last;
+        while (j > i && !hitBox(j, bmin, bmax, t_min, t_max[j], t)) --j;
+        first = i;
+        last = j;
+        return true;
+    }
+};
+
+inline void RayPacket::finalize()
+{
+    for (int i = 0; i < size(); ++i) {
+        idx[i] = 1.0f / dx[i];
+        idy[i] = 1.0f / dy[i];
+        idz[i] = 1.0f / dz[i];
+    }
+
+    // Planes through consecutive corner rays, in order around the packet
+    int corners[4] = { 0, width - 1, size() - 1, size() - width };
+    glm::vec3 center(0.0f);
+    for (int k = 0; k < 4; ++k) {
+        center += glm::vec3(dx[corners[k]], dy[corners[k]], dz[corners[k]]);
+    }
+    for (int k = 0; k < 4; ++k) {
+        int a = corners[k];
+        int b = corners[(k + 1) % 4];
+        glm::vec3 n = glm::cross(glm::vec3(dx[a], dy[a], dz[a]), glm::vec3(dx[b], dy[b], dz[b]));
+        float len = glm::length(n);
+        // Coinciding corners (packets that are one ray wide) give no plane
+        if (len > 0.0f) {
+            n /= len;
+            if (glm::dot(n, center) > 0.0f) n = -n;
+        }
+        frustum.normal[k] = n;
+        frustum.offset[k] = glm::dot(n, origin);
+    }
+}
+
+} // namespace rt
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace rt {
+
+// Writes the average radiance of an accumulated image (sums of the samples
+// in RGB and their number in alpha) as a little-endian PFM image. PFM stores
+// rows bottom to top, like the image of the ray tracer.
+inline bool writePFM(const std::string &filename, int width, int height, const std::vector<glm::vec4> &image)
+{
+    std::ofstream file(filename.c_str(), std::ios::binary);
+    if (!file) {
+        std::cout << "Error: could not open " << filename << std::endl;
+        return false;
+    }
+    file << "PF\n" << width << " " << height << "\n-1.0\n";
+    std::vector<float> row(width * 3);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            glm::vec4 p = image[y * width + x];
+            for (int c = 0; c < 3; ++c) {
+                row[x * 3 + c] = p[c] / glm::max(p.a, 1.0f);
+            }
+        }
+        file.write(reinterpret_cast<const char *>(row.data()), row.size() * sizeof(float));
+    }
+    return bool(file);
+}
+
+// Reads a little-endian RGB PFM image written by writePFM(), with alpha set
+// to one so that it can be used like an accumulated image
+inline bool readPFM(const std::string &filename, int &width, int &height, std::vector<glm::vec4> &image)
+{
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    std::string magic;
+    float scale = 0.0f;
+    if (!(file >> magic >> width >> height >> scale) || magic != "PF" || width <= 0 || height <= 0) {
+        return false;
+    }
+    if (scale >= 0.0f) {
+        std::cout << "Error: big-endian PFM images are not supported" << std::endl;
+        return false;
+    }
+    file.get();  // Single whitespace character before the pixels
+
+    image.resize(width * height);
+    std::vector<float> row(width * 3);
+    for (int y = 0; y < height; ++y) {
+        if (!file.read(reinterpret_cast<char *>(row.data()), row.size() * sizeof(float))) return false;
+        for (int x = 0; x < width; ++x) {
+            image[y * width + x] = glm::vec4(row[x * 3 + 0], row[x * 3 + 1], row[x * 3 + 2], 1.0f);
+        }
+    }
+    return true;
+}
+
+} // namespace rt
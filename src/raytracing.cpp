@@ -4,74 +4,213 @@
 #include "sphere.h"
 #include "triangle.h"
 #include "box.h"
+#include "bvh.h"
+#include "instance.h"
+#include "scenecache.h"
 #include "camera.h"
 #include "hitable_list.h"
 #include "material.h"
+#include "trace.h"
 
 #include "utils2.h"  // Used for OBJ-mesh loading
 #include <stdlib.h>  // Needed for drand48()
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <utility>
+
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
 namespace rt {
 
 // Store scene (world) in a global variable for convenience
 struct Scene {
-    Sphere ground;
+    // Reference to a primitive in the top-level BVH
+    enum PrimType { SPHERE, BOX, INSTANCE };
+    struct PrimRef {
+        PrimType type;
+        std::uint32_t index;
+    };
+
+    Sphere ground;  // Not in the top-level BVH, since it would cover everything
     std::vector<Sphere> spheres;
     std::vector<Box> boxes;
-    std::vector<Triangle> mesh;
-    Box mesh_bbox;
+    std::vector<MeshBLAS> meshes;  // Unique meshes, shared by the instances
+    std::vector<Instance> instances;
+    BVH top_bvh;
+    std::vector<PrimRef> top_prims;  // Stored in top-level slot order
+    std::vector<Material> materials;  // Indexed by MaterialID
+    double setup_ms = 0.0;
 } g_scene;
 
-bool hit_world(const Ray &r, float t_min, float t_max, HitRecord &rec)
+// Rebuild the top-level BVH over spheres, boxes and mesh instances. This is
+// all that is needed after moving objects around, since the meshes are
+// kept in object space.
+void buildTopLevel(BVHBuilder builder)
+{
+    RT_TRACE_SCOPE("buildTopLevel");
+    std::vector<Scene::PrimRef> prims;
+    std::vector<AABB> bounds;
+    for (std::uint32_t i = 0; i < g_scene.spheres.size(); ++i) {
+        const Sphere &sphere = g_scene.spheres[i];
+        AABB box;
+        box.grow(sphere.center - glm::vec3(sphere.radius));
+        box.grow(sphere.center + glm::vec3(sphere.radius));
+        prims.push_back({ Scene::SPHERE, i });
+        bounds.push_back(box);
+    }
+    for (std::uint32_t i = 0; i < g_scene.boxes.size(); ++i) {
+        const Box &b = g_scene.boxes[i];
+        AABB box;
+        box.grow(b.center - b.radius);
+        box.grow(b.center + b.radius);
+        prims.push_back({ Scene::BOX, i });
+        bounds.push_back(box);
+    }
+    for (std::uint32_t i = 0; i < g_scene.instances.size(); ++i) {
+        prims.push_back({ Scene::INSTANCE, i });
+        bounds.push_back(g_scene.instances[i].worldBounds());
+    }
+
+    g_scene.top_bvh.build(bounds, builder, 1);
+    g_scene.top_prims.resize(prims.size());
+    for (std::size_t i = 0; i < prims.size(); ++i) {
+        g_scene.top_prims[i] = prims[g_scene.top_bvh.prim_indices[i]];
+    }
+}
+
+// With a queue, rays are queued on treelets of streamed meshes that are not
+// in memory instead of waiting for them to be read
+bool hit_world(const Ray &r, float t_min, float t_max, HitRecord &rec, TreeletQueue *deferred)
 {
     HitRecord temp_rec;
     bool hit_anything = false;
     float closest_so_far = t_max;
 
+    RT_COUNT(sphere_tests, 1);
     if (g_scene.ground.hit(r, t_min, closest_so_far, temp_rec)) {
         hit_anything = true;
         closest_so_far = temp_rec.t;
         rec = temp_rec;
     }
-    for (int i = 0; i < g_scene.spheres.size(); ++i) {
-        if (g_scene.spheres[i].hit(r, t_min, closest_so_far, temp_rec)) {
-            hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+    auto hit_prim = [&](std::uint32_t i, float tmin, float &closest) {
+        const Scene::PrimRef &prim = g_scene.top_prims[i];
+        bool hit = false;
+        switch (prim.type) {
+        case Scene::SPHERE:
+            RT_COUNT(sphere_tests, 1);
+            hit = g_scene.spheres[prim.index].hit(r, tmin, closest, temp_rec);
+            break;
+        case Scene::BOX:
+            RT_COUNT(box_tests, 1);
+            hit = g_scene.boxes[prim.index].hit(r, tmin, closest, temp_rec);
+            break;
+        case Scene::INSTANCE:
+            RT_COUNT(instance_tests, 1);
+            hit = g_scene.instances[prim.index].hit(r, tmin, closest, temp_rec, deferred);
+            break;
         }
-    }
-    for (int i = 0; i < g_scene.boxes.size(); ++i) {
-        if (g_scene.boxes[i].hit(r, t_min, closest_so_far, temp_rec)) {
-            hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
-        }
-    }
-    for (int i = 0; i < g_scene.mesh.size(); ++i) {
-        if (g_scene.mesh[i].hit(r, t_min, closest_so_far, temp_rec)) {
-            hit_anything = true;
-            closest_so_far = temp_rec.t;
+        if (hit) {
+            closest = temp_rec.t;
             rec = temp_rec;
         }
+        return hit;
+    };
+    if (g_scene.top_bvh.hit(r, t_min, closest_so_far, hit_prim)) {
+        hit_anything = true;
     }
     return hit_anything;
 }
 
+bool hit_world(const Ray &r, float t_min, float t_max, HitRecord &rec)
+{
+    return hit_world(r, t_min, t_max, rec, nullptr);
+}
+
+bool streamingGeometry()
+{
+    for (std::size_t i = 0; i < g_scene.meshes.size(); ++i) {
+        if (g_scene.meshes[i].treelets) return true;
+    }
+    return false;
+}
+
+// Closest hits of all rays of a primary ray packet, in the same order as
+// hit_world() so that packets and single rays give the same result
+void hit_world_packet(const RayPacket &packet, float t_min, float t_max, bool hit[], HitRecord rec[])
+{
+    float closest[kPacketSize];
+    RT_COUNT(sphere_tests, packet.size());
+    for (int i = 0; i < packet.size(); ++i) {
+        hit[i] = g_scene.ground.hit(packet.ray(i), t_min, t_max, rec[i]);
+        closest[i] = hit[i] ? rec[i].t : t_max;
+    }
+    auto hit_prim = [&](std::uint32_t slot, int first, int last) {
+        const Scene::PrimRef &prim = g_scene.top_prims[slot];
+        if (prim.type == Scene::INSTANCE) {
+            RT_COUNT(instance_tests, last - first + 1);
+            g_scene.instances[prim.index].hitPacket(packet, first, last, t_min, closest, hit, rec);
+            return;
+        }
+        for (int i = first; i <= last; ++i) {
+            bool prim_hit = false;
+            if (prim.type == Scene::SPHERE) {
+                RT_COUNT(sphere_tests, 1);
+                prim_hit = g_scene.spheres[prim.index].hit(packet.ray(i), t_min, closest[i], rec[i]);
+            }
+            else {
+                RT_COUNT(box_tests, 1);
+                prim_hit = g_scene.boxes[prim.index].hit(packet.ray(i), t_min, closest[i], rec[i]);
+            }
+            if (prim_hit) {
+                hit[i] = true;
+                closest[i] = rec[i].t;
+            }
+        }
+    };
+    g_scene.top_bvh.hitPacket(packet, 0, packet.size() - 1, t_min, closest, hit_prim);
+}
+
+glm::vec3 shade(RTContext &rtx, const Ray &r, bool hit, HitRecord &rec, int max_bounces, RNG &rng);
+
+glm::vec3 skyColor(const RTContext &rtx, const Ray &r)
+{
+    glm::vec3 unit_direction = glm::normalize(r.direction());
+    float t = 0.5f * (unit_direction.y + 1.0f);
+    return (1.0f - t) * rtx.ground_color + t * rtx.sky_color;
+}
+
 // This function should be called recursively (inside the function) for
 // bouncing rays when you compute the lighting for materials, like this
 //
 // if (hit_world(...)) {
 //     ...
-//     return color(rtx, r_bounce, max_bounces - 1);
+//     return color(rtx, r_bounce, max_bounces - 1, rng.nextBounce());
 // }
 //
 // See Chapter 7 in the "Ray Tracing in a Weekend" book
-glm::vec3 color(RTContext &rtx, const Ray &r, int max_bounces)
+glm::vec3 color(RTContext &rtx, const Ray &r, int max_bounces, RNG rng)
 {
-    if (max_bounces < 0) return glm::vec3(0.0f);
+    if (max_bounces < 0) {
+        RT_COUNT(paths_max_bounces, 1);
+        return glm::vec3(0.0f);
+    }
+    RT_COUNT(rays[glm::min(rtx.max_bounces - max_bounces, kStatsMaxDepth - 1)], 1);
 
     HitRecord rec;
-    if (hit_world(r, 0.0f, 9999.0f, rec)) {
+    bool hit = hit_world(r, rtx.epsilon, 9999.0f, rec);
+    return shade(rtx, r, hit, rec, max_bounces, rng);
+}
+
+// Color of a ray from its closest hit, so that the hits of primary rays can
+// be found in packets
+glm::vec3 shade(RTContext &rtx, const Ray &r, bool hit, HitRecord &rec, int max_bounces, RNG &rng)
+{
+    if (hit) {
         rec.normal = glm::normalize(rec.normal);  // Always normalise before use!
         if (rtx.show_normals) {
             return rec.normal * 0.5f + 0.5f;
@@ -79,10 +218,11 @@ glm::vec3 color(RTContext &rtx, const Ray &r, int max_bounces)
 		else {
 			Ray scattered;
 			glm::vec3 attenuation;
-			if (max_bounces < 50 && rec.mat_ptr->scatter(r, rec, attenuation, scattered)) {
-				return attenuation * color(rtx, scattered, rtx.max_bounces + 1);
+			if (max_bounces < 50 && scatter(g_scene.materials[rec.material_id], r, rec, attenuation, scattered, rng)) {
+				return attenuation * color(rtx, scattered, max_bounces - 1, rng.nextBounce());
 			}
 			else {
+				RT_COUNT(paths_absorbed, 1);
 				return glm::vec3(0, 0, 0);
 			}
 		}
@@ -92,19 +232,96 @@ glm::vec3 color(RTContext &rtx, const Ray &r, int max_bounces)
     }
 
     // If no hit, return sky color
-    glm::vec3 unit_direction = glm::normalize(r.direction());
-    float t = 0.5f * (unit_direction.y + 1.0f);
-    return (1.0f - t) * rtx.ground_color + t * rtx.sky_color;
+    RT_COUNT(paths_escaped, 1);
+    return skyColor(rtx, r);
+}
+
+void printBVHStats(const BVHStats &stats, BVHBuilder builder)
+{
+    std::cout << "Built BVH (" << (builder == BVHBuilder::SweepSAH ? "sweep SAH" : "binned SAH")
+              << ") in " << stats.build_ms << " ms" << std::endl;
+    std::cout << "  nodes: " << stats.num_nodes << ", leaves: " << stats.num_leaves
+              << ", depth: " << stats.max_depth << std::endl;
+    std::cout << "  leaf size min/avg/max: " << stats.min_leaf_size << "/" << stats.avg_leaf_size
+              << "/" << stats.max_leaf_size << ", SAH cost: " << stats.sah_cost << std::endl;
+}
+
+// Triangles of an OBJ mesh. Returns false if the file could not be loaded.
+bool loadMeshTriangles(const char *filename, std::vector<Triangle> &triangles)
+{
+    OBJMesh mesh;
+    if (!objMeshLoad(mesh, filename)) return false;
+    triangles.clear();
+    for (std::size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+        glm::vec3 v0 = mesh.vertices[mesh.indices[i + 0]];
+        glm::vec3 v1 = mesh.vertices[mesh.indices[i + 1]];
+        glm::vec3 v2 = mesh.vertices[mesh.indices[i + 2]];
+        triangles.push_back(Triangle(v0, v1, v2));
+    }
+    return true;
+}
+
+// Unit sphere made by subdividing an icosahedron, with 20 * 4^subdivisions
+// triangles facing outwards
+void tessellateSphere(int subdivisions, std::vector<Triangle> &triangles)
+{
+    const float t = 1.618034f;  // Golden ratio
+    const glm::vec3 v[12] = {
+        glm::vec3(-1.0f, t, 0.0f), glm::vec3(1.0f, t, 0.0f), glm::vec3(-1.0f, -t, 0.0f),
+        glm::vec3(1.0f, -t, 0.0f), glm::vec3(0.0f, -1.0f, t), glm::vec3(0.0f, 1.0f, t),
+        glm::vec3(0.0f, -1.0f, -t), glm::vec3(0.0f, 1.0f, -t), glm::vec3(t, 0.0f, -1.0f),
+        glm::vec3(t, 0.0f, 1.0f), glm::vec3(-t, 0.0f, -1.0f), glm::vec3(-t, 0.0f, 1.0f),
+    };
+    const int faces[20][3] = {
+        { 0, 11, 5 }, { 0, 5, 1 }, { 0, 1, 7 }, { 0, 7, 10 }, { 0, 10, 11 },
+        { 1, 5, 9 }, { 5, 11, 4 }, { 11, 10, 2 }, { 10, 7, 6 }, { 7, 1, 8 },
+        { 3, 9, 4 }, { 3, 4, 2 }, { 3, 2, 6 }, { 3, 6, 8 }, { 3, 8, 9 },
+        { 4, 9, 5 }, { 2, 4, 11 }, { 6, 2, 10 }, { 8, 6, 7 }, { 9, 8, 1 },
+    };
+    triangles.clear();
+    for (int i = 0; i < 20; ++i) {
+        triangles.push_back(Triangle(glm::normalize(v[faces[i][0]]), glm::normalize(v[faces[i][1]]),
+                                     glm::normalize(v[faces[i][2]])));
+    }
+    for (int s = 0; s < subdivisions; ++s) {
+        std::vector<Triangle> finer;
+        finer.reserve(4 * triangles.size());
+        for (std::size_t i = 0; i < triangles.size(); ++i) {
+            const Triangle &tri = triangles[i];
+            glm::vec3 m01 = glm::normalize(tri.v0 + tri.v1);
+            glm::vec3 m12 = glm::normalize(tri.v1 + tri.v2);
+            glm::vec3 m20 = glm::normalize(tri.v2 + tri.v0);
+            finer.push_back(Triangle(tri.v0, m01, m20));
+            finer.push_back(Triangle(tri.v1, m12, m01));
+            finer.push_back(Triangle(tri.v2, m20, m12));
+            finer.push_back(Triangle(m01, m12, m20));
+        }
+        triangles.swap(finer);
+    }
+}
+
+double millisecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 }
 
 // MODIFY THIS FUNCTION!
-void setupScene(RTContext &rtx, const char *filename)
+bool setupScene(RTContext &rtx, const char *filename)
 {
-    g_scene.ground = Sphere(glm::vec3(0.0f, -1000.5f, 0.0f), 1000.0f, new metal(glm::vec3(0.8, 0.6, 0.2), 1.0));
+    RT_TRACE_SCOPE("setupScene");
+    auto start = std::chrono::steady_clock::now();
+    g_scene.materials = {
+        metal(glm::vec3(0.8, 0.6, 0.2), 1.0),
+        lambertian(glm::vec3(0.8, 0.3, 0.3)),
+        metal(glm::vec3(0.8, 0.6, 0.2), 1.0),
+        dielectric(1.5),
+        lambertian(glm::vec3(0.7f, 0.7f, 0.7f)),
+    };
+    g_scene.ground = Sphere(glm::vec3(0.0f, -1000.5f, 0.0f), 1000.0f, 0);
     g_scene.spheres = {
-        Sphere(glm::vec3(0.0f, 0.0f, 0.0f), 0.5f, new lambertian(glm::vec3(0.8, 0.3, 0.3))),
-        Sphere(glm::vec3(1.0f, 0.0f, 0.0f), 0.5f, new metal(glm::vec3(0.8, 0.6, 0.2), 1.0)),
-        Sphere(glm::vec3(-1.0f, 0.0f, 0.0f), 0.5f, new dielectric(1.5)),
+        Sphere(glm::vec3(0.0f, 0.0f, 0.0f), 0.5f, 1),
+        Sphere(glm::vec3(1.0f, 0.0f, 0.0f), 0.5f, 2),
+        Sphere(glm::vec3(-1.0f, 0.0f, 0.0f), 0.5f, 3),
     };
     //g_scene.boxes = {
     //    Box(glm::vec3(0.0f, -0.25f, 0.0f), glm::vec3(0.25f)),
@@ -112,77 +329,1073 @@ void setupScene(RTContext &rtx, const char *filename)
     //    Box(glm::vec3(-1.0f, -0.25f, 0.0f), glm::vec3(0.25f)),
     //};
 
-    //OBJMesh mesh;
-    //objMeshLoad(mesh, filename);
-    //g_scene.mesh.clear();
-    //for (int i = 0; i < mesh.indices.size(); i += 3) {
-    //    int i0 = mesh.indices[i + 0];
-    //    int i1 = mesh.indices[i + 1];
-    //    int i2 = mesh.indices[i + 2];
-    //    glm::vec3 v0 = mesh.vertices[i0] + glm::vec3(0.0f, 0.135f, 0.0f);
-    //    glm::vec3 v1 = mesh.vertices[i1] + glm::vec3(0.0f, 0.135f, 0.0f);
-    //    glm::vec3 v2 = mesh.vertices[i2] + glm::vec3(0.0f, 0.135f, 0.0f);
-    //    g_scene.mesh.push_back(Triangle(v0, v1, v2));
-    //}
+    g_scene.meshes.clear();
+    g_scene.instances.clear();
+    std::cout << "Triangle kernel: " << selectTriangleKernel(rtx.use_simd) << std::endl;
+
+    std::vector<Triangle> triangles;
+    MeshBLAS mesh;
+    bool loaded = false;
+    std::size_t budget_bytes = std::size_t(glm::max(rtx.geometry_budget_mb, 0)) << 20;
+    if (filename != nullptr && rtx.use_scene_cache) {
+        auto load_start = std::chrono::steady_clock::now();
+        loaded = budget_bytes > 0 ? openSceneCacheStreamed(filename, rtx.bvh_builder, budget_bytes, mesh)
+                                  : loadSceneCache(filename, rtx.bvh_builder, mesh);
+        if (loaded) {
+            std::cout << "Loaded " << sceneCacheFilename(filename) << " (" << mesh.num_triangles
+                      << " triangles) in " << millisecondsSince(load_start) << " ms" << std::endl;
+        }
+    }
+    if (!loaded && filename != nullptr && loadMeshTriangles(filename, triangles)) {
+        mesh.build(triangles, rtx.bvh_builder);
+        printBVHStats(mesh.stats, rtx.bvh_builder);
+        loaded = true;
+        if (rtx.use_scene_cache && writeSceneCache(filename, rtx.bvh_builder, mesh)) {
+            std::cout << "Wrote " << sceneCacheFilename(filename) << std::endl;
+            // Trade the mesh in memory for the streamed one
+            MeshBLAS streamed;
+            if (budget_bytes > 0 && openSceneCacheStreamed(filename, rtx.bvh_builder, budget_bytes, streamed)) {
+                mesh = std::move(streamed);
+            }
+        }
+    }
+    if (mesh.treelets) {
+        std::cout << "Streaming " << mesh.treelets->size() << " treelets through " << rtx.geometry_budget_mb
+                  << " MB, top of the BVH: " << mesh.bvh.nodes.size() << " nodes, " << mesh.blocks.size()
+                  << " blocks" << std::endl;
+    }
+    if (loaded) {
+        g_scene.meshes.push_back(std::move(mesh));
+
+        // Instances keep pointers to the meshes, so they are added once all
+        // meshes have been built
+        glm::mat4 transform = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.135f, 0.0f));
+        g_scene.instances.push_back(Instance(&g_scene.meshes[0], transform, 4));
+    }
+
+    buildTopLevel(rtx.bvh_builder);
+    g_scene.setup_ms = millisecondsSince(start);
+    return filename == nullptr || loaded;
 }
 
-// MODIFY THIS FUNCTION!
-void updateLine(RTContext &rtx, int y)
+void setupProceduralScene(RTContext &rtx, const ProceduralScene &desc)
+{
+    RT_TRACE_SCOPE("setupProceduralScene");
+    auto start = std::chrono::steady_clock::now();
+    g_scene.spheres.clear();
+    g_scene.boxes.clear();
+    g_scene.meshes.clear();
+    g_scene.instances.clear();
+    std::cout << "Triangle kernel: " << selectTriangleKernel(rtx.use_simd) << std::endl;
+
+    // A few shared materials, so that the size of the scene is dominated
+    // by the geometry
+    g_scene.materials = {
+        metal(glm::vec3(0.8, 0.6, 0.2), 1.0),
+        lambertian(glm::vec3(0.8, 0.3, 0.3)),
+        lambertian(glm::vec3(0.3, 0.5, 0.8)),
+        lambertian(glm::vec3(0.7, 0.7, 0.7)),
+        metal(glm::vec3(0.9, 0.9, 0.9), 0.1),
+        dielectric(1.5),
+    };
+    std::size_t num_materials = g_scene.materials.size();
+    g_scene.ground = Sphere(glm::vec3(0.0f, -1000.5f, 0.0f), 1000.0f, 0);
+
+    // Objects are placed in a region in front of the default camera, with
+    // a size that keeps the total volume of the objects constant
+    const glm::vec3 region_min(-1.5f, -0.5f, -1.5f);
+    const glm::vec3 region_max(1.5f, 1.0f, 0.5f);
+    int num_objects = glm::max(desc.num_spheres + desc.num_instances, 1);
+    float object_radius = 0.4f / std::cbrt(float(num_objects));
+    std::uint32_t object = 0;
+
+    for (int i = 0; i < desc.num_spheres; ++i, ++object) {
+        RNG rng(object, desc.seed);
+        glm::vec3 center = region_min + glm::vec3(rng.next(), rng.next(), rng.next()) * (region_max - region_min);
+        float radius = object_radius * (0.5f + rng.next());
+        MaterialID mat = MaterialID(1 + std::size_t(rng.next() * (num_materials - 1)));
+        g_scene.spheres.push_back(Sphere(center, radius, mat));
+    }
+
+    if (desc.num_instances > 0) {
+        std::vector<Triangle> triangles;
+        if (desc.mesh_filename == nullptr || !loadMeshTriangles(desc.mesh_filename, triangles)) {
+            tessellateSphere(desc.mesh_subdivisions, triangles);
+        }
+        // Scale of the mesh that makes its bounding sphere about as large
+        // as the spheres
+        AABB bounds;
+        for (std::size_t i = 0; i < triangles.size(); ++i) {
+            bounds.grow(triangles[i].v0);
+            bounds.grow(triangles[i].v1);
+            bounds.grow(triangles[i].v2);
+        }
+        glm::vec3 mesh_center = 0.5f * (bounds.bmin + bounds.bmax);
+        float mesh_radius = glm::max(0.5f * glm::length(bounds.bmax - bounds.bmin), 1e-6f);
+
+        int num_meshes = desc.unique_meshes ? desc.num_instances : 1;
+        g_scene.meshes.resize(num_meshes);
+        for (int i = 0; i < num_meshes; ++i) {
+            g_scene.meshes[i].build(triangles, rtx.bvh_builder);
+        }
+        printBVHStats(g_scene.meshes[0].stats, rtx.bvh_builder);
+
+        for (int i = 0; i < desc.num_instances; ++i, ++object) {
+            RNG rng(object, desc.seed);
+            glm::vec3 center = region_min + glm::vec3(rng.next(), rng.next(), rng.next()) * (region_max - region_min);
+            float scale = object_radius * (0.5f + rng.next()) / mesh_radius;
+            float angle = 6.2831853f * rng.next();
+            glm::mat4 transform = glm::translate(glm::mat4(1.0f), center);
+            transform = glm::rotate(transform, angle, glm::vec3(0.0f, 1.0f, 0.0f));
+            transform = glm::scale(transform, glm::vec3(scale));
+            transform = glm::translate(transform, -mesh_center);
+            MaterialID mat = MaterialID(1 + std::size_t(rng.next() * (num_materials - 1)));
+            const MeshBLAS *mesh = &g_scene.meshes[desc.unique_meshes ? i : 0];
+            g_scene.instances.push_back(Instance(mesh, transform, mat));
+        }
+    }
+
+    buildTopLevel(rtx.bvh_builder);
+    g_scene.setup_ms = millisecondsSince(start);
+}
+
+template <typename T>
+std::size_t vectorBytes(const std::vector<T> &v)
+{
+    return v.size() * sizeof(T);
+}
+
+template <typename T>
+std::size_t vectorBytes(const MappedArray<T> &v)
+{
+    return v.size() * sizeof(T);
+}
+
+SceneInfo sceneInfo()
+{
+    SceneInfo info;
+    info.num_spheres = g_scene.spheres.size();
+    info.num_boxes = g_scene.boxes.size();
+    info.num_instances = g_scene.instances.size();
+    info.build_ms = g_scene.top_bvh.stats.build_ms;
+    info.setup_ms = g_scene.setup_ms;
+    info.memory_bytes = vectorBytes(g_scene.spheres) + vectorBytes(g_scene.boxes) +
+                        vectorBytes(g_scene.meshes) + vectorBytes(g_scene.instances) +
+                        vectorBytes(g_scene.top_bvh.nodes) + vectorBytes(g_scene.top_bvh.prim_indices) +
+                        vectorBytes(g_scene.top_prims) + vectorBytes(g_scene.materials);
+    for (std::size_t i = 0; i < g_scene.meshes.size(); ++i) {
+        const MeshBLAS &mesh = g_scene.meshes[i];
+        info.num_unique_triangles += mesh.num_triangles;
+        info.build_ms += mesh.stats.build_ms;
+        info.memory_bytes += vectorBytes(mesh.blocks) + vectorBytes(mesh.bvh.nodes);
+        if (mesh.treelets) {
+            info.memory_bytes += mesh.treelets->residentBytes();
+            info.treelet_read_errors += mesh.treelets->readErrors();
+        }
+    }
+    for (std::size_t i = 0; i < g_scene.instances.size(); ++i) {
+        info.num_instanced_triangles += g_scene.instances[i].mesh->num_triangles;
+    }
+    return info;
+}
+
+void setInstanceTransform(RTContext &rtx, int instance, const glm::mat4 &world_from_object)
+{
+    g_scene.instances[instance].setTransform(world_from_object);
+    buildTopLevel(rtx.bvh_builder);
+    resetAccumulation(rtx);
+}
+
+const std::vector<Material> &sceneMaterials()
+{
+    return g_scene.materials;
+}
+
+void setMaterial(RTContext &rtx, MaterialID id, const Material &material)
+{
+    g_scene.materials[id] = material;
+    resetAccumulation(rtx);
+}
+
+// Camera ray through the center of pixel (x, y)
+Ray primaryRay(RTContext &rtx, camera &cam, const glm::mat4 &world_from_view, int x, int y)
+{
+    float u = (float(x) + 0.5f) / float(rtx.width);
+    float v = (float(y) + 0.5f) / float(rtx.height);
+    Ray r = cam.get_ray(u, v);
+    r.A = glm::vec3(world_from_view * glm::vec4(r.A, 1.0f));
+    r.B = glm::vec3(world_from_view * glm::vec4(r.B, 0.0f));
+    return r;
+}
+
+// Random numbers of pixel (x, y) in a pass. Passes are numbered from -1
+// after each reset, so a pass always gets the same numbers, and continue
+// after the passes of the history kept by reprojection. Each seed gets its
+// own range of 2^20 passes.
+RNG pixelRNG(const RTContext &rtx, int frame, int x, int y, int bounce = 0)
+{
+    return RNG(std::uint32_t(y * rtx.width + x),
+               std::uint32_t(frame + 1 + rtx.history_frames) + (rtx.seed << 20), std::uint32_t(bounce));
+}
+
+float luminance(const glm::vec3 &c)
+{
+    return glm::dot(c, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+void accumulate(RTContext &rtx, int frame, int x, int y, const glm::vec3 &c)
 {
     int nx = rtx.width;
-    int ny = rtx.height;
-    float aspect = float(nx) / float(ny);
-	glm::mat4 world_from_view = glm::inverse(rtx.view);
-	camera cam;
+    bool adaptive = !rtx.luminance_sq.empty();
+    if (frame <= 0) {
+        // Here we make the first frame blend with the old image,
+        // to smoothen the transition when resetting the accumulation
+        glm::vec4 old = rtx.image[y * nx + x];
+        rtx.image[y * nx + x] = glm::clamp(old / glm::max(1.0f, old.a), 0.0f, 1.0f);
+        if (adaptive) {
+            // The old image counts as one sample, or none after a reset
+            float l = luminance(glm::vec3(rtx.image[y * nx + x]));
+            rtx.luminance_sq[y * nx + x] = rtx.image[y * nx + x].a * l * l;
+        }
+    }
+    rtx.image[y * nx + x] += glm::vec4(c, 1.0f);
+    if (adaptive) {
+        float l = luminance(c);
+        rtx.luminance_sq[y * nx + x] += l * l;
+    }
+    RT_COUNT(samples, 1);
+}
+
+bool adaptiveSampling(const RTContext &rtx)
+{
+    return rtx.adaptive_threshold > 0.0f && rtx.cost_view == CostView::Off;
+}
+
+// Whether the pixels [x_begin, x_end) x [y_begin, y_end) all have enough
+// samples and the relative standard error of their mean luminance, over
+// the block, is below the threshold. A small constant is added to the mean
+// so that dark pixels do not need forever. Pooling the variance of the
+// block keeps pixels whose first samples happened to agree (such as all
+// paths absorbed) from stopping early. The estimate is stale until the
+// passes that blend with the old image are done.
+bool blockConverged(const RTContext &rtx, int frame, int x_begin, int y_begin, int x_end, int y_end)
+{
+    if (frame <= 0) return false;
+    float min_samples = float(glm::max(rtx.adaptive_min_samples, 2));
+    float sum_mean = 0.0f;
+    float sum_error_sq = 0.0f;
+    for (int y = y_begin; y < y_end; ++y) {
+        for (int x = x_begin; x < x_end; ++x) {
+            int i = y * rtx.width + x;
+            float n = rtx.image[i].a;
+            if (n < min_samples) return false;
+            float mean = luminance(glm::vec3(rtx.image[i])) / n;
+            float variance = glm::max(rtx.luminance_sq[i] / n - mean * mean, 0.0f) * n / (n - 1.0f);
+            sum_mean += mean;
+            sum_error_sq += variance / n;
+        }
+    }
+    float num_pixels = float((x_end - x_begin) * (y_end - y_begin));
+    float error = std::sqrt(sum_error_sq / num_pixels) / (sum_mean / num_pixels + 0.01f);
+    return error <= rtx.adaptive_threshold;
+}
+
+// Renders the pixels [x_begin, x_end) x [y_begin, y_end) one ray at a time
+void updatePixels(RTContext &rtx, const glm::mat4 &world_from_view, int frame, int x_begin,
+                  int y_begin, int x_end, int y_end)
+{
+    if (adaptiveSampling(rtx) && blockConverged(rtx, frame, x_begin, y_begin, x_end, y_end)) return;
+    camera cam;
+    for (int y = y_begin; y < y_end; ++y) {
+        for (int x = x_begin; x < x_end; ++x) {
+            Ray r = primaryRay(rtx, cam, world_from_view, x, y);
+            glm::vec3 c = color(rtx, r, rtx.max_bounces, pixelRNG(rtx, frame, x, y));
+            accumulate(rtx, frame, x, y, c);
+        }
+    }
+}
+
+// Cost of one sample in the current cost view, from the counters of the
+// thread before the sample and the time it started
+float sampleCost(const RTContext &rtx, const RenderStats &before, std::chrono::steady_clock::time_point start)
+{
+    if (rtx.cost_view == CostView::Time) {
+        return float(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+    }
+#if defined(RT_ENABLE_STATS)
+    const RenderStats &after = threadStats();
+    switch (rtx.cost_view) {
+    case CostView::NodeVisits:
+        return float(after.node_visits - before.node_visits);
+    case CostView::PrimitiveTests:
+        return float(after.sphere_tests + after.box_tests + after.instance_tests + after.triangle_tests -
+                     before.sphere_tests - before.box_tests - before.instance_tests - before.triangle_tests);
+    case CostView::PathLength:
+        return float(after.totalRays() - before.totalRays());
+    default:
+        break;
+    }
+#else
+    (void)before;
+#endif
+    return 0.0f;
+}
+
+float costMax(const RTContext &rtx)
+{
+    if (rtx.cost_max > 0.0f) return rtx.cost_max;
+    switch (rtx.cost_view) {
+    case CostView::NodeVisits: return 100.0f;
+    case CostView::PrimitiveTests: return 100.0f;
+    case CostView::PathLength: return float(rtx.max_bounces + 1);
+    case CostView::Time: return 20000.0f;
+    default: return 1.0f;
+    }
+}
+
+// Blue-cyan-green-yellow-red ramp for t in [0, 1]. The colors are squared
+// by the display gamma, so that they appear as given after gamma correction.
+glm::vec3 costColor(float t)
+{
+    const glm::vec3 ramp[5] = { glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 1.0f, 1.0f),
+                                glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(1.0f, 1.0f, 0.0f),
+                                glm::vec3(1.0f, 0.0f, 0.0f) };
+    float s = glm::clamp(t, 0.0f, 1.0f) * 4.0f;
+    int i = glm::min(int(s), 3);
+    glm::vec3 c = glm::mix(ramp[i], ramp[i + 1], s - float(i));
+    return glm::pow(c, glm::vec3(2.2f));
+}
+
+// Adds the cost of a sample and shows the mean cost of the pixel through
+// the color ramp. The image keeps the number of samples in alpha.
+void accumulateCost(RTContext &rtx, int frame, int x, int y, float cost)
+{
+    int i = y * rtx.width + x;
+    if (frame <= 0) {
+        rtx.cost[i] = 0.0f;
+        rtx.image[i] = glm::vec4(0.0f);
+    }
+    rtx.cost[i] += cost;
+    float n = rtx.image[i].a + 1.0f;
+    rtx.image[i] = glm::vec4(costColor(rtx.cost[i] / n / costMax(rtx)) * n, n);
+    RT_COUNT(samples, 1);
+}
+
+// Renders the pixels of a cost view one ray at a time, measuring the cost
+// of each sample
+void updateCostPixels(RTContext &rtx, const glm::mat4 &world_from_view, int frame, int x_begin,
+                      int y_begin, int x_end, int y_end)
+{
+    camera cam;
+    for (int y = y_begin; y < y_end; ++y) {
+        for (int x = x_begin; x < x_end; ++x) {
+#if defined(RT_ENABLE_STATS)
+            RenderStats before = threadStats();
+#else
+            RenderStats before;
+#endif
+            auto start = std::chrono::steady_clock::now();
+            Ray r = primaryRay(rtx, cam, world_from_view, x, y);
+            color(rtx, r, rtx.max_bounces, pixelRNG(rtx, frame, x, y));
+            accumulateCost(rtx, frame, x, y, sampleCost(rtx, before, start));
+        }
+    }
+}
+
+// Renders a block of at most 8x8 pixels, finding all primary hits as one
+// packet before shading the pixels
+void updatePacket(RTContext &rtx, const glm::mat4 &world_from_view, int frame, int x_begin,
+                  int y_begin, int x_end, int y_end)
+{
+    if (adaptiveSampling(rtx) && blockConverged(rtx, frame, x_begin, y_begin, x_end, y_end)) return;
+    camera cam;
+    RayPacket packet;
+    bool hit[kPacketSize];
+    HitRecord rec[kPacketSize];
+    packet.width = x_end - x_begin;
+    packet.height = y_end - y_begin;
+    for (int j = 0; j < packet.height; ++j) {
+        for (int i = 0; i < packet.width; ++i) {
+            Ray r = primaryRay(rtx, cam, world_from_view, x_begin + i, y_begin + j);
+            packet.origin = r.A;
+            packet.setDirection(j * packet.width + i, r.B);
+        }
+    }
+    packet.finalize();
+    hit_world_packet(packet, rtx.epsilon, 9999.0f, hit, rec);
+    RT_COUNT(rays[0], packet.size());
+
+    for (int j = 0; j < packet.height; ++j) {
+        for (int i = 0; i < packet.width; ++i) {
+            int k = j * packet.width + i;
+            RNG rng = pixelRNG(rtx, frame, x_begin + i, y_begin + j);
+            glm::vec3 c = rtx.max_bounces < 0 ? glm::vec3(0.0f)
+                                              : shade(rtx, packet.ray(k), hit[k], rec[k], rtx.max_bounces, rng);
+            accumulate(rtx, frame, x_begin + i, y_begin + j, c);
+        }
+    }
+}
+
+// The image is rendered in square tiles, numbered in scanline order. The
+// tile size is a multiple of the packet size so packets never cross tiles.
+const int kTileSize = 16;
+
+// Tiles per thread in each call to updateImage(), which keeps the calls
+// short for the GUI while giving the threads enough tiles to balance
+const int kTilesPerThread = 8;
+
+int numTiles(const RTContext &rtx)
+{
+    int tiles_x = (rtx.width + kTileSize - 1) / kTileSize;
+    int tiles_y = (rtx.height + kTileSize - 1) / kTileSize;
+    return tiles_x * tiles_y;
+}
+
+// Path states of a wavefront batch in structure-of-arrays layout. All paths
+// in a queue are at the same bounce, so the bounce is not stored.
+struct PathQueue {
+    static const int kCapacity = kTileSize * kTileSize;
+    int size = 0;
+    float ox[kCapacity], oy[kCapacity], oz[kCapacity];
+    float dx[kCapacity], dy[kCapacity], dz[kCapacity];
+    float tx[kCapacity], ty[kCapacity], tz[kCapacity];  // Throughput
+    int pixel[kCapacity];  // Index of the pixel in the tile
+
+    Ray ray(int i) const { return Ray(glm::vec3(ox[i], oy[i], oz[i]), glm::vec3(dx[i], dy[i], dz[i])); }
+    glm::vec3 throughput(int i) const { return glm::vec3(tx[i], ty[i], tz[i]); }
+    void push(const Ray &r, const glm::vec3 &throughput, int pixel_index)
+    {
+        int i = size++;
+        ox[i] = r.A.x; oy[i] = r.A.y; oz[i] = r.A.z;
+        dx[i] = r.B.x; dy[i] = r.B.y; dz[i] = r.B.z;
+        tx[i] = throughput.x; ty[i] = throughput.y; tz[i] = throughput.z;
+        pixel[i] = pixel_index;
+    }
+};
+
+// Closest hits of all paths of a queue with streamed meshes. The paths are
+// traced through the geometry in memory first, and queued on the treelets
+// that are not. Then each treelet with queued paths is read once and traced
+// by all of them, except those that meanwhile found a hit in front of it.
+void hitPathsStreamed(const PathQueue &paths, float t_min, float t_max, bool hit[], HitRecord rec[])
+{
+    TreeletQueue queue;
+    for (int i = 0; i < paths.size; ++i) {
+        queue.ray = i;
+        hit[i] = hit_world(paths.ray(i), t_min, t_max, rec[i], &queue);
+    }
+    queue.found.clear();  // Unpin, so that only one treelet at a time is held beyond the budget
+
+    std::vector<TreeletQueue::Entry> &entries = queue.entries;
+    std::less<const MeshBLAS *> mesh_less;
+    std::sort(entries.begin(), entries.end(), [&](const TreeletQueue::Entry &a, const TreeletQueue::Entry &b) {
+        if (a.instance->mesh != b.instance->mesh) return mesh_less(a.instance->mesh, b.instance->mesh);
+        if (a.treelet != b.treelet) return a.treelet < b.treelet;
+        return a.ray < b.ray;
+    });
+    for (std::size_t begin = 0, end = 0; begin < entries.size(); begin = end) {
+        const MeshBLAS *mesh = entries[begin].instance->mesh;
+        std::uint32_t index = entries[begin].treelet;
+        while (end < entries.size() && entries[end].instance->mesh == mesh && entries[end].treelet == index) ++end;
+
+        const TreeletRange &range = mesh->treelets->range(index);
+        BVHNode box;
+        box.bbox_min = glm::vec3(range.bounds_min[0], range.bounds_min[1], range.bounds_min[2]);
+        box.bbox_max = glm::vec3(range.bounds_max[0], range.bounds_max[1], range.bounds_max[2]);
+        std::shared_ptr<const Treelet> treelet;
+        bool acquired = false;
+        for (std::size_t k = begin; k < end; ++k) {
+            const TreeletQueue::Entry &entry = entries[k];
+            Ray r = paths.ray(entry.ray);
+            Ray object_ray = entry.instance->objectRay(r);
+            float closest = hit[entry.ray] ? rec[entry.ray].t : t_max;
+            float t_entry;
+            if (!hitNode(box, object_ray.origin(), 1.0f / object_ray.direction(), t_min, closest, t_entry)) continue;
+            if (!acquired) {
+                treelet = mesh->treelets->acquire(index);
+                acquired = true;
+            }
+            if (!treelet) break;  // Could not be read
+            if (entry.instance->hitTreelet(*treelet, r, t_min, closest, rec[entry.ray])) hit[entry.ray] = true;
+        }
+    }
+}
+
+// Renders the pixels [x_begin, x_end) x [y_begin, y_end) of a tile as one
+// batch of paths, advanced one bounce at a time in stages instead of
+// recursively: intersect all paths, add the sky to the paths that missed,
+// scatter the hits grouped by material, and compact the surviving paths
+// into the queue of the next bounce. Gives the same image as color(), up
+// to rounding of the throughput.
+void updateTileWavefront(RTContext &rtx, const glm::mat4 &world_from_view, int frame, int x_begin,
+                         int y_begin, int x_end, int y_end)
+{
+    const int kCapacity = PathQueue::kCapacity;
+    PathQueue queues[2];
+    PathQueue *paths = &queues[0];
+    PathQueue *next = &queues[1];
+    bool hit[kCapacity];
+    HitRecord rec[kCapacity];
+    int order[kCapacity];
+    glm::vec3 radiance[kCapacity];
+    int tile_width = x_end - x_begin;
+    int num_pixels = tile_width * (y_end - y_begin);
+    for (int i = 0; i < num_pixels; ++i) radiance[i] = glm::vec3(0.0f);
+    bool streamed = streamingGeometry();
+
+    // Generate camera rays in blocks of 8x8 pixels, so that the first
+    // bounce can be traced as packets
+    struct Block {
+        int first, width, height;
+    };
+    Block blocks[kCapacity / kPacketSize];
+    int num_blocks = 0;
+    camera cam;
+    for (int y0 = y_begin; y0 < y_end; y0 += kPacketHeight) {
+        for (int x0 = x_begin; x0 < x_end; x0 += kPacketWidth) {
+            Block block = { paths->size, glm::min(kPacketWidth, x_end - x0), glm::min(kPacketHeight, y_end - y0) };
+            blocks[num_blocks++] = block;
+            for (int y = y0; y < y0 + block.height; ++y) {
+                for (int x = x0; x < x0 + block.width; ++x) {
+                    paths->push(primaryRay(rtx, cam, world_from_view, x, y), glm::vec3(1.0f),
+                                (y - y_begin) * tile_width + (x - x_begin));
+                }
+            }
+        }
+    }
+
+    for (int bounce = 0; paths->size > 0; ++bounce) {
+        // Same limits as the recursion in color() and shade()
+        int max_bounces = rtx.max_bounces - bounce;
+        if (max_bounces < 0) {
+            RT_COUNT(paths_max_bounces, paths->size);
+            break;
+        }
+
+        // Extend: closest hits of all paths
+        RT_COUNT(rays[glm::min(bounce, kStatsMaxDepth - 1)], paths->size);
+        if (streamed) {
+            hitPathsStreamed(*paths, rtx.epsilon, 9999.0f, hit, rec);
+        }
+        else if (bounce == 0 && rtx.use_packets) {
+            for (int b = 0; b < num_blocks; ++b) {
+                RayPacket packet;
+                packet.width = blocks[b].width;
+                packet.height = blocks[b].height;
+                packet.origin = paths->ray(blocks[b].first).A;
+                for (int i = 0; i < packet.size(); ++i) {
+                    packet.setDirection(i, paths->ray(blocks[b].first + i).B);
+                }
+                packet.finalize();
+                hit_world_packet(packet, rtx.epsilon, 9999.0f, &hit[blocks[b].first], &rec[blocks[b].first]);
+            }
+        }
+        else {
+            for (int i = 0; i < paths->size; ++i) {
+                hit[i] = hit_world(paths->ray(i), rtx.epsilon, 9999.0f, rec[i]);
+            }
+        }
+
+        // Terminate paths that escaped to the sky, and collect the hits
+        int num_hits = 0;
+        for (int i = 0; i < paths->size; ++i) {
+            if (!hit[i]) {
+                RT_COUNT(paths_escaped, 1);
+                radiance[paths->pixel[i]] += paths->throughput(i) * skyColor(rtx, paths->ray(i));
+                continue;
+            }
+            rec[i].normal = glm::normalize(rec[i].normal);
+            if (rtx.show_normals) {
+                radiance[paths->pixel[i]] += paths->throughput(i) * (rec[i].normal * 0.5f + 0.5f);
+                continue;
+            }
+            order[num_hits++] = i;
+        }
+
+        // Shade the hits grouped by material, and compact the paths that
+        // scattered into the queue of the next bounce. There are few
+        // materials, so the hits are partitioned once per material.
+        for (int begin = 0; begin < num_hits;) {
+            MaterialID mat = rec[order[begin]].material_id;
+            begin = int(std::partition(order + begin, order + num_hits,
+                                       [&](int i) { return rec[i].material_id == mat; }) - order);
+        }
+        next->size = 0;
+        for (int k = 0; k < num_hits; ++k) {
+            int i = order[k];
+            int pixel = paths->pixel[i];
+            RNG rng = pixelRNG(rtx, frame, x_begin + pixel % tile_width, y_begin + pixel / tile_width, bounce);
+            Ray scattered;
+            glm::vec3 attenuation;
+            if (max_bounces < 50 && scatter(g_scene.materials[rec[i].material_id], paths->ray(i), rec[i], attenuation, scattered, rng)) {
+                next->push(scattered, paths->throughput(i) * attenuation, pixel);
+            }
+            else {
+                RT_COUNT(paths_absorbed, 1);
+            }
+        }
+        std::swap(paths, next);
+    }
+
+    for (int y = y_begin; y < y_end; ++y) {
+        for (int x = x_begin; x < x_end; ++x) {
+            accumulate(rtx, frame, x, y, radiance[(y - y_begin) * tile_width + (x - x_begin)]);
+        }
+    }
+}
+
+// Pixels [x_begin, x_end) x [y_begin, y_end) of a tile
+void tileBounds(const RTContext &rtx, int tile, int &x_begin, int &y_begin, int &x_end, int &y_end)
+{
+    int tiles_x = (rtx.width + kTileSize - 1) / kTileSize;
+    x_begin = (tile % tiles_x) * kTileSize;
+    y_begin = (tile / tiles_x) * kTileSize;
+    x_end = glm::min(x_begin + kTileSize, rtx.width);
+    y_end = glm::min(y_begin + kTileSize, rtx.height);
+}
+
+void updateTile(RTContext &rtx, const glm::mat4 &world_from_view, int frame, int tile)
+{
+    int x_begin, y_begin, x_end, y_end;
+    tileBounds(rtx, tile, x_begin, y_begin, x_end, y_end);
+    rtx.dirty_tiles.mark(tile);
+
+    if (rtx.cost_view != CostView::Off) {
+        updateCostPixels(rtx, world_from_view, frame, x_begin, y_begin, x_end, y_end);
+        return;
+    }
+    if (rtx.use_wavefront || streamingGeometry()) {
+        updateTileWavefront(rtx, world_from_view, frame, x_begin, y_begin, x_end, y_end);
+        return;
+    }
+    // Blocks of the size of a packet, which is also the granularity of
+    // adaptive sampling
+    for (int y = y_begin; y < y_end; y += kPacketHeight) {
+        for (int x = x_begin; x < x_end; x += kPacketWidth) {
+            int block_x_end = glm::min(x + kPacketWidth, x_end);
+            int block_y_end = glm::min(y + kPacketHeight, y_end);
+            if (rtx.use_packets) {
+                updatePacket(rtx, world_from_view, frame, x, y, block_x_end, block_y_end);
+            }
+            else {
+                updatePixels(rtx, world_from_view, frame, x, y, block_x_end, block_y_end);
+            }
+        }
+    }
+}
+
+// Whether all blocks of a tile have converged after the pass frame, so that
+// the tile can be skipped as a whole. Wavefront batches are only skipped per
+// tile.
+bool tileConverged(const RTContext &rtx, int frame, int tile)
+{
+    int x_begin, y_begin, x_end, y_end;
+    tileBounds(rtx, tile, x_begin, y_begin, x_end, y_end);
+    for (int y = y_begin; y < y_end; y += kPacketHeight) {
+        for (int x = x_begin; x < x_end; x += kPacketWidth) {
+            if (!blockConverged(rtx, frame, x, y, glm::min(x + kPacketWidth, x_end),
+                                glm::min(y + kPacketHeight, y_end))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool allTilesConverged(const RTContext &rtx)
+{
+    return !rtx.tile_converged.empty() &&
+           std::find(rtx.tile_converged.begin(), rtx.tile_converged.end(), 0) == rtx.tile_converged.end();
+}
+
+// Sizes the per-pixel and per-tile buffers for the current settings
+void resizeBuffers(RTContext &rtx)
+{
+    int num_pixels = rtx.width * rtx.height;
+    bool adaptive = adaptiveSampling(rtx);
+    rtx.image.resize(num_pixels);  // Just in case...
+    rtx.cost.resize(rtx.cost_view != CostView::Off ? num_pixels : 0);
+    rtx.luminance_sq.resize(adaptive ? num_pixels : 0);
+    rtx.tile_converged.resize(adaptive ? numTiles(rtx) : 0);
+    rtx.dirty_tiles.resize(rtx.width, rtx.height, kTileSize);
+}
+
+// Adds the counters of the calling thread to the totals of the context
+void flushThreadStats(RTContext &rtx)
+{
+#if defined(RT_ENABLE_STATS)
+    RenderStats &local = threadStats();
+    #pragma omp critical(rt_stats)
+    rtx.stats.add(local);
+    local = RenderStats();
+#else
+    (void)rtx;
+#endif
+}
 
-    // You can try to parallelise this loop by uncommenting this line:
-    //#pragma omp parallel for schedule(dynamic)
-    for (int x = 0; x < nx; ++x) {
-        float u = (float(x) + 0.5f) / float(nx);
-        float v = (float(y) + 0.5f) / float(ny);
-		Ray r = cam.get_ray(u, v);
-        r.A = glm::vec3(world_from_view * glm::vec4(r.A, 1.0f));
-        r.B = glm::vec3(world_from_view * glm::vec4(r.B, 0.0f));
+int renderThreads(const RTContext &rtx)
+{
+#if defined(_OPENMP)
+    return rtx.num_threads > 0 ? rtx.num_threads : omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// Redraws the whole image at reduced resolution: one sample through the
+// center of each scale x scale block of pixels, copied to all pixels of the
+// block with a sample count of one
+void renderPreview(RTContext &rtx, int scale)
+{
+    RT_TRACE_SCOPE("renderPreview");
+    rtx.image.resize(rtx.width * rtx.height);
+    rtx.dirty_tiles.resize(rtx.width, rtx.height, kTileSize);
+    rtx.dirty_tiles.markAll();
+    scale = glm::max(scale, 1);
+    glm::mat4 world_from_view = glm::inverse(rtx.view);
+    int blocks_x = (rtx.width + scale - 1) / scale;
+    int blocks_y = (rtx.height + scale - 1) / scale;
 
-        if (rtx.current_frame <= 0) {
-            // Here we make the first frame blend with the old image,
-            // to smoothen the transition when resetting the accumulation
-            glm::vec4 old = rtx.image[y * nx + x];
-            rtx.image[y * nx + x] = glm::clamp(old / glm::max(1.0f, old.a), 0.0f, 1.0f);
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(renderThreads(rtx))
+    for (int by = 0; by < blocks_y; ++by) {
+        camera cam;
+        int y_begin = by * scale;
+        int y_end = glm::min(y_begin + scale, rtx.height);
+        for (int bx = 0; bx < blocks_x; ++bx) {
+            int x_begin = bx * scale;
+            int x_end = glm::min(x_begin + scale, rtx.width);
+            int x = (x_begin + x_end) / 2;
+            int y = (y_begin + y_end) / 2;
+            Ray r = primaryRay(rtx, cam, world_from_view, x, y);
+            glm::vec4 c(color(rtx, r, rtx.max_bounces, pixelRNG(rtx, 0, x, y)), 1.0f);
+            for (int py = y_begin; py < y_end; ++py) {
+                for (int px = x_begin; px < x_end; ++px) {
+                    rtx.image[py * rtx.width + px] = c;
+                }
+            }
         }
-        glm::vec3 c = color(rtx, r, rtx.max_bounces);
-        rtx.image[y * nx + x] += glm::vec4(c, 1.0f);
+#if defined(RT_ENABLE_STATS)
+        threadStats() = RenderStats();  // Previews are not part of the counted render
+#endif
+    }
+}
+
+// Draws the next preview after a reset, and picks the scale of the one
+// after it. The cost of a preview falls with the square of the scale.
+void updatePreview(RTContext &rtx)
+{
+    auto start = std::chrono::steady_clock::now();
+    renderPreview(rtx, rtx.preview_scale);
+    double ms = millisecondsSince(start);
+    if (ms > rtx.preview_target_ms && rtx.preview_scale < 16) {
+        rtx.preview_scale *= 2;
     }
+    else if (ms * 4.0 < 0.7 * rtx.preview_target_ms && rtx.preview_scale > 1) {
+        rtx.preview_scale /= 2;
+    }
+    rtx.preview_frames_left -= 1;
 }
 
+// Renders the next batch of tiles of the current pass. Tiles write to
+// disjoint pixels, so they are rendered in parallel without locking, and
+// are handed out to the threads one at a time to balance the load.
 void updateImage(RTContext &rtx)
 {
     if (rtx.freeze) return;  // Skip update
-    rtx.image.resize(rtx.width * rtx.height);  // Just in case...
+    RT_TRACE_SCOPE("updateImage");
+    if (rtx.preview_frames_left > 0 && rtx.cost_view == CostView::Off) {
+        updatePreview(rtx);
+        return;
+    }
+    resizeBuffers(rtx);
+    bool adaptive = adaptiveSampling(rtx);
 
-    updateLine(rtx, rtx.current_line % rtx.height);
+    glm::mat4 world_from_view = glm::inverse(rtx.view);
+    int num_tiles = numTiles(rtx);
+    int num_threads = renderThreads(rtx);
+    int first_tile = rtx.current_tile % num_tiles;
+    int end_tile = glm::min(first_tile + kTilesPerThread * num_threads, num_tiles);
+#if defined(RT_ENABLE_STATS)
+    auto start = std::chrono::steady_clock::now();
+#endif
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(num_threads)
+    for (int tile = first_tile; tile < end_tile; ++tile) {
+        if (adaptive && rtx.tile_converged[tile]) continue;
+        RT_TRACE_SCOPE("tile");
+        updateTile(rtx, world_from_view, rtx.current_frame, tile);
+        if (adaptive) rtx.tile_converged[tile] = tileConverged(rtx, rtx.current_frame, tile);
+        flushThreadStats(rtx);
+    }
+#if defined(RT_ENABLE_STATS)
+    rtx.stats.seconds += millisecondsSince(start) * 1e-3;
+#endif
 
     if (rtx.current_frame < rtx.max_frames) {
-        rtx.current_line += 1;
-        if (rtx.current_line >= rtx.height) {
+        rtx.current_tile = end_tile;
+        if (rtx.current_tile >= num_tiles) {
             rtx.current_frame += 1;
-            rtx.current_line = rtx.current_line % rtx.height;
+            rtx.current_tile = 0;
+            rtx.converged = allTilesConverged(rtx);
+        }
+    }
+}
+
+// Renders passes until num_frames have been accumulated, without returning
+// in between. Each thread renders all remaining passes of a tile before
+// taking the next one, so there is no synchronization between passes. The
+// result is the same as calling updateImage() repeatedly. With adaptive
+// sampling, a tile stops as soon as it has converged.
+void renderImage(RTContext &rtx, int num_frames)
+{
+    if (rtx.current_frame >= num_frames) return;
+    RT_TRACE_SCOPE("renderImage");
+    resizeBuffers(rtx);
+    bool adaptive = adaptiveSampling(rtx);
+
+    glm::mat4 world_from_view = glm::inverse(rtx.view);
+    int num_tiles = numTiles(rtx);
+#if defined(RT_ENABLE_STATS)
+    auto start = std::chrono::steady_clock::now();
+#endif
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(renderThreads(rtx))
+    for (int tile = 0; tile < num_tiles; ++tile) {
+        RT_TRACE_SCOPE("tile");
+        // Tiles before current_tile are already done with the current pass
+        int first_frame = tile < rtx.current_tile ? rtx.current_frame + 1 : rtx.current_frame;
+        for (int frame = first_frame; frame < num_frames; ++frame) {
+            if (adaptive && rtx.tile_converged[tile]) break;
+            updateTile(rtx, world_from_view, frame, tile);
+            if (adaptive) rtx.tile_converged[tile] = tileConverged(rtx, frame, tile);
+        }
+        flushThreadStats(rtx);
+    }
+#if defined(RT_ENABLE_STATS)
+    rtx.stats.seconds += millisecondsSince(start) * 1e-3;
+#endif
+    rtx.current_frame = num_frames;
+    rtx.current_tile = 0;
+    rtx.converged = allTilesConverged(rtx);
+}
+
+// Primary hits of all pixels in a view, traced as packets
+void renderSurfaces(RTContext &rtx, const glm::mat4 &view, std::vector<glm::vec4> &surface,
+                    std::vector<glm::vec3> &normal, std::vector<glm::vec3> &albedo)
+{
+    RT_TRACE_SCOPE("renderSurfaces");
+    surface.resize(rtx.width * rtx.height);
+    normal.resize(rtx.width * rtx.height);
+    albedo.resize(rtx.width * rtx.height);
+    glm::mat4 world_from_view = glm::inverse(view);
+    int blocks_x = (rtx.width + kPacketWidth - 1) / kPacketWidth;
+    int blocks_y = (rtx.height + kPacketHeight - 1) / kPacketHeight;
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(renderThreads(rtx))
+    for (int block = 0; block < blocks_x * blocks_y; ++block) {
+        int x_begin = (block % blocks_x) * kPacketWidth;
+        int y_begin = (block / blocks_x) * kPacketHeight;
+        camera cam;
+        RayPacket packet;
+        bool hit[kPacketSize];
+        HitRecord rec[kPacketSize];
+        packet.width = glm::min(kPacketWidth, rtx.width - x_begin);
+        packet.height = glm::min(kPacketHeight, rtx.height - y_begin);
+        for (int j = 0; j < packet.height; ++j) {
+            for (int i = 0; i < packet.width; ++i) {
+                Ray r = primaryRay(rtx, cam, world_from_view, x_begin + i, y_begin + j);
+                packet.origin = r.A;
+                packet.setDirection(j * packet.width + i, r.B);
+            }
+        }
+        packet.finalize();
+        hit_world_packet(packet, rtx.epsilon, 9999.0f, hit, rec);
+        RT_COUNT(rays[0], packet.size());
+        for (int j = 0; j < packet.height; ++j) {
+            for (int i = 0; i < packet.width; ++i) {
+                int k = j * packet.width + i;
+                int pixel = (y_begin + j) * rtx.width + x_begin + i;
+                surface[pixel] = hit[k] ? glm::vec4(rec[k].p, 1.0f) : glm::vec4(0.0f);
+                normal[pixel] = hit[k] ? glm::normalize(rec[k].normal) : glm::vec3(0.0f);
+                albedo[pixel] = hit[k] ? g_scene.materials[rec[k].material_id].albedo : glm::vec3(0.0f);
+            }
+        }
+        flushThreadStats(rtx);
+    }
+}
+
+// Pixel of the old view that saw the primary hit of pixel i of the new
+// view, or -1 if that surface was hidden or outside of the old view. The
+// point is projected with the camera of primaryRay(), and the surface
+// found there must match it in position (relative to its depth) and normal.
+int reprojectPixel(const RTContext &rtx, const glm::mat4 &old_view, const std::vector<glm::vec4> &old_surface,
+                   const std::vector<glm::vec3> &old_normal, int i)
+{
+    if (rtx.surface[i].w == 0.0f) return -1;  // The sky costs a single sample anyway
+    glm::vec3 p = glm::vec3(rtx.surface[i]);
+    glm::vec3 q = glm::vec3(old_view * glm::vec4(p, 1.0f));
+    if (q.z >= 0.0f) return -1;
+    float u = (q.x / -q.z + 2.0f) / 4.0f;
+    float v = (q.y / -q.z + 1.0f) / 2.0f;
+    int x = int(std::floor(u * rtx.width));
+    int y = int(std::floor(v * rtx.height));
+    if (x < 0 || y < 0 || x >= rtx.width || y >= rtx.height) return -1;
+    int j = y * rtx.width + x;
+    const float kDepthTolerance = 0.02f;
+    const float kMinNormalCosine = 0.9f;
+    if (old_surface[j].w == 0.0f || glm::length(glm::vec3(old_surface[j]) - p) > kDepthTolerance * -q.z ||
+        glm::dot(old_normal[j], rtx.surface_normal[i]) < kMinNormalCosine) {
+        return -1;
+    }
+    return j;
+}
+
+// Warps an accumulated image of another view (and the squared luminance of
+// adaptive sampling) into the new view. Pixels without history get one new
+// sample, or keep the preview of the new view in rtx.image if keep_preview
+// is set, so that there are no holes. Accumulation then continues from pass
+// 1, with random numbers that follow those of the history.
+void reprojectImage(RTContext &rtx, const glm::mat4 &view, const ViewHistory &history, bool keep_preview)
+{
+    RT_TRACE_SCOPE("reprojectImage");
+    int num_pixels = rtx.width * rtx.height;
+    renderSurfaces(rtx, view, rtx.surface, rtx.surface_normal, rtx.surface_albedo);
+
+    std::vector<glm::vec4> preview;
+    preview.swap(rtx.image);
+    rtx.image.resize(num_pixels);
+    rtx.luminance_sq.resize(history.luminance_sq.size());
+    rtx.view = view;
+    rtx.surface_view = view;
+    rtx.history_frames = history.frames;
+    rtx.current_frame = 1;
+    rtx.current_tile = 0;
+    rtx.tile_converged.clear();
+    rtx.converged = false;
+    rtx.preview_frames_left = 0;
+    rtx.dirty_tiles.resize(rtx.width, rtx.height, kTileSize);
+    rtx.dirty_tiles.markAll();
+    glm::mat4 world_from_view = glm::inverse(view);
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(renderThreads(rtx))
+    for (int y = 0; y < rtx.height; ++y) {
+        camera cam;
+        for (int x = 0; x < rtx.width; ++x) {
+            int i = y * rtx.width + x;
+            int j = reprojectPixel(rtx, history.view, history.surface, history.normal, i);
+            if (j >= 0 && history.image[j].a >= 1.0f) {
+                float weight = glm::min(history.image[j].a, rtx.reprojection_max_samples) / history.image[j].a;
+                rtx.image[i] = history.image[j] * weight;
+                if (!rtx.luminance_sq.empty()) rtx.luminance_sq[i] = history.luminance_sq[j] * weight;
+                continue;
+            }
+            if (keep_preview) {
+                rtx.image[i] = glm::vec4(glm::vec3(preview[i]), 1.0f);
+                float l = luminance(glm::vec3(preview[i]));
+                if (!rtx.luminance_sq.empty()) rtx.luminance_sq[i] = l * l;
+                continue;
+            }
+            Ray r = primaryRay(rtx, cam, world_from_view, x, y);
+            accumulate(rtx, 0, x, y, color(rtx, r, rtx.max_bounces, pixelRNG(rtx, 0, x, y)));
+        }
+        flushThreadStats(rtx);
+    }
+}
+
+// The accumulated image and the primary hits of the current view, to be
+// warped into another view
+ViewHistory currentHistory(RTContext &rtx)
+{
+    if (rtx.surface.size() != rtx.image.size() || rtx.surface_view != rtx.view) {
+        renderSurfaces(rtx, rtx.view, rtx.surface, rtx.surface_normal, rtx.surface_albedo);
+        rtx.surface_view = rtx.view;
+    }
+    ViewHistory history;
+    history.image = rtx.image;
+    history.luminance_sq = rtx.luminance_sq;
+    history.surface.swap(rtx.surface);  // Rendered again for the new view
+    history.normal.swap(rtx.surface_normal);
+    history.view = rtx.view;
+    history.frames = rtx.history_frames + rtx.current_frame + 1;
+    return history;
+}
+
+void setView(RTContext &rtx, const glm::mat4 &view)
+{
+    bool reproject = rtx.use_reprojection && rtx.cost_view == CostView::Off && !rtx.image.empty();
+    if (view == rtx.view) {
+        // The view stopped changing: warp the history into its preview, as
+        // long as one was drawn and nothing accumulated on top of it yet
+        bool previewed = rtx.current_frame < 0 && rtx.preview_frames_left < rtx.preview_after_reset;
+        if (rtx.view_history.image.empty() || (reproject && !previewed)) return;
+        ViewHistory history;
+        std::swap(history, rtx.view_history);
+        if (reproject && history.image.size() == rtx.image.size()) {
+            reprojectImage(rtx, view, history, true);
         }
+        return;
+    }
+    if (!reproject || (rtx.current_frame <= 0 && rtx.view_history.image.empty())) {
+        rtx.view = view;
+        resetAccumulation(rtx);
+        return;
+    }
+    if (rtx.preview_after_reset <= 0) {
+        reprojectImage(rtx, view, currentHistory(rtx), false);
+        return;
+    }
+
+    // Preview the changing view, keeping the history from before it
+    // started to change
+    ViewHistory history;
+    std::swap(history, rtx.view_history);
+    if (history.image.empty()) history = currentHistory(rtx);
+    rtx.view = view;
+    resetAccumulation(rtx);
+    std::swap(history, rtx.view_history);
+}
+
+void denoiseImage(RTContext &rtx)
+{
+    RT_TRACE_SCOPE("denoiseImage");
+    if (rtx.image.size() != std::size_t(rtx.width * rtx.height)) return;
+    if (rtx.surface.size() != rtx.image.size() || rtx.surface_view != rtx.view) {
+        renderSurfaces(rtx, rtx.view, rtx.surface, rtx.surface_normal, rtx.surface_albedo);
+        rtx.surface_view = rtx.view;
     }
+    denoise(rtx.width, rtx.height, rtx.image, rtx.surface, rtx.surface_normal, rtx.surface_albedo,
+            rtx.denoise_settings, rtx.denoised, renderThreads(rtx));
 }
 
 void resetImage(RTContext &rtx)
 {
     rtx.image.clear();
     rtx.image.resize(rtx.width * rtx.height);
+    rtx.dirty_tiles.resize(rtx.width, rtx.height, kTileSize);
+    rtx.dirty_tiles.markAll();
+    rtx.cost.clear();
+    rtx.luminance_sq.clear();
+    rtx.tile_converged.clear();
+    rtx.converged = false;
+    rtx.preview_frames_left = 0;
+    rtx.history_frames = 0;
+    rtx.surface.clear();
     rtx.current_frame = 0;
-    rtx.current_line = 0;
+    rtx.current_tile = 0;
     rtx.freeze = false;
+    rtx.stats = RenderStats();
 }
 
 void resetAccumulation(RTContext &rtx)
 {
     rtx.current_frame = -1;
+    rtx.history_frames = 0;
+    rtx.surface.clear();  // The scene may have changed
+    rtx.tile_converged.clear();
+    rtx.converged = false;
+    rtx.preview_frames_left = rtx.preview_after_reset;
+    rtx.view_history = ViewHistory();
+    rtx.stats = RenderStats();
 }
 
 } // namespace rt
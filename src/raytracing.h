@@ -1,20 +1,68 @@
 #pragma once
 
+#include "stats.h"
+#include "denoise.h"
+#include "framebuffer.h"
+
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
 #include <vector>
+#include <cstddef>
+#include <cstdint>
 
 namespace rt {
 
+// Algorithms available for building the BVH of the scene
+enum class BVHBuilder {
+    SweepSAH,   // Exact sweep over all partitions, single-threaded
+    BinnedSAH,  // Binned SAH with task-parallel recursion
+};
+
+// Per-pixel cost shown instead of the image, mapped through a color ramp.
+// The counts need RT_ENABLE_STATS; without it, only Time is measured.
+enum class CostView {
+    Off,
+    NodeVisits,      // BVH nodes visited per sample
+    PrimitiveTests,  // Sphere, box, instance and triangle tests per sample
+    PathLength,      // Rays traced per sample
+    Time,            // Nanoseconds per sample
+};
+
+// Whether the cost view is measured in this build
+inline bool costViewAvailable(CostView view)
+{
+#if defined(RT_ENABLE_STATS)
+    (void)view;
+    return true;
+#else
+    return view == CostView::Off || view == CostView::Time;
+#endif
+}
+
+// Bumped whenever a change alters the rendered images, so that references
+// rendered by an older version are not compared against newer renders
+const int kRenderVersion = 2;
+
+// Accumulated image from before the view started to change, with what
+// reprojection needs of it
+struct ViewHistory {
+    std::vector<glm::vec4> image;
+    std::vector<float> luminance_sq;
+    std::vector<glm::vec4> surface;
+    std::vector<glm::vec3> normal;
+    glm::mat4 view = glm::mat4(1.0f);
+    int frames = 0;  // Passes of the history, including those before its own reprojections
+};
+
 struct RTContext {
     int width = 500;
     int height = 500;
     std::vector<glm::vec4> image;
     bool freeze = false;
     int current_frame = 0;
-    int current_line = 0;
+    int current_tile = 0;
     int max_frames = 1000;
     int max_bounces = 1;
     float epsilon = 2e-4f;
@@ -22,13 +70,124 @@ struct RTContext {
     glm::vec3 ground_color = glm::vec3(1.0f, 1.0f, 1.0f);
     glm::vec3 sky_color = glm::vec3(0.5f, 0.7f, 1.0f);
     bool show_normals = true;
+    BVHBuilder bvh_builder = BVHBuilder::BinnedSAH;
+    bool use_simd = true;  // Use SIMD triangle kernels when the CPU has them
+    // Map the mesh and its BVH from <model>.rtcache next to the model, writing
+    // it there if needed. Off by default, since it writes outside the output.
+    bool use_scene_cache = false;
+    // Out of core: stream the mesh from the scene cache, keeping only the top
+    // of its BVH and this many MB of treelets in memory. Needs
+    // use_scene_cache. Streamed meshes are traced in wavefront batches, whose
+    // rays are queued per treelet.
+    int geometry_budget_mb = 0;  // 0 keeps the whole mesh in memory
+    bool use_packets = true;  // Trace primary rays in 8x8 packets
+    bool use_wavefront = false;  // Trace the paths of a tile in batches per bounce instead of recursively
+    int num_threads = 0;  // Render threads, or 0 to use all cores
+    std::uint32_t seed = 0;  // Renders with different seeds use independent samples
+    RenderStats stats;  // Counters since the last reset, if compiled with RT_ENABLE_STATS
+    CostView cost_view = CostView::Off;  // Traces single rays, so that cost can be assigned to pixels
+    float cost_max = 0.0f;  // Cost at the top of the color ramp, or 0 for a default per view
+    std::vector<float> cost;  // Sum of the cost of the samples of each pixel, in cost views
+    // Adaptive sampling: a tile is no longer sampled once the standard error
+    // of the mean luminance of its pixels, pooled over the tile, is below the
+    // threshold relative to their average luminance plus 0.01. Single pixels
+    // may still be noisier. Changing the threshold from 0 needs a reset.
+    float adaptive_threshold = 0.0f;  // 0 samples every pixel in every pass
+    int adaptive_min_samples = 16;  // Samples per pixel before the error estimate is trusted
+    std::vector<float> luminance_sq;  // Sum of the squared luminance of the samples of each pixel
+    std::vector<std::uint8_t> tile_converged;
+    bool converged = false;  // All tiles have converged, so further passes do nothing
+    // Interactive preview: for preview_after_reset calls of updateImage()
+    // after each resetAccumulation(), the whole image is redrawn with one
+    // sample per preview_scale x preview_scale block of pixels instead of
+    // accumulating. The scale adapts to keep a preview within
+    // preview_target_ms. Progressive rendering then blends in from the
+    // preview.
+    int preview_after_reset = 0;  // 0 disables the preview
+    float preview_target_ms = 1000.0f / 30.0f;
+    int preview_scale = 4;
+    int preview_frames_left = 0;
+    // Temporal reprojection: setView() warps the accumulated image into the
+    // new view instead of restarting, keeping the pixels whose primary hit
+    // is still visible at about the same depth and normal. Their sample
+    // count is clamped, so that the warped history fades out as new samples
+    // arrive. Surfaces hold the primary hits of surface_view (w = 1), or
+    // w = 0 for pixels that see the sky, which the denoiser also uses.
+    // With the preview on, a view that keeps changing is previewed, and the
+    // history from before is only warped once the view stops, into pixels
+    // that otherwise keep the preview. Without it, every change is warped
+    // at full resolution.
+    bool use_reprojection = false;
+    float reprojection_max_samples = 64.0f;
+    std::vector<glm::vec4> surface;
+    std::vector<glm::vec3> surface_normal;
+    std::vector<glm::vec3> surface_albedo;
+    glm::mat4 surface_view = glm::mat4(1.0f);
+    int history_frames = 0;  // Passes before the last reprojection, skipped by the random numbers
+    ViewHistory view_history;  // Kept while the view changes with the preview on
+    DenoiseSettings denoise_settings;
+    std::vector<glm::vec4> denoised;  // Result of denoiseImage(), with alpha one
+    DirtyTiles dirty_tiles;  // Tiles of the image that changed since the display took them
     // Add more settings and parameters here
     // ...
 };
 
-void setupScene(RTContext &rtx, const char *mesh_filename);
+// Generated scene for measuring how the renderer scales with the size of
+// the scene. Spheres and mesh instances are scattered at random over the
+// view of the default camera and shrink as their number grows, so that the
+// image stays about equally covered.
+struct ProceduralScene {
+    int num_spheres = 1000;
+    int num_instances = 0;
+    // Mesh of the instances. Without a file, a sphere is tessellated into
+    // 20 * 4^mesh_subdivisions triangles.
+    const char *mesh_filename = nullptr;
+    int mesh_subdivisions = 4;
+    // Give every instance its own copy of the mesh instead of sharing one,
+    // to measure scenes without instancing
+    bool unique_meshes = false;
+    std::uint32_t seed = 1;
+};
+
+// Size and setup cost of the current scene
+struct SceneInfo {
+    std::size_t num_spheres = 0;
+    std::size_t num_boxes = 0;
+    std::size_t num_instances = 0;
+    std::size_t num_unique_triangles = 0;    // Triangles stored in the meshes
+    std::size_t num_instanced_triangles = 0;  // Triangles seen by rays, over all instances
+    double build_ms = 0.0;  // Time spent building BVHs
+    double setup_ms = 0.0;  // Total time of the last setup, including loading and generating
+    std::size_t memory_bytes = 0;  // Geometry and acceleration structures, without the image
+    std::size_t treelet_read_errors = 0;  // Failed reads of streamed meshes, which leave holes in the image
+};
+
+class Ray;
+struct HitRecord;
+struct Material;
+typedef std::uint16_t MaterialID;
+
+// Returns false if the mesh could not be loaded; the rest of the scene is
+// set up all the same
+bool setupScene(RTContext &rtx, const char *mesh_filename);
+void setupProceduralScene(RTContext &rtx, const ProceduralScene &desc);
+SceneInfo sceneInfo();
+// Closest hit of a ray in the scene, for testing and benchmarking
+bool hit_world(const Ray &r, float t_min, float t_max, HitRecord &rec);
+void setInstanceTransform(RTContext &rtx, int instance, const glm::mat4 &world_from_object);
+// Material table of the scene, indexed by the material IDs of the primitives
+const std::vector<Material> &sceneMaterials();
+void setMaterial(RTContext &rtx, MaterialID id, const Material &material);
 void updateImage(RTContext &rtx);
+void renderPreview(RTContext &rtx, int scale);
+void renderImage(RTContext &rtx, int num_frames);
 void resetImage(RTContext &rtx);
+// Changes the view, with reprojection if it is enabled and otherwise with
+// resetAccumulation(). Call it again with the same view once the view
+// stops changing, to warp the history that was kept during the preview.
+void setView(RTContext &rtx, const glm::mat4 &view);
+// Filters the current image into rtx.denoised, guided by the primary hits
+void denoiseImage(RTContext &rtx);
 void resetAccumulation(RTContext &rtx);
 
 } // namespace rt
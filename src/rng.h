@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+
+namespace rt {
+
+// Integer hash from "Hash Functions for GPU Rendering" (Jarzynski and
+// Olano, 2020), based on the output permutation of the PCG generator
+inline std::uint32_t pcgHash(std::uint32_t v)
+{
+    std::uint32_t state = v * 747796405u + 2891336453u;
+    std::uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// Counter-based random numbers. Every number is a hash of (pixel, sample,
+// bounce, dimension) without any shared state, so the image does not depend
+// on which thread renders a pixel or in which order. The generator is
+// passed by reference to everything that draws numbers for a path.
+class RNG {
+public:
+    RNG(std::uint32_t pixel, std::uint32_t sample, std::uint32_t bounce = 0)
+        : pixel_(pixel), sample_(sample), bounce_(bounce), dimension_(0)
+    {
+        key_ = pcgHash(pcgHash(pcgHash(pixel) ^ sample) ^ bounce);
+    }
+
+    // Uniform number in [0, 1), advancing to the next dimension
+    float next() { return float(pcgHash(key_ ^ pcgHash(dimension_++)) >> 8) * (1.0f / 16777216.0f); }
+
+    // Generator for the next bounce of the same path
+    RNG nextBounce() const { return RNG(pixel_, sample_, bounce_ + 1); }
+
+private:
+    std::uint32_t pixel_;
+    std::uint32_t sample_;
+    std::uint32_t bounce_;
+    std::uint32_t dimension_;
+    std::uint32_t key_;
+};
+
+} // namespace rt
@@ -0,0 +1,350 @@
+#pragma once
+
+#include "instance.h"
+#include "mappedfile.h"
+#include "treelet.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace rt {
+
+// Binary cache of a mesh and its acceleration structure, written next to the
+// model as <model>.rtcache the first time the model is loaded. The file is a
+// header followed by the 4-wide BVH nodes and the triangle blocks exactly as
+// they are laid out in memory, so later runs map it and trace the mapped
+// data without parsing, building or copying anything. After them come the
+// top of the BVH and the table of its treelets, for streaming the mesh out
+// of core instead (see treelet.h).
+//
+// The cache is keyed on the size, modification time and contents of the
+// model and on the BVH builder. A cache whose model only has a new
+// modification time is still used if the contents hash the same. The file
+// size and a checksum over the header and the small sections catch
+// truncated or corrupted files, and the sizes of the stored structs catch
+// layout changes between builds; in all these cases the model is loaded and
+// the cache rewritten. The nodes and blocks are checked once, when the
+// cache is written, so that mapping it stays free of reading them; streaming
+// also checks them whenever it opens the cache.
+const char kSceneCacheMagic[8] = { 'R', 'T', 'C', 'A', 'C', 'H', 'E', '\0' };
+const std::uint32_t kSceneCacheVersion = 2;
+
+struct SceneCacheHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t header_size;
+    std::uint32_t node_size;
+    std::uint32_t block_size;
+    std::uint32_t treelet_size;
+    std::uint32_t builder;
+    std::uint64_t source_size;
+    std::int64_t source_time;  // Modification time in ticks of the file clock
+    std::uint64_t source_hash;
+    std::uint64_t num_triangles;
+    std::uint64_t num_nodes, nodes_offset;
+    std::uint64_t num_blocks, blocks_offset;
+    std::uint64_t num_top_nodes, top_nodes_offset;
+    std::uint64_t num_top_blocks, top_blocks_offset;
+    std::uint64_t num_treelets, treelets_offset;
+    float bounds_min[3], bounds_max[3];
+    BVHStats stats;
+    std::uint64_t checksum;  // Of the header with both checksums zero, the top nodes and blocks and the treelets
+    std::uint64_t data_checksum;  // Of the nodes and blocks
+};
+
+inline std::string sceneCacheFilename(const std::string &model_filename)
+{
+    return model_filename + ".rtcache";
+}
+
+namespace cache {
+
+// Size and modification time of a file, or false if it does not exist
+inline bool fileStamp(const std::string &filename, std::uint64_t &size, std::int64_t &time)
+{
+    std::error_code error;
+    std::uintmax_t file_size = std::filesystem::file_size(filename, error);
+    if (error) return false;
+    std::filesystem::file_time_type file_time = std::filesystem::last_write_time(filename, error);
+    if (error) return false;
+    size = std::uint64_t(file_size);
+    time = std::int64_t(file_time.time_since_epoch().count());
+    return true;
+}
+
+inline bool hashFile(const std::string &filename, std::uint64_t &hash)
+{
+    MappedFile file;
+    if (!file.open(filename)) return false;
+    hash = hashBytes(file.data(), file.size());
+    return true;
+}
+
+inline std::uint64_t alignOffset(std::uint64_t offset)
+{
+    return (offset + 63) & ~std::uint64_t(63);
+}
+
+// Whether count elements of the given size at offset lie in the file,
+// checked so that none of the sums can overflow
+inline bool sectionFits(std::uint64_t offset, std::uint64_t count, std::uint64_t size, std::uint64_t file_size)
+{
+    return offset % 64 == 0 && offset >= sizeof(SceneCacheHeader) && offset <= file_size &&
+           count <= (file_size - offset) / size;
+}
+
+// Whether the cache was written by this build for the current contents of
+// the model, and all its sections lie in the file
+inline bool validHeader(const SceneCacheHeader &header, const std::string &model_filename, BVHBuilder builder,
+                        std::uint64_t file_size)
+{
+    std::uint64_t source_size;
+    std::int64_t source_time;
+    if (!fileStamp(model_filename, source_size, source_time)) return false;
+    if (std::memcmp(header.magic, kSceneCacheMagic, sizeof(header.magic)) != 0 ||
+        header.version != kSceneCacheVersion || header.header_size != sizeof(SceneCacheHeader) ||
+        header.node_size != sizeof(BVH4Node) || header.block_size != sizeof(TriangleBlock) ||
+        header.treelet_size != sizeof(TreeletRange) || header.builder != std::uint32_t(builder) ||
+        header.source_size != source_size) {
+        return false;
+    }
+    if (!sectionFits(header.nodes_offset, header.num_nodes, sizeof(BVH4Node), file_size) ||
+        !sectionFits(header.blocks_offset, header.num_blocks, sizeof(TriangleBlock), file_size) ||
+        !sectionFits(header.top_nodes_offset, header.num_top_nodes, sizeof(BVH4Node), file_size) ||
+        !sectionFits(header.top_blocks_offset, header.num_top_blocks, sizeof(TriangleBlock), file_size) ||
+        !sectionFits(header.treelets_offset, header.num_treelets, sizeof(TreeletRange), file_size)) {
+        return false;
+    }
+    if (header.source_time != source_time) {
+        std::uint64_t source_hash;
+        if (!hashFile(model_filename, source_hash) || source_hash != header.source_hash) return false;
+    }
+    return true;
+}
+
+inline std::uint64_t checksum(const SceneCacheHeader &header, const void *top_nodes, const void *top_blocks,
+                              const void *treelets)
+{
+    char bytes[sizeof(SceneCacheHeader)];
+    std::memcpy(bytes, &header, sizeof(header));
+    std::memset(bytes + offsetof(SceneCacheHeader, checksum), 0, sizeof(header.checksum));
+    std::memset(bytes + offsetof(SceneCacheHeader, data_checksum), 0, sizeof(header.data_checksum));
+    std::uint64_t h = hashBytes(bytes, sizeof(bytes));
+    h = hashBytes(top_nodes, std::size_t(header.num_top_nodes) * sizeof(BVH4Node), h);
+    h = hashBytes(top_blocks, std::size_t(header.num_top_blocks) * sizeof(TriangleBlock), h);
+    return hashBytes(treelets, std::size_t(header.num_treelets) * sizeof(TreeletRange), h);
+}
+
+inline std::uint64_t dataChecksum(const SceneCacheHeader &header, const void *nodes, const void *blocks)
+{
+    std::uint64_t h = hashBytes(nodes, std::size_t(header.num_nodes) * sizeof(BVH4Node));
+    return hashBytes(blocks, std::size_t(header.num_blocks) * sizeof(TriangleBlock), h);
+}
+
+// dataChecksum() of the nodes and blocks of a file, read in chunks so that
+// streaming never holds more than one chunk of them. The chunk size is a
+// multiple of 8, so hashing it in parts gives the same hash as a whole.
+inline bool fileDataChecksum(const PagedFile &file, const SceneCacheHeader &header, std::uint64_t &h)
+{
+    std::vector<char> chunk(1 << 20);
+    const std::uint64_t offsets[2] = { header.nodes_offset, header.blocks_offset };
+    const std::uint64_t sizes[2] = { header.num_nodes * sizeof(BVH4Node), header.num_blocks * sizeof(TriangleBlock) };
+    h = hashBytes(nullptr, 0);
+    for (int section = 0; section < 2; ++section) {
+        for (std::uint64_t done = 0; done < sizes[section];) {
+            std::size_t size = std::size_t(std::min<std::uint64_t>(chunk.size(), sizes[section] - done));
+            if (!file.read(offsets[section] + done, size, chunk.data())) return false;
+            h = hashBytes(chunk.data(), size, h);
+            done += size;
+        }
+    }
+    return true;
+}
+
+inline void setMeshInfo(const SceneCacheHeader &header, MeshBLAS &mesh)
+{
+    mesh.bvh.bounds = AABB();
+    mesh.bvh.bounds.grow(glm::vec3(header.bounds_min[0], header.bounds_min[1], header.bounds_min[2]));
+    mesh.bvh.bounds.grow(glm::vec3(header.bounds_max[0], header.bounds_max[1], header.bounds_max[2]));
+    mesh.stats = header.stats;
+    mesh.stats.build_ms = 0.0;  // Nothing was built
+    mesh.num_triangles = std::size_t(header.num_triangles);
+}
+
+template <typename T>
+bool writeSection(std::ofstream &file, std::uint64_t offset, const T *data, std::uint64_t count)
+{
+    const char zeros[64] = {};
+    std::uint64_t position = std::uint64_t(file.tellp());
+    file.write(zeros, std::streamsize(offset - position));
+    file.write(reinterpret_cast<const char *>(data), std::streamsize(count * sizeof(T)));
+    return bool(file);
+}
+
+} // namespace cache
+
+// Maps the cached mesh of the model into mesh. Returns false if there is no
+// cache or it does not match the model, and leaves the mesh alone then.
+inline bool loadSceneCache(const std::string &model_filename, BVHBuilder builder, MeshBLAS &mesh)
+{
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+    if (!file->open(sceneCacheFilename(model_filename))) return false;
+    SceneCacheHeader header;
+    if (file->size() < sizeof(header)) return false;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (!cache::validHeader(header, model_filename, builder, file->size())) return false;
+    const char *data = file->data();
+    if (cache::checksum(header, data + header.top_nodes_offset, data + header.top_blocks_offset,
+                        data + header.treelets_offset) != header.checksum) {
+        return false;
+    }
+
+    mesh.bvh.nodes.map(file, header.nodes_offset, header.num_nodes);
+    mesh.blocks.map(file, header.blocks_offset, header.num_blocks);
+    mesh.treelets.reset();
+    cache::setMeshInfo(header, mesh);
+    return true;
+}
+
+// Opens the cached mesh of the model for streaming: reads the top of its BVH
+// and the table of treelets, which are read when rays need them and kept in
+// memory up to budget_bytes. Returns false if there is no valid cache. The
+// whole file is hashed once, so that a corrupt cache is rebuilt instead of
+// leaving holes in the mesh.
+inline bool openSceneCacheStreamed(const std::string &model_filename, BVHBuilder builder, std::size_t budget_bytes,
+                                   MeshBLAS &mesh)
+{
+    std::string filename = sceneCacheFilename(model_filename);
+    std::error_code error;
+    std::uint64_t file_size = std::filesystem::file_size(filename, error);
+    PagedFile file;
+    SceneCacheHeader header;
+    if (error || file_size < sizeof(header) || !file.open(filename) || !file.read(0, sizeof(header), &header) ||
+        !cache::validHeader(header, model_filename, builder, file_size)) {
+        return false;
+    }
+    std::vector<BVH4Node> top_nodes(header.num_top_nodes);
+    std::vector<TriangleBlock> top_blocks(header.num_top_blocks);
+    std::vector<TreeletRange> treelets(header.num_treelets);
+    if (!file.read(header.top_nodes_offset, top_nodes.size() * sizeof(BVH4Node), top_nodes.data()) ||
+        !file.read(header.top_blocks_offset, top_blocks.size() * sizeof(TriangleBlock), top_blocks.data()) ||
+        !file.read(header.treelets_offset, treelets.size() * sizeof(TreeletRange), treelets.data()) ||
+        cache::checksum(header, top_nodes.data(), top_blocks.data(), treelets.data()) != header.checksum) {
+        return false;
+    }
+    std::uint64_t data_checksum;
+    if (!cache::fileDataChecksum(file, header, data_checksum) || data_checksum != header.data_checksum) return false;
+    for (std::size_t i = 0; i < treelets.size(); ++i) {
+        const TreeletRange &range = treelets[i];
+        if (range.node_begin + range.num_nodes > header.num_nodes ||
+            range.block_begin + range.num_blocks > header.num_blocks) {
+            return false;
+        }
+    }
+
+    std::shared_ptr<TreeletCache> treelet_cache = std::make_shared<TreeletCache>();
+    if (!treelet_cache->open(filename, header.nodes_offset, header.blocks_offset, std::move(treelets), budget_bytes)) {
+        return false;
+    }
+    mesh.bvh.nodes.vector() = std::move(top_nodes);
+    mesh.blocks.vector() = std::move(top_blocks);
+    mesh.treelets = treelet_cache;
+    cache::setMeshInfo(header, mesh);
+    return true;
+}
+
+// Writes the cache of a mesh built from the model. The cache is written to a
+// temporary file and renamed, so that readers never see a partial cache.
+inline bool writeSceneCache(const std::string &model_filename, BVHBuilder builder, const MeshBLAS &mesh)
+{
+    SceneCacheHeader header;
+    std::memset(static_cast<void *>(&header), 0, sizeof(header));  // Also the padding, which is hashed
+    std::memcpy(header.magic, kSceneCacheMagic, sizeof(header.magic));
+    header.version = kSceneCacheVersion;
+    header.header_size = sizeof(SceneCacheHeader);
+    header.node_size = sizeof(BVH4Node);
+    header.block_size = sizeof(TriangleBlock);
+    header.treelet_size = sizeof(TreeletRange);
+    header.builder = std::uint32_t(builder);
+    if (!cache::fileStamp(model_filename, header.source_size, header.source_time) ||
+        !cache::hashFile(model_filename, header.source_hash)) {
+        return false;
+    }
+
+    std::vector<BVH4Node> top_nodes;
+    std::vector<TriangleBlock> top_blocks;
+    std::vector<TreeletRange> treelets;
+    splitTreelets(mesh.bvh.nodes.data(), mesh.bvh.nodes.size(), mesh.blocks.data(), top_nodes, top_blocks, treelets);
+
+    header.num_triangles = mesh.num_triangles;
+    header.num_nodes = mesh.bvh.nodes.size();
+    header.nodes_offset = cache::alignOffset(sizeof(header));
+    header.num_blocks = mesh.blocks.size();
+    header.blocks_offset = cache::alignOffset(header.nodes_offset + header.num_nodes * sizeof(BVH4Node));
+    header.num_top_nodes = top_nodes.size();
+    header.top_nodes_offset = cache::alignOffset(header.blocks_offset + header.num_blocks * sizeof(TriangleBlock));
+    header.num_top_blocks = top_blocks.size();
+    header.top_blocks_offset = cache::alignOffset(header.top_nodes_offset + header.num_top_nodes * sizeof(BVH4Node));
+    header.num_treelets = treelets.size();
+    header.treelets_offset =
+        cache::alignOffset(header.top_blocks_offset + header.num_top_blocks * sizeof(TriangleBlock));
+    for (int axis = 0; axis < 3; ++axis) {
+        header.bounds_min[axis] = mesh.bvh.bounds.bmin[axis];
+        header.bounds_max[axis] = mesh.bvh.bounds.bmax[axis];
+    }
+    header.stats = mesh.stats;
+    header.checksum = cache::checksum(header, top_nodes.data(), top_blocks.data(), treelets.data());
+    header.data_checksum = cache::dataChecksum(header, mesh.bvh.nodes.data(), mesh.blocks.data());
+
+    std::string filename = sceneCacheFilename(model_filename);
+    std::string temp_filename = filename + ".tmp";
+    {
+        std::ofstream file(temp_filename.c_str(), std::ios::binary);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        bool ok = cache::writeSection(file, header.nodes_offset, mesh.bvh.nodes.data(), header.num_nodes) &&
+                  cache::writeSection(file, header.blocks_offset, mesh.blocks.data(), header.num_blocks) &&
+                  cache::writeSection(file, header.top_nodes_offset, top_nodes.data(), header.num_top_nodes) &&
+                  cache::writeSection(file, header.top_blocks_offset, top_blocks.data(), header.num_top_blocks) &&
+                  cache::writeSection(file, header.treelets_offset, treelets.data(), header.num_treelets);
+        if (!ok) {
+            std::cerr << "Could not write " << temp_filename << std::endl;
+            file.close();
+            std::remove(temp_filename.c_str());
+            return false;
+        }
+    }
+    {
+        // Read the nodes and blocks back once, since loads trust them
+        PagedFile file;
+        std::uint64_t data_checksum;
+        if (!file.open(temp_filename) || !cache::fileDataChecksum(file, header, data_checksum) ||
+            data_checksum != header.data_checksum) {
+            std::cerr << "Could not write " << temp_filename << std::endl;
+            file.close();
+            std::remove(temp_filename.c_str());
+            return false;
+        }
+    }
+    if (std::rename(temp_filename.c_str(), filename.c_str()) != 0) {
+        // Renaming onto an existing file fails on Windows
+        std::remove(filename.c_str());
+        if (std::rename(temp_filename.c_str(), filename.c_str()) != 0) {
+            std::cerr << "Could not write " << filename << std::endl;
+            std::remove(temp_filename.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace rt
@@ -7,17 +7,17 @@ namespace rt {
 class Sphere: public Hitable {
 public:
     Sphere() {}
-    Sphere(const glm::vec3 &cen, float r) : center(cen), radius(r) {};
-	Sphere(const glm::vec3 &cen, float r, material* mat) : center(cen), radius(r) , material_ptr(mat) {};
+    Sphere(const glm::vec3 &cen, float r) : center(cen), radius(r), material_id(0) {};
+    Sphere(const glm::vec3 &cen, float r, MaterialID mat) : center(cen), radius(r), material_id(mat) {};
     virtual bool hit(const Ray &r, float t_min, float t_max, HitRecord &rec) const;
 
     glm::vec3 center;
     float radius;
-	material *material_ptr;
+    MaterialID material_id;
 };
 
 // Ray-sphere test from "Ray Tracing in a Weekend" book (page 16)
-bool Sphere::hit(const Ray &r, float t_min, float t_max, HitRecord &rec) const
+inline bool Sphere::hit(const Ray &r, float t_min, float t_max, HitRecord &rec) const
 {
     glm::vec3 oc = r.origin() - center;
     float a = glm::dot(r.direction(), r.direction());
@@ -32,7 +32,7 @@ bool Sphere::hit(const Ray &r, float t_min, float t_max, HitRecord &rec) const
             rec.t = temp;
             rec.p = r.point_at_parameter(rec.t);
             rec.normal = (rec.p - center) / radius;
-			rec.mat_ptr = material_ptr;
+            rec.material_id = material_id;
             return true;
         }
     }
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+
+namespace rt {
+
+// Rays deeper than this are counted with the deepest bounce
+const int kStatsMaxDepth = 8;
+
+// Counters of the work done by the tracer. Each thread counts into its own
+// copy (threadStats()), which is added to the totals in RTContext after
+// every tile, so counting needs no atomics. Without RT_ENABLE_STATS the
+// counting macro expands to nothing and all counters stay zero.
+struct RenderStats {
+    std::uint64_t rays[kStatsMaxDepth] = {};  // Rays traced per bounce depth
+    std::uint64_t sphere_tests = 0;
+    std::uint64_t box_tests = 0;
+    std::uint64_t instance_tests = 0;
+    std::uint64_t triangle_tests = 0;  // Four per triangle block
+    std::uint64_t node_visits = 0;  // BVH nodes visited by single rays
+    std::uint64_t packet_node_visits = 0;  // BVH nodes visited by ray packets
+    std::uint64_t paths_escaped = 0;  // Paths that ended in the sky
+    std::uint64_t paths_absorbed = 0;  // Paths that ended at a surface that did not scatter
+    std::uint64_t paths_max_bounces = 0;  // Paths cut off at max_bounces
+    std::uint64_t treelet_reads = 0;  // Treelets of streamed meshes read from disk
+    std::uint64_t treelet_bytes_read = 0;
+    std::uint64_t rays_deferred = 0;  // Rays queued on a treelet that was not in memory
+    std::uint64_t samples = 0;
+    double seconds = 0.0;  // Wall time spent rendering
+
+    void add(const RenderStats &other)
+    {
+        for (int i = 0; i < kStatsMaxDepth; ++i) rays[i] += other.rays[i];
+        sphere_tests += other.sphere_tests;
+        box_tests += other.box_tests;
+        instance_tests += other.instance_tests;
+        triangle_tests += other.triangle_tests;
+        node_visits += other.node_visits;
+        packet_node_visits += other.packet_node_visits;
+        paths_escaped += other.paths_escaped;
+        paths_absorbed += other.paths_absorbed;
+        paths_max_bounces += other.paths_max_bounces;
+        treelet_reads += other.treelet_reads;
+        treelet_bytes_read += other.treelet_bytes_read;
+        rays_deferred += other.rays_deferred;
+        samples += other.samples;
+        seconds += other.seconds;
+    }
+
+    std::uint64_t totalRays() const
+    {
+        std::uint64_t total = 0;
+        for (int i = 0; i < kStatsMaxDepth; ++i) total += rays[i];
+        return total;
+    }
+
+    double samplesPerSecond() const { return seconds > 0.0 ? samples / seconds : 0.0; }
+};
+
+#if defined(RT_ENABLE_STATS)
+inline RenderStats &threadStats()
+{
+    static thread_local RenderStats stats;
+    return stats;
+}
+#define RT_COUNT(counter, n) (::rt::threadStats().counter += (n))
+#else
+#define RT_COUNT(counter, n) ((void)0)
+#endif
+
+inline void writeStatsJSON(std::ostream &out, const RenderStats &stats)
+{
+    out << "{\n";
+    out << "  \"enabled\": ";
+#if defined(RT_ENABLE_STATS)
+    out << "true,\n";
+#else
+    out << "false,\n";
+#endif
+    out << "  \"rays_per_depth\": [";
+    for (int i = 0; i < kStatsMaxDepth; ++i) {
+        out << (i > 0 ? ", " : "") << stats.rays[i];
+    }
+    out << "],\n";
+    out << "  \"rays\": " << stats.totalRays() << ",\n";
+    out << "  \"sphere_tests\": " << stats.sphere_tests << ",\n";
+    out << "  \"box_tests\": " << stats.box_tests << ",\n";
+    out << "  \"instance_tests\": " << stats.instance_tests << ",\n";
+    out << "  \"triangle_tests\": " << stats.triangle_tests << ",\n";
+    out << "  \"node_visits\": " << stats.node_visits << ",\n";
+    out << "  \"packet_node_visits\": " << stats.packet_node_visits << ",\n";
+    out << "  \"paths_escaped\": " << stats.paths_escaped << ",\n";
+    out << "  \"paths_absorbed\": " << stats.paths_absorbed << ",\n";
+    out << "  \"paths_max_bounces\": " << stats.paths_max_bounces << ",\n";
+    out << "  \"treelet_reads\": " << stats.treelet_reads << ",\n";
+    out << "  \"treelet_bytes_read\": " << stats.treelet_bytes_read << ",\n";
+    out << "  \"rays_deferred\": " << stats.rays_deferred << ",\n";
+    out << "  \"samples\": " << stats.samples << ",\n";
+    out << "  \"seconds\": " << stats.seconds << ",\n";
+    out << "  \"samples_per_second\": " << stats.samplesPerSecond() << "\n";
+    out << "}\n";
+}
+
+} // namespace rt
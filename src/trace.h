@@ -0,0 +1,171 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace rt {
+
+// Timeline of scoped events per thread, written in the Chrome trace event
+// format (open the file in chrome://tracing or https://ui.perfetto.dev).
+// Tracing is off until setTracing(true); a disabled RT_TRACE_SCOPE costs a
+// relaxed atomic load.
+
+// Begin and end of a scope in nanoseconds since the start of the program.
+// Names must be string literals, since only the pointer is stored.
+struct TraceEvent {
+    const char *name;
+    std::int64_t begin_ns;
+    std::int64_t end_ns;
+};
+
+// Events of one thread. Only the owning thread writes to its buffer, so
+// recording needs no locks. When the buffer is full, the oldest events are
+// overwritten.
+struct TraceBuffer {
+    static const std::uint64_t kCapacity = 1 << 16;
+    TraceEvent events[kCapacity];
+    std::atomic<std::uint64_t> num_written{ 0 };
+    int thread_index = 0;
+    std::string thread_name;
+};
+
+struct TraceRegistry {
+    std::atomic<bool> enabled{ false };
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    std::mutex mutex;  // Guards buffers, which only changes when a thread records its first event
+    std::vector<std::unique_ptr<TraceBuffer> > buffers;
+};
+
+inline TraceRegistry &traceRegistry()
+{
+    static TraceRegistry registry;
+    return registry;
+}
+
+inline void setTracing(bool enabled) { traceRegistry().enabled.store(enabled, std::memory_order_relaxed); }
+inline bool tracingEnabled() { return traceRegistry().enabled.load(std::memory_order_relaxed); }
+
+inline std::int64_t traceNow()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                                traceRegistry().epoch).count();
+}
+
+// Buffer of the calling thread, and its name until the buffer exists
+struct ThreadTrace {
+    TraceBuffer *buffer = nullptr;
+    std::string name;
+};
+
+inline ThreadTrace &threadTrace()
+{
+    static thread_local ThreadTrace trace;
+    return trace;
+}
+
+// Buffer of the calling thread, created on first use. Buffers live until the
+// program exits, since the threads of OpenMP are reused.
+inline TraceBuffer &threadTraceBuffer()
+{
+    ThreadTrace &trace = threadTrace();
+    if (trace.buffer == nullptr) {
+        TraceRegistry &registry = traceRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.buffers.emplace_back(new TraceBuffer());
+        trace.buffer = registry.buffers.back().get();
+        trace.buffer->thread_index = int(registry.buffers.size()) - 1;
+        trace.buffer->thread_name =
+            trace.name.empty() ? "thread " + std::to_string(trace.buffer->thread_index) : trace.name;
+    }
+    return *trace.buffer;
+}
+
+// Name of the calling thread in the timeline. Does not create the buffer,
+// so naming threads costs nothing while tracing is off.
+inline void setTraceThreadName(const std::string &name)
+{
+    ThreadTrace &trace = threadTrace();
+    trace.name = name;
+    if (trace.buffer == nullptr) return;
+    std::lock_guard<std::mutex> lock(traceRegistry().mutex);
+    trace.buffer->thread_name = name;
+}
+
+inline void recordTraceEvent(const char *name, std::int64_t begin_ns, std::int64_t end_ns)
+{
+    TraceBuffer &buffer = threadTraceBuffer();
+    std::uint64_t i = buffer.num_written.load(std::memory_order_relaxed);
+    TraceEvent &event = buffer.events[i % TraceBuffer::kCapacity];
+    event.name = name;
+    event.begin_ns = begin_ns;
+    event.end_ns = end_ns;
+    buffer.num_written.store(i + 1, std::memory_order_release);
+}
+
+// Records the time from construction to destruction as one event
+class TraceScope {
+public:
+    explicit TraceScope(const char *name) : name_(tracingEnabled() ? name : nullptr), begin_ns_(0)
+    {
+        if (name_ != nullptr) begin_ns_ = traceNow();
+    }
+    ~TraceScope()
+    {
+        if (name_ != nullptr) recordTraceEvent(name_, begin_ns_, traceNow());
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+    const char *name_;
+    std::int64_t begin_ns_;
+};
+
+#define RT_TRACE_CONCAT_(a, b) a##b
+#define RT_TRACE_CONCAT(a, b) RT_TRACE_CONCAT_(a, b)
+#define RT_TRACE_SCOPE(name) ::rt::TraceScope RT_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+// Writes the events in all buffers as a Chrome trace JSON file. Events that
+// threads record while writing may be missing or, if their buffer wraps
+// around, torn; flush while the threads are idle for an exact timeline.
+inline bool writeTrace(const std::string &filename)
+{
+    std::ofstream file(filename.c_str());
+    if (!file) return false;
+    TraceRegistry &registry = traceRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    char line[256];
+    for (std::size_t b = 0; b < registry.buffers.size(); ++b) {
+        const TraceBuffer &buffer = *registry.buffers[b];
+        file << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+             << buffer.thread_index << ", \"args\": {\"name\": \"" << buffer.thread_name << "\"}}";
+        first = false;
+
+        std::uint64_t end = buffer.num_written.load(std::memory_order_acquire);
+        std::uint64_t begin = end > TraceBuffer::kCapacity ? end - TraceBuffer::kCapacity : 0;
+        for (std::uint64_t i = begin; i < end; ++i) {
+            const TraceEvent &event = buffer.events[i % TraceBuffer::kCapacity];
+            std::snprintf(line, sizeof(line),
+                          ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, "
+                          "\"dur\": %.3f}",
+                          event.name, buffer.thread_index, event.begin_ns * 1e-3,
+                          (event.end_ns - event.begin_ns) * 1e-3);
+            file << line;
+        }
+    }
+    file << "\n]}\n";
+    return bool(file);
+}
+
+} // namespace rt
@@ -0,0 +1,339 @@
+#pragma once
+
+#include "bvh4.h"
+#include "triangle4.h"
+#include "mappedfile.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace rt {
+
+// Out-of-core meshes are split into treelets: the largest subtrees of the
+// 4-wide BVH whose nodes and triangle blocks fit into kTreeletBytes. The top
+// of the BVH above them stays in memory and refers to each treelet as a
+// leaf with kTreeletLeafCount and the index of the treelet as the child.
+// Mesh leaves hold at most two blocks, so the count is never ambiguous.
+const std::uint8_t kTreeletLeafCount = 255;
+const std::size_t kTreeletBytes = 256 * 1024;
+
+// Treelet in the node and block arrays of a scene cache. The BVH nodes are
+// in depth-first order and the blocks in the order of their leaves, so the
+// nodes of a subtree and the blocks below it are both contiguous.
+struct TreeletRange {
+    std::uint64_t node_begin;
+    std::uint64_t block_begin;
+    std::uint32_t num_nodes;
+    std::uint32_t num_blocks;
+    float bounds_min[3], bounds_max[3];
+    std::uint64_t hash;  // hashBytes() of its nodes, then of its blocks
+};
+
+// Box of child i of a node, as quantized
+inline AABB childBounds(const BVH4Node &node, int i)
+{
+    const std::uint8_t *qlo[3] = { node.qlo_x, node.qlo_y, node.qlo_z };
+    const std::uint8_t *qhi[3] = { node.qhi_x, node.qhi_y, node.qhi_z };
+    AABB bounds;
+    for (int axis = 0; axis < 3; ++axis) {
+        float scale = exponentToFloat(node.exponent[axis]);
+        bounds.bmin[axis] = node.origin[axis] + float(qlo[axis][i]) * scale;
+        bounds.bmax[axis] = node.origin[axis] + float(qhi[axis][i]) * scale;
+    }
+    return bounds;
+}
+
+// Splits the BVH of a mesh into the top nodes and the treelets. Leaves right
+// below top nodes are copied to top_blocks, to which the top nodes refer.
+inline void splitTreelets(const BVH4Node *nodes, std::size_t num_nodes, const TriangleBlock *blocks,
+                          std::vector<BVH4Node> &top_nodes, std::vector<TriangleBlock> &top_blocks,
+                          std::vector<TreeletRange> &treelets)
+{
+    top_nodes.clear();
+    top_blocks.clear();
+    treelets.clear();
+    if (num_nodes == 0) return;
+
+    // Size of the subtree of each node. Children come after their parent,
+    // so a reverse pass sees them first.
+    std::vector<std::uint32_t> subtree_nodes(num_nodes), first_block(num_nodes), subtree_blocks(num_nodes);
+    for (std::size_t n = num_nodes; n-- > 0;) {
+        const BVH4Node &node = nodes[n];
+        subtree_nodes[n] = 1;
+        first_block[n] = 0xffffffffu;
+        subtree_blocks[n] = 0;
+        for (int i = 0; i < node.num_children; ++i) {
+            std::uint32_t child = node.child[i];
+            if (node.leaf_count[i] > 0) {
+                first_block[n] = std::min(first_block[n], child);
+                subtree_blocks[n] += node.leaf_count[i];
+            }
+            else {
+                subtree_nodes[n] += subtree_nodes[child];
+                first_block[n] = std::min(first_block[n], first_block[child]);
+                subtree_blocks[n] += subtree_blocks[child];
+            }
+        }
+    }
+
+    // Copies node n to the top, deciding for each interior child whether it
+    // becomes a treelet or another top node
+    auto add_top = [&](std::uint32_t n, auto &add_top_ref) -> std::uint32_t {
+        std::uint32_t index = std::uint32_t(top_nodes.size());
+        top_nodes.push_back(nodes[n]);
+        const BVH4Node &node = nodes[n];
+        for (int i = 0; i < node.num_children; ++i) {
+            std::uint32_t child = node.child[i];
+            if (node.leaf_count[i] > 0) {
+                top_nodes[index].child[i] = std::uint32_t(top_blocks.size());
+                top_blocks.insert(top_blocks.end(), blocks + child, blocks + child + node.leaf_count[i]);
+                continue;
+            }
+            std::size_t bytes = subtree_nodes[child] * sizeof(BVH4Node) + subtree_blocks[child] * sizeof(TriangleBlock);
+            if (bytes > kTreeletBytes) {
+                std::uint32_t top_child = add_top_ref(child, add_top_ref);
+                top_nodes[index].child[i] = top_child;
+                continue;
+            }
+            TreeletRange range;
+            range.node_begin = child;
+            range.block_begin = first_block[child];
+            range.num_nodes = subtree_nodes[child];
+            range.num_blocks = subtree_blocks[child];
+            AABB bounds = childBounds(node, i);
+            for (int axis = 0; axis < 3; ++axis) {
+                range.bounds_min[axis] = bounds.bmin[axis];
+                range.bounds_max[axis] = bounds.bmax[axis];
+            }
+            range.hash = hashBytes(nodes + child, range.num_nodes * sizeof(BVH4Node));
+            range.hash = hashBytes(blocks + range.block_begin, range.num_blocks * sizeof(TriangleBlock), range.hash);
+            top_nodes[index].child[i] = std::uint32_t(treelets.size());
+            top_nodes[index].leaf_count[i] = kTreeletLeafCount;
+            treelets.push_back(range);
+        }
+        return index;
+    };
+    add_top(0, add_top);
+}
+
+// Closest hit within the blocks [first, first + count), with the normal of
+// the hit triangle
+inline bool hitBlocks(TriangleKernel kernel, const TriangleBlock *blocks, std::uint32_t first, std::uint32_t count,
+                      const Ray &r, float t_min, float &closest, glm::vec3 &normal)
+{
+    RT_COUNT(triangle_tests, 4 * count);
+    int index;
+    if (!kernel(&blocks[first], int(count), r, t_min, closest, index)) return false;
+    const TriangleBlock &block = blocks[first + index / 4];
+    int lane = index % 4;
+    normal = glm::vec3(block.nx[lane], block.ny[lane], block.nz[lane]);
+    return true;
+}
+
+// Treelet read into memory, with its node and block indices relative to its
+// own arrays
+struct Treelet {
+    BVH4 bvh;
+    std::vector<TriangleBlock> blocks;
+
+    std::size_t bytes() const { return bvh.nodes.size() * sizeof(BVH4Node) + blocks.size() * sizeof(TriangleBlock); }
+
+    bool hit(TriangleKernel kernel, const Ray &r, float t_min, float &closest, glm::vec3 &normal) const
+    {
+        auto hit_leaf = [&](std::uint32_t first, std::uint32_t count, float tmin, float &leaf_closest) {
+            if (!hitBlocks(kernel, blocks.data(), first, count, r, tmin, leaf_closest, normal)) return false;
+            closest = leaf_closest;
+            return true;
+        };
+        return bvh.hit(r, t_min, closest, hit_leaf);
+    }
+};
+
+// Treelets of a streamed mesh that are in memory, up to a budget in bytes.
+// Reading a treelet evicts the least recently used ones until it fits;
+// threads still tracing an evicted treelet keep it alive until they are
+// done. At least one treelet is kept, however small the budget.
+class TreeletCache {
+public:
+    bool open(const std::string &filename, std::uint64_t nodes_offset, std::uint64_t blocks_offset,
+              std::vector<TreeletRange> ranges, std::size_t budget_bytes)
+    {
+        if (!file_.open(filename)) return false;
+        filename_ = filename;
+        nodes_offset_ = nodes_offset;
+        blocks_offset_ = blocks_offset;
+        ranges_ = std::move(ranges);
+        slots_.assign(ranges_.size(), Slot());
+        lru_.clear();
+        resident_bytes_ = 0;
+        budget_bytes_ = budget_bytes;
+        read_errors_ = 0;
+        return true;
+    }
+
+    std::size_t size() const { return ranges_.size(); }
+    const TreeletRange &range(std::uint32_t index) const { return ranges_[index]; }
+
+    std::size_t residentBytes() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return resident_bytes_;
+    }
+
+    // Failed reads since the cache was opened. Rays miss the treelets that
+    // could not be read, so the image is incomplete if there were any.
+    std::size_t readErrors() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return read_errors_;
+    }
+
+    // The treelet if it is in memory, or null
+    std::shared_ptr<const Treelet> find(std::uint32_t index)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Slot &slot = slots_[index];
+        if (slot.treelet) lru_.splice(lru_.begin(), lru_, slot.lru);
+        return slot.treelet;
+    }
+
+    // The treelet, read from the file if it is not in memory, or null if it
+    // could not be read. Failed reads are not cached, so later calls retry.
+    std::shared_ptr<const Treelet> acquire(std::uint32_t index)
+    {
+        std::shared_ptr<const Treelet> treelet = find(index);
+        if (treelet) return treelet;
+
+        // Read without holding the lock; if another thread read the same
+        // treelet meanwhile, its copy is used
+        std::shared_ptr<const Treelet> loaded = read(index);
+        std::lock_guard<std::mutex> lock(mutex_);
+        Slot &slot = slots_[index];
+        if (!loaded) {
+            if (read_errors_++ == 0) {
+                std::cerr << "Could not read treelet " << index << " of " << filename_ << std::endl;
+            }
+            return nullptr;
+        }
+        if (slot.treelet) {
+            lru_.splice(lru_.begin(), lru_, slot.lru);
+            return slot.treelet;
+        }
+        while (!lru_.empty() && resident_bytes_ + loaded->bytes() > budget_bytes_) {
+            Slot &evicted = slots_[lru_.back()];
+            resident_bytes_ -= evicted.treelet->bytes();
+            evicted.treelet.reset();
+            lru_.pop_back();
+        }
+        slot.treelet = loaded;
+        lru_.push_front(index);
+        slot.lru = lru_.begin();
+        resident_bytes_ += loaded->bytes();
+        return loaded;
+    }
+
+private:
+    struct Slot {
+        std::shared_ptr<const Treelet> treelet;
+        std::list<std::uint32_t>::iterator lru;
+    };
+
+    std::shared_ptr<const Treelet> read(std::uint32_t index) const
+    {
+        const TreeletRange &range = ranges_[index];
+        std::shared_ptr<Treelet> treelet = std::make_shared<Treelet>();
+        std::vector<BVH4Node> &nodes = treelet->bvh.nodes.vector();
+        nodes.resize(range.num_nodes);
+        treelet->blocks.resize(range.num_blocks);
+        std::size_t node_bytes = nodes.size() * sizeof(BVH4Node);
+        std::size_t block_bytes = treelet->blocks.size() * sizeof(TriangleBlock);
+        bool ok = file_.read(nodes_offset_ + range.node_begin * sizeof(BVH4Node), node_bytes, nodes.data()) &&
+                  file_.read(blocks_offset_ + range.block_begin * sizeof(TriangleBlock), block_bytes,
+                             treelet->blocks.data());
+        if (!ok || hashBytes(treelet->blocks.data(), block_bytes, hashBytes(nodes.data(), node_bytes)) != range.hash) {
+            return nullptr;
+        }
+        RT_COUNT(treelet_reads, 1);
+        RT_COUNT(treelet_bytes_read, node_bytes + block_bytes);
+
+        // Relocate the children to the arrays of the treelet
+        for (std::size_t n = 0; n < nodes.size(); ++n) {
+            BVH4Node &node = nodes[n];
+            for (int i = 0; i < node.num_children; ++i) {
+                node.child[i] -= std::uint32_t(node.leaf_count[i] > 0 ? range.block_begin : range.node_begin);
+            }
+        }
+        return treelet;
+    }
+
+    mutable std::mutex mutex_;
+    PagedFile file_;
+    std::string filename_;
+    std::uint64_t nodes_offset_ = 0;
+    std::uint64_t blocks_offset_ = 0;
+    std::vector<TreeletRange> ranges_;
+    std::vector<Slot> slots_;
+    std::list<std::uint32_t> lru_;  // Treelets in memory, most recently used first
+    std::size_t resident_bytes_ = 0;
+    std::size_t budget_bytes_ = 0;
+    std::size_t read_errors_ = 0;
+};
+
+class Instance;
+
+// Rays of a batch that reached treelets that were not in memory. They are
+// traced per treelet after the rest of the batch, so that each treelet is
+// read at most once per batch instead of whenever a ray needs it.
+struct TreeletQueue {
+    struct Entry {
+        const Instance *instance;
+        std::uint32_t treelet;
+        int ray;
+    };
+    std::vector<Entry> entries;
+    const Instance *instance = nullptr;  // Instance and ray being traced
+    int ray = 0;
+    // Treelets looked up during the batch, or null for the ones that were
+    // not in memory. The cache, and its lock, is only asked the first time
+    // a batch reaches a treelet, not on every visit of a ray. The treelets
+    // found stay pinned, even beyond the budget of their cache, until the
+    // batch clears them after its traversal, before the deferred rays read
+    // in more treelets.
+    struct Key {
+        TreeletCache *cache;
+        std::uint32_t treelet;
+        bool operator==(const Key &other) const { return cache == other.cache && treelet == other.treelet; }
+    };
+    struct KeyHash {
+        std::size_t operator()(const Key &key) const
+        {
+            return std::hash<const void *>()(key.cache) ^ (std::size_t(key.treelet) * 0x9e3779b97f4a7c15ull);
+        }
+    };
+    std::unordered_map<Key, std::shared_ptr<const Treelet>, KeyHash> found;
+
+    const Treelet *find(TreeletCache &cache, std::uint32_t treelet)
+    {
+        auto inserted = found.emplace(Key{ &cache, treelet }, nullptr);
+        if (inserted.second) inserted.first->second = cache.find(treelet);
+        return inserted.first->second.get();
+    }
+
+    void push(std::uint32_t treelet)
+    {
+        RT_COUNT(rays_deferred, 1);
+        entries.push_back({ instance, treelet, ray });
+    }
+};
+
+} // namespace rt
@@ -7,16 +7,18 @@ namespace rt {
 class Triangle: public Hitable {
 public:
     Triangle() {}
-    Triangle(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c) : v0(a), v1(b), v2(c)  {};
+    Triangle(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c) : v0(a), v1(b), v2(c), material_id(0)  {};
+    Triangle(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c, MaterialID mat) : v0(a), v1(b), v2(c), material_id(mat) {};
     virtual bool hit(const Ray &r, float t_min, float t_max, HitRecord &rec) const;
 
     glm::vec3 v0;
     glm::vec3 v1;
     glm::vec3 v2;
+    MaterialID material_id;
 };
 
 // Ray-triangle test adapted from "Real-Time Collision Detection" book (pages 191--192)
-bool Triangle::hit(const Ray &r, float t_min, float t_max, HitRecord &rec) const
+inline bool Triangle::hit(const Ray &r, float t_min, float t_max, HitRecord &rec) const
 {
     glm::vec3 n = glm::cross(v1 - v0, v2 - v0);
     float d = glm::dot(-r.direction(), n);
@@ -32,6 +34,7 @@ bool Triangle::hit(const Ray &r, float t_min, float t_max, HitRecord &rec) const
                     rec.t = temp;
                     rec.p = r.point_at_parameter(rec.t);
                     rec.normal = n;
+                    rec.material_id = material_id;
                     return true;
                 }
             }
@@ -0,0 +1,213 @@
+#pragma once
+
+#include "triangle.h"
+
+#include <vector>
+#include <cfloat>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RT_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+namespace rt {
+
+// Four triangles in structure-of-arrays layout with precomputed edges and
+// unnormalized normals. Unused lanes are zero, which makes them degenerate
+// triangles that are never hit.
+struct TriangleBlock {
+    float v0x[4], v0y[4], v0z[4];
+    float e1x[4], e1y[4], e1z[4];  // v1 - v0
+    float e2x[4], e2y[4], e2z[4];  // v2 - v0
+    float nx[4], ny[4], nz[4];     // cross(e1, e2)
+};
+
+// Pack triangles into blocks, leaving unused lanes of the last block empty
+inline void packTriangles(const Triangle *triangles, int count, std::vector<TriangleBlock> &blocks)
+{
+    for (int first = 0; first < count; first += 4) {
+        TriangleBlock block = {};
+        for (int lane = 0; lane < 4 && first + lane < count; ++lane) {
+            const Triangle &tri = triangles[first + lane];
+            glm::vec3 e1 = tri.v1 - tri.v0;
+            glm::vec3 e2 = tri.v2 - tri.v0;
+            glm::vec3 n = glm::cross(e1, e2);
+            block.v0x[lane] = tri.v0.x; block.v0y[lane] = tri.v0.y; block.v0z[lane] = tri.v0.z;
+            block.e1x[lane] = e1.x; block.e1y[lane] = e1.y; block.e1z[lane] = e1.z;
+            block.e2x[lane] = e2.x; block.e2y[lane] = e2.y; block.e2z[lane] = e2.z;
+            block.nx[lane] = n.x; block.ny[lane] = n.y; block.nz[lane] = n.z;
+        }
+        blocks.push_back(block);
+    }
+}
+
+// Intersects a ray with num_blocks consecutive blocks, using the same
+// one-sided test as Triangle::hit. On a hit closer than t_max, t_max is
+// updated and hit_index is set to 4 * block + lane. All kernels perform the
+// same floating point operations in the same order and break ties towards
+// the lowest index, so they produce bit-identical results.
+typedef bool (*TriangleKernel)(const TriangleBlock *blocks, int num_blocks, const Ray &r,
+                               float t_min, float &t_max, int &hit_index);
+
+inline bool hitTrianglesScalar(const TriangleBlock *blocks, int num_blocks, const Ray &r,
+                               float t_min, float &t_max, int &hit_index)
+{
+    glm::vec3 nd = -r.direction();
+    glm::vec3 o = r.origin();
+    bool hit = false;
+    for (int b = 0; b < num_blocks; ++b) {
+        const TriangleBlock &blk = blocks[b];
+        for (int lane = 0; lane < 4; ++lane) {
+            float d = (nd.x * blk.nx[lane] + nd.y * blk.ny[lane]) + nd.z * blk.nz[lane];
+            float aox = o.x - blk.v0x[lane];
+            float aoy = o.y - blk.v0y[lane];
+            float aoz = o.z - blk.v0z[lane];
+            float temp = (aox * blk.nx[lane] + aoy * blk.ny[lane]) + aoz * blk.nz[lane];
+            float ex = nd.y * aoz - nd.z * aoy;
+            float ey = nd.z * aox - nd.x * aoz;
+            float ez = nd.x * aoy - nd.y * aox;
+            float v = (blk.e2x[lane] * ex + blk.e2y[lane] * ey) + blk.e2z[lane] * ez;
+            float w = -((blk.e1x[lane] * ex + blk.e1y[lane] * ey) + blk.e1z[lane] * ez);
+            float t = temp / d;
+            if (d > 0.0f && temp >= 0.0f && v >= 0.0f && v <= d && w >= 0.0f && v + w <= d &&
+                t < t_max && t > t_min) {
+                t_max = t;
+                hit_index = 4 * b + lane;
+                hit = true;
+            }
+        }
+    }
+    return hit;
+}
+
+#if defined(RT_HAVE_X86_SIMD)
+inline bool hitTrianglesSSE(const TriangleBlock *blocks, int num_blocks, const Ray &r,
+                            float t_min, float &t_max, int &hit_index)
+{
+    glm::vec3 nd = -r.direction();
+    __m128 ndx = _mm_set1_ps(nd.x), ndy = _mm_set1_ps(nd.y), ndz = _mm_set1_ps(nd.z);
+    __m128 ox = _mm_set1_ps(r.A.x), oy = _mm_set1_ps(r.A.y), oz = _mm_set1_ps(r.A.z);
+    __m128 zero = _mm_setzero_ps();
+    __m128 tmin = _mm_set1_ps(t_min);
+    bool hit = false;
+    for (int b = 0; b < num_blocks; ++b) {
+        const TriangleBlock &blk = blocks[b];
+        __m128 nx = _mm_loadu_ps(blk.nx), ny = _mm_loadu_ps(blk.ny), nz = _mm_loadu_ps(blk.nz);
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ndx, nx), _mm_mul_ps(ndy, ny)), _mm_mul_ps(ndz, nz));
+        __m128 aox = _mm_sub_ps(ox, _mm_loadu_ps(blk.v0x));
+        __m128 aoy = _mm_sub_ps(oy, _mm_loadu_ps(blk.v0y));
+        __m128 aoz = _mm_sub_ps(oz, _mm_loadu_ps(blk.v0z));
+        __m128 temp = _mm_add_ps(_mm_add_ps(_mm_mul_ps(aox, nx), _mm_mul_ps(aoy, ny)), _mm_mul_ps(aoz, nz));
+        __m128 ex = _mm_sub_ps(_mm_mul_ps(ndy, aoz), _mm_mul_ps(ndz, aoy));
+        __m128 ey = _mm_sub_ps(_mm_mul_ps(ndz, aox), _mm_mul_ps(ndx, aoz));
+        __m128 ez = _mm_sub_ps(_mm_mul_ps(ndx, aoy), _mm_mul_ps(ndy, aox));
+        __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(blk.e2x), ex), _mm_mul_ps(_mm_loadu_ps(blk.e2y), ey)),
+                              _mm_mul_ps(_mm_loadu_ps(blk.e2z), ez));
+        __m128 w = _mm_sub_ps(zero, _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(blk.e1x), ex), _mm_mul_ps(_mm_loadu_ps(blk.e1y), ey)),
+                                               _mm_mul_ps(_mm_loadu_ps(blk.e1z), ez)));
+        __m128 t = _mm_div_ps(temp, d);
+        __m128 mask = _mm_and_ps(_mm_cmpgt_ps(d, zero), _mm_cmpge_ps(temp, zero));
+        mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(v, d)));
+        mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(w, zero), _mm_cmple_ps(_mm_add_ps(v, w), d)));
+        mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmplt_ps(t, _mm_set1_ps(t_max)), _mm_cmpgt_ps(t, tmin)));
+        int bits = _mm_movemask_ps(mask);
+        if (bits == 0) continue;
+
+        float ts[4];
+        _mm_storeu_ps(ts, t);
+        for (int lane = 0; lane < 4; ++lane) {
+            if ((bits & (1 << lane)) && ts[lane] < t_max) {
+                t_max = ts[lane];
+                hit_index = 4 * b + lane;
+                hit = true;
+            }
+        }
+    }
+    return hit;
+}
+
+// Tests two blocks at a time in the lower and upper halves of the registers
+__attribute__((target("avx")))
+inline bool hitTrianglesAVX(const TriangleBlock *blocks, int num_blocks, const Ray &r,
+                            float t_min, float &t_max, int &hit_index)
+{
+    glm::vec3 nd = -r.direction();
+    __m256 ndx = _mm256_set1_ps(nd.x), ndy = _mm256_set1_ps(nd.y), ndz = _mm256_set1_ps(nd.z);
+    __m256 ox = _mm256_set1_ps(r.A.x), oy = _mm256_set1_ps(r.A.y), oz = _mm256_set1_ps(r.A.z);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 tmin = _mm256_set1_ps(t_min);
+    bool hit = false;
+    for (int b = 0; b < num_blocks; b += 2) {
+        const TriangleBlock &lo = blocks[b];
+        const TriangleBlock &hi = blocks[b + 1 < num_blocks ? b + 1 : b];
+#define RT_LOAD8(field) _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(lo.field)), _mm_loadu_ps(hi.field), 1)
+        __m256 nx = RT_LOAD8(nx), ny = RT_LOAD8(ny), nz = RT_LOAD8(nz);
+        __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ndx, nx), _mm256_mul_ps(ndy, ny)), _mm256_mul_ps(ndz, nz));
+        __m256 aox = _mm256_sub_ps(ox, RT_LOAD8(v0x));
+        __m256 aoy = _mm256_sub_ps(oy, RT_LOAD8(v0y));
+        __m256 aoz = _mm256_sub_ps(oz, RT_LOAD8(v0z));
+        __m256 temp = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(aox, nx), _mm256_mul_ps(aoy, ny)), _mm256_mul_ps(aoz, nz));
+        __m256 ex = _mm256_sub_ps(_mm256_mul_ps(ndy, aoz), _mm256_mul_ps(ndz, aoy));
+        __m256 ey = _mm256_sub_ps(_mm256_mul_ps(ndz, aox), _mm256_mul_ps(ndx, aoz));
+        __m256 ez = _mm256_sub_ps(_mm256_mul_ps(ndx, aoy), _mm256_mul_ps(ndy, aox));
+        __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(RT_LOAD8(e2x), ex), _mm256_mul_ps(RT_LOAD8(e2y), ey)),
+                                 _mm256_mul_ps(RT_LOAD8(e2z), ez));
+        __m256 w = _mm256_sub_ps(zero, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(RT_LOAD8(e1x), ex), _mm256_mul_ps(RT_LOAD8(e1y), ey)),
+                                                     _mm256_mul_ps(RT_LOAD8(e1z), ez)));
+#undef RT_LOAD8
+        __m256 t = _mm256_div_ps(temp, d);
+        __m256 mask = _mm256_and_ps(_mm256_cmp_ps(d, zero, _CMP_GT_OQ), _mm256_cmp_ps(temp, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(v, d, _CMP_LE_OQ)));
+        mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(w, zero, _CMP_GE_OQ),
+                                                 _mm256_cmp_ps(_mm256_add_ps(v, w), d, _CMP_LE_OQ)));
+        mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(t_max), _CMP_LT_OQ),
+                                                 _mm256_cmp_ps(t, tmin, _CMP_GT_OQ)));
+        int bits = _mm256_movemask_ps(mask);
+        if (b + 1 >= num_blocks) bits &= 0x0F;  // Upper half duplicates the last block
+        if (bits == 0) continue;
+
+        float ts[8];
+        _mm256_storeu_ps(ts, t);
+        for (int lane = 0; lane < 8; ++lane) {
+            if ((bits & (1 << lane)) && ts[lane] < t_max) {
+                t_max = ts[lane];
+                hit_index = 4 * b + lane;
+                hit = true;
+            }
+        }
+    }
+    return hit;
+}
+#endif
+
+// Kernel used for triangle blocks, selected with selectTriangleKernel()
+inline TriangleKernel &triangleKernel()
+{
+    static TriangleKernel kernel = hitTrianglesScalar;
+    return kernel;
+}
+
+// Pick the widest kernel supported by the CPU, or the scalar kernel if SIMD
+// is disabled. Returns the name of the selected kernel.
+inline const char *selectTriangleKernel(bool use_simd)
+{
+    triangleKernel() = hitTrianglesScalar;
+    const char *name = "scalar";
+#if defined(RT_HAVE_X86_SIMD)
+    if (use_simd) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx")) {
+            triangleKernel() = hitTrianglesAVX;
+            name = "AVX";
+        }
+        else if (__builtin_cpu_supports("sse2")) {
+            triangleKernel() = hitTrianglesSSE;
+            name = "SSE";
+        }
+    }
+#endif
+    return name;
+}
+
+} // namespace rt
@@ -5,6 +5,8 @@
 #include <glm/gtx/constants.hpp>
 #include <glm/gtx/quaternion.hpp>
 
+#include "objfile.h"
+
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -13,7 +15,6 @@
 #include <cmath>
 #include <cstdint>
 #include <algorithm>
-#include <map>
 
 // Struct for representing a virtual 3D trackball that can be used for
 // object or camera rotation
@@ -135,49 +136,35 @@ static glm::mat4 trackballGetRotationMatrix(Trackball &trackball)
     return glm::mat4_cast(trackball.qCurrent);
 }
 
-// Read an OBJMesh from an .obj file
-static bool objMeshLoad(OBJMesh &mesh, const std::string &filename)
+// Maps and parses an .obj file (see objfile.h)
+static bool objFileLoad(rt::OBJData &data, const std::string &filename)
 {
-    const std::string VERTEX_LINE("v ");
-    const std::string FACE_LINE("f ");
-
-    // Open OBJ file
-    std::ifstream f(filename.c_str());
-    if (!f.is_open()) {
+    rt::MappedFile file;
+    if (!file.open(filename)) {
         std::cerr << "Could not open " << filename << std::endl;
         return false;
     }
+    if (!rt::parseOBJ(file.data(), file.size(), data)) {
+        std::cerr << "Invalid face in " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Read an OBJMesh from an .obj file. Only vertex positions are read;
+// polygons are split into triangles.
+static bool objMeshLoad(OBJMesh &mesh, const std::string &filename)
+{
+    rt::OBJData data;
+    if (!objFileLoad(data, filename)) return false;
 
     // Extract vertices and indices
-    std::string line;
-    glm::vec3 vertex;
-    std::uint32_t vertexIndex0, vertexIndex1, vertexIndex2;
-    while (!f.eof()) {
-        std::getline(f, line);
-        if (line.substr(0, 2) == VERTEX_LINE) {
-            std::istringstream vertexLine(line.substr(2));
-            vertexLine >> vertex.x;
-            vertexLine >> vertex.y;
-            vertexLine >> vertex.z;
-            mesh.vertices.push_back(vertex);
-        }
-        else if (line.substr(0, 2) == FACE_LINE) {
-            std::istringstream faceLine(line.substr(2));
-            faceLine >> vertexIndex0;
-            faceLine >> vertexIndex1;
-            faceLine >> vertexIndex2;
-            mesh.indices.push_back(vertexIndex0 - 1);
-            mesh.indices.push_back(vertexIndex1 - 1);
-            mesh.indices.push_back(vertexIndex2 - 1);
-        }
-        else {
-            // Ignore line
-        }
+    mesh.vertices.swap(data.positions);
+    mesh.indices.resize(data.corners.size());
+    for (std::size_t i = 0; i < data.corners.size(); ++i) {
+        mesh.indices[i] = data.corners[i].x;
     }
 
-    // Close OBJ file
-    f.close();
-
     // Compute normals
     computeNormals(mesh.vertices, mesh.indices, &mesh.normals);
 
@@ -189,141 +176,28 @@ static bool objMeshLoad(OBJMesh &mesh, const std::string &filename)
     return true;
 }
 
-struct uvec3Less {
-    bool operator() (const glm::uvec3 &a, const glm::uvec3 &b) const
-    {
-        return (a.x < b.x) |
-               ((a.x == b.x) & (a.y < b.y)) |
-               ((a.x == b.x) & (a.y == b.y) & (a.z < b.z));
-    }
-};
-
 // Read an OBJMeshUV from an .obj file. This function can read texture
-// coordinates and/or normals, in addition to vertex positions.
+// coordinates and/or normals, in addition to vertex positions. Each unique
+// combination of position, texture coordinate and normal becomes a vertex.
 static bool objMeshUVLoad(OBJMeshUV &mesh, const std::string &filename)
 {
-    const std::string VERTEX_LINE("v ");
-    const std::string TEXCOORD_LINE("vt ");
-    const std::string NORMAL_LINE("vn ");
-    const std::string FACE_LINE("f ");
-
-    std::string line;
-    glm::vec3 vertex;
-    glm::vec3 normal;
-    glm::vec3 texcoord;
-    std::uint32_t vindex[3];
-    std::uint32_t tindex[3];
-    std::uint32_t nindex[3];
-
-    // Open OBJ file
-    std::ifstream f(filename.c_str());
-    if (!f.is_open()) {
-        std::cerr << "Could not open " << filename << std::endl;
-        return false;
+    rt::OBJData data;
+    if (!objFileLoad(data, filename)) return false;
+
+    std::vector<glm::uvec3> unique;
+    rt::uniqueOBJCorners(data.corners, unique, mesh.indices);
+    bool has_texcoords = false, has_normals = false;
+    for (std::size_t i = 0; i < unique.size(); ++i) {
+        has_texcoords = has_texcoords || unique[i].y != rt::kOBJNoIndex;
+        has_normals = has_normals || unique[i].z != rt::kOBJNoIndex;
     }
-
-    // First pass: read vertex data into temporary mesh
-    OBJMeshUV tmp_mesh;
-    while (!f.eof()) {
-        std::getline(f, line);
-        if (line.substr(0, 2) == VERTEX_LINE) {
-            std::istringstream ss(line.substr(2));
-            ss >> vertex.x >> vertex.y >> vertex.z;
-            tmp_mesh.vertices.push_back(vertex);
-        }
-        else if (line.substr(0, 3) == TEXCOORD_LINE) {
-            std::istringstream ss(line.substr(3));
-            ss >> texcoord.x >> texcoord.y >> texcoord.z;
-            tmp_mesh.texcoords.push_back(texcoord);
-        }
-        else if (line.substr(0, 3) == NORMAL_LINE) {
-            std::istringstream ss(line.substr(3));
-            ss >> normal.x >> normal.y >> normal.z;
-            tmp_mesh.normals.push_back(normal);
-        }
-        else {
-            // Ignore line
-        }
-    }
-
-    // Rewind file
-    f.clear();
-    f.seekg(0);
-
-    // Clear old mesh and pre-allocate space for new mesh data
-    mesh.vertices.clear();
-    mesh.vertices.reserve(tmp_mesh.vertices.size());
-    mesh.texcoords.clear();
-    mesh.texcoords.reserve(tmp_mesh.texcoords.size());
-    mesh.normals.clear();
-    mesh.normals.reserve(tmp_mesh.normals.size());
-    mesh.indices.clear();
-
-    // Set up dictionary for mapping unique tuples to indices
-    std::map<glm::uvec3, unsigned, uvec3Less> visited;
-    unsigned next_index = 0;
-    glm::uvec3 key;
-
-    // Second pass: read faces and construct per-vertex texcoords/normals.
-    // Note: OBJ-indices start at one, so we need to subtract indices by one.
-    while (!f.eof()) {
-        std::getline(f, line);
-        if (line.substr(0, 2) == FACE_LINE) {
-            if (std::sscanf(line.c_str(), "f %d %d %d",
-                            &vindex[0], &vindex[1], &vindex[2]) == 3) {
-                for (unsigned i = 0; i < 3; ++i) {
-                    key = glm::uvec3(vindex[i], 0, 0);
-                    if (visited.count(key) == 0) {
-                        visited[key] = next_index++;
-                        mesh.vertices.push_back(tmp_mesh.vertices[vindex[i] - 1]);
-                    }
-                    mesh.indices.push_back(visited[key]);
-                }
-            }
-            else if (std::sscanf(line.c_str(), "f %d/%d %d/%d %d/%d",
-                                 &vindex[0], &tindex[0],
-                                 &vindex[1], &tindex[1],
-                                 &vindex[2], &tindex[2]) == 6) {
-                for (unsigned i = 0; i < 3; ++i) {
-                    key = glm::uvec3(vindex[i], tindex[i], 0);
-                    if (visited.count(key) == 0) {
-                        visited[key] = next_index++;
-                        mesh.vertices.push_back(tmp_mesh.vertices[vindex[i] - 1]);
-                        mesh.texcoords.push_back(tmp_mesh.texcoords[tindex[i] - 1]);
-                    }
-                    mesh.indices.push_back(visited[key]);
-                }
-            }
-            else if (std::sscanf(line.c_str(), "f %d//%d %d//%d %d//%d",
-                                 &vindex[0], &nindex[0],
-                                 &vindex[1], &nindex[1],
-                                 &vindex[2], &nindex[2]) == 6) {
-                for (unsigned i = 0; i < 3; ++i) {
-                    key = glm::uvec3(vindex[i], nindex[i], 0);
-                    if (visited.count(key) == 0) {
-                        visited[key] = next_index++;
-                        mesh.vertices.push_back(tmp_mesh.vertices[vindex[i] - 1]);
-                        mesh.normals.push_back(tmp_mesh.normals[nindex[i] - 1]);
-                    }
-                    mesh.indices.push_back(visited[key]);
-                }
-            }
-            else if (std::sscanf(line.c_str(), "f %d/%d/%d %d/%d/%d %d/%d/%d",
-                                 &vindex[0], &tindex[0], &nindex[0],
-                                 &vindex[1], &tindex[1], &nindex[1],
-                                 &vindex[2], &tindex[2], &nindex[2]) == 9) {
-                for (unsigned i = 0; i < 3; ++i) {
-                    key = glm::uvec3(vindex[i], tindex[i], nindex[i]);
-                    if (visited.count(key) == 0) {
-                        visited[key] = next_index++;
-                        mesh.vertices.push_back(tmp_mesh.vertices[vindex[i] - 1]);
-                        mesh.texcoords.push_back(tmp_mesh.texcoords[tindex[i] - 1]);
-                        mesh.normals.push_back(tmp_mesh.normals[nindex[i] - 1]);
-                    }
-                    mesh.indices.push_back(visited[key]);
-                }
-            }
-        }
+    mesh.vertices.resize(unique.size());
+    mesh.texcoords.assign(has_texcoords ? unique.size() : 0, glm::vec3(0.0f));
+    mesh.normals.assign(has_normals ? unique.size() : 0, glm::vec3(0.0f));
+    for (std::size_t i = 0; i < unique.size(); ++i) {
+        mesh.vertices[i] = data.positions[unique[i].x];
+        if (unique[i].y != rt::kOBJNoIndex) mesh.texcoords[i] = data.texcoords[unique[i].y];
+        if (unique[i].z != rt::kOBJNoIndex) mesh.normals[i] = data.normals[unique[i].z];
     }
 
     // Compute normals (if OBJ-file did not contain normals)